@@ -0,0 +1,106 @@
+#pragma once
+
+// Shared harness for the benchmark programs: timing helpers and a suite
+// that prints each result and writes them all as JSON, so runs from two
+// builds can be diffed.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+inline double secondsBetween(bench_clock::time_point from, bench_clock::time_point to) {
+	return std::chrono::duration<double>(to - from).count();
+}
+
+inline double percentile(std::vector<double>& samples, double fraction) {
+	if (samples.empty()) return 0.0;
+	std::sort(samples.begin(), samples.end());
+	return samples[size_t(fraction * double(samples.size() - 1) + 0.5)];
+}
+
+// Keep the optimiser from dropping work whose result is never used
+inline volatile uint64_t sink = 0;
+inline void keep(uint64_t value) {
+	sink = sink + value;
+}
+
+// One measured case, `ops` operations took `seconds`
+struct bench_result {
+	std::string name;
+	std::vector<std::pair<std::string, double>> params;
+	uint64_t ops = 0;
+	double seconds = 0.0;
+	std::vector<std::pair<std::string, double>> metrics; // Extra numbers, like latency percentiles
+};
+
+class bench_suite {
+public:
+	bench_suite(std::string filter, bool quick) : filter(std::move(filter)), quick(quick) {}
+
+	bool wants(const std::string& name) const {
+		return filter.empty() || name.find(filter) != std::string::npos;
+	}
+
+	// Scale an iteration count down for --quick runs
+	uint64_t count(uint64_t full) const {
+		return quick ? std::max<uint64_t>(1, full / 20) : full;
+	}
+
+	void add(bench_result result) {
+		std::cerr << result.name;
+		for (const auto& param : result.params) std::cerr << " " << param.first << "=" << param.second;
+		std::cerr << ": " << (result.seconds * 1e9 / double(std::max<uint64_t>(result.ops, 1))) << " ns/op";
+		for (const auto& metric : result.metrics) std::cerr << ", " << metric.first << " " << metric.second;
+		std::cerr << std::endl;
+		results.push_back(std::move(result));
+	}
+
+	void writeJson(std::ostream& out) const {
+		out << "{\n  \"context\": {\"compiler\": \"" << compilerName() << "\", \"optimized\": "
+#ifdef NDEBUG
+			<< "true"
+#else
+			<< "false"
+#endif
+			<< ", \"hardware_threads\": " << std::thread::hardware_concurrency()
+			<< ", \"quick\": " << (quick ? "true" : "false") << "},\n  \"benchmarks\": [";
+		for (size_t i = 0; i < results.size(); i++) {
+			const bench_result& r = results[i];
+			out << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.name << "\", \"params\": {";
+			for (size_t p = 0; p < r.params.size(); p++) {
+				out << (p ? ", " : "") << "\"" << r.params[p].first << "\": " << r.params[p].second;
+			}
+			out << "}, \"ops\": " << r.ops << ", \"seconds\": " << r.seconds
+				<< ", \"ns_per_op\": " << (r.seconds * 1e9 / double(std::max<uint64_t>(r.ops, 1)))
+				<< ", \"ops_per_sec\": " << (r.seconds > 0.0 ? double(r.ops) / r.seconds : 0.0);
+			for (const auto& metric : r.metrics) {
+				out << ", \"" << metric.first << "\": " << metric.second;
+			}
+			out << "}";
+		}
+		out << "\n  ]\n}\n";
+	}
+
+private:
+	static std::string compilerName() {
+#if defined(__clang__)
+		return "clang " __clang_version__;
+#elif defined(__GNUC__)
+		return "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+		return "msvc " + std::to_string(_MSC_VER);
+#else
+		return "unknown";
+#endif
+	}
+
+	std::string filter;
+	bool quick;
+	std::vector<bench_result> results;
+};
@@ -0,0 +1,353 @@
+// Microbenchmarks for the networking core in net_common.hpp. Results are
+// written as JSON so runs from two builds can be diffed.
+#include "bench_suite.hpp"
+#include <net_common.hpp>
+#include <argparse/argparse.hpp>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//--------------------------------------------------------------------------------------
+// message<T> serialization
+//--------------------------------------------------------------------------------------
+
+static void benchMessages(bench_suite& suite) {
+	const size_t payloads[] = { 16, 64, 256, 1024, 4096 };
+	for (size_t payload : payloads) {
+		const uint64_t iterations = suite.count(4000000 / (payload / 16 + 1) + 10000);
+		std::vector<uint8_t> bytes(payload, 0xAB);
+
+		if (suite.wants("message.push_pop")) {
+			// The original operators, one uint32_t at a time in and back out
+			hsc::net::packets::message<CustomMsgTypes> msg;
+			uint32_t value = 0, sum = 0;
+			auto start = bench_clock::now();
+			for (uint64_t i = 0; i < iterations; i++) {
+				msg.body.clear();
+				for (size_t n = 0; n < payload / sizeof(uint32_t); n++) msg << value++;
+				for (size_t n = 0; n < payload / sizeof(uint32_t); n++) { uint32_t out; msg >> out; sum += out; }
+			}
+			double seconds = secondsBetween(start, bench_clock::now());
+			keep(sum);
+			suite.add({ "message.push_pop", { { "payload", double(payload) } }, iterations, seconds,
+				{ { "mb_per_sec", double(payload) * iterations / seconds / 1e6 } } });
+		}
+
+		if (suite.wants("message.writer_reader")) {
+			hsc::net::packets::message<CustomMsgTypes> msg;
+			std::vector<uint8_t> out(payload);
+			auto start = bench_clock::now();
+			for (uint64_t i = 0; i < iterations; i++) {
+				msg.body.clear();
+				hsc::net::packets::message_writer(msg).writeBytes(bytes.data(), bytes.size());
+				hsc::net::packets::message_reader(msg).readBytes(out.data(), out.size());
+			}
+			double seconds = secondsBetween(start, bench_clock::now());
+			keep(out[0]);
+			suite.add({ "message.writer_reader", { { "payload", double(payload) } }, iterations, seconds,
+				{ { "mb_per_sec", double(payload) * iterations / seconds / 1e6 } } });
+		}
+
+		if (suite.wants("message.shared_frame")) {
+			// What every send pays to turn a message into its wire frame
+			hsc::net::packets::message<CustomMsgTypes> msg;
+			hsc::net::packets::message_writer(msg).writeBytes(bytes.data(), bytes.size());
+			auto start = bench_clock::now();
+			for (uint64_t i = 0; i < iterations; i++) {
+				hsc::net::packets::shared_frame<CustomMsgTypes> frame(msg);
+				keep(frame.size());
+			}
+			double seconds = secondsBetween(start, bench_clock::now());
+			suite.add({ "message.shared_frame", { { "payload", double(payload) } }, iterations, seconds, {} });
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------
+// Queues under 1..N producers and one consumer
+//--------------------------------------------------------------------------------------
+
+template <typename Push, typename Pop>
+static double runProducers(size_t producers, uint64_t perProducer, Push push, Pop pop) {
+	std::atomic<bool> go{ false };
+	std::vector<std::thread> threads;
+	for (size_t p = 0; p < producers; p++) {
+		threads.emplace_back([&, p]() {
+			while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+			for (uint64_t i = 0; i < perProducer; i++) push(p * perProducer + i);
+		});
+	}
+	const uint64_t total = producers * perProducer;
+	auto start = bench_clock::now();
+	go.store(true, std::memory_order_release);
+	for (uint64_t got = 0; got < total;) {
+		if (pop()) got++;
+		else std::this_thread::yield();
+	}
+	double seconds = secondsBetween(start, bench_clock::now());
+	for (auto& thread : threads) thread.join();
+	return seconds;
+}
+
+static void benchQueues(bench_suite& suite) {
+	size_t maxProducers = std::max<size_t>(4, std::thread::hardware_concurrency());
+	for (size_t producers = 1; producers <= maxProducers; producers *= 2) {
+		const uint64_t perProducer = suite.count(2000000) / producers;
+		const uint64_t total = perProducer * producers;
+
+		if (suite.wants("queue.thread_safe_queue")) {
+			hsc::queues::thread_safe_queue<uint64_t> queue;
+			double seconds = runProducers(producers, perProducer,
+				[&](uint64_t v) { queue.push_back(v); },
+				[&]() { if (queue.empty()) return false; keep(queue.pop_front()); return true; });
+			suite.add({ "queue.thread_safe_queue", { { "producers", double(producers) } }, total, seconds, {} });
+		}
+
+		if (suite.wants("queue.mpsc_queue")) {
+			hsc::queues::mpsc_queue<uint64_t> queue(1 << 16);
+			double seconds = runProducers(producers, perProducer,
+				[&](uint64_t v) { while (!queue.try_push(std::move(v))) std::this_thread::yield(); },
+				[&]() { uint64_t v; if (!queue.try_pop(v)) return false; keep(v); return true; });
+			suite.add({ "queue.mpsc_queue", { { "producers", double(producers) } }, total, seconds, {} });
+		}
+	}
+
+	if (suite.wants("queue.spsc_queue")) {
+		const uint64_t total = suite.count(2000000);
+		hsc::queues::spsc_queue<uint64_t> queue(1 << 16);
+		double seconds = runProducers(1, total,
+			[&](uint64_t v) { while (!queue.try_push(std::move(v))) std::this_thread::yield(); },
+			[&]() { uint64_t v; if (!queue.try_pop(v)) return false; keep(v); return true; });
+		suite.add({ "queue.spsc_queue", { { "producers", 1.0 } }, total, seconds, {} });
+	}
+}
+
+//--------------------------------------------------------------------------------------
+// Connections over loopback
+//--------------------------------------------------------------------------------------
+
+// Echoes pings and counts everything else
+class BenchServer : public hsc::net::server_interface<CustomMsgTypes>
+{
+public:
+	BenchServer(uint16_t port) : hsc::net::server_interface<CustomMsgTypes>(port, "127.0.0.1") {}
+
+	std::atomic<uint64_t> received{ 0 };
+	std::atomic<uint32_t> validated{ 0 };
+
+protected:
+	bool onClientConnect(std::shared_ptr<hsc::net::connection<CustomMsgTypes>> client) override {
+		return true;
+	}
+
+	void onClientValidates(std::shared_ptr<hsc::net::connection<CustomMsgTypes>> client) override {
+		validated++;
+	}
+
+	void onMessage(std::shared_ptr<hsc::net::connection<CustomMsgTypes>> client, hsc::net::packets::message<CustomMsgTypes>& msg) override {
+		if (msg.header.id == CustomMsgTypes::Server_GetPing) {
+			client->send(msg);
+		}
+		received++;
+	}
+};
+
+// Runs the server's update loop until destroyed
+class server_runner {
+public:
+	explicit server_runner(BenchServer& server) : server(server) {
+		thread = std::thread([this]() {
+			while (running.load(std::memory_order_relaxed)) {
+				this->server.updateUntil(bench_clock::now() + std::chrono::milliseconds(5));
+			}
+		});
+	}
+
+	~server_runner() {
+		running = false;
+		thread.join();
+	}
+
+private:
+	BenchServer& server;
+	std::atomic<bool> running{ true };
+	std::thread thread;
+};
+
+static bool waitFor(const std::function<bool()>& done, double timeoutSeconds) {
+	auto until = bench_clock::now() + std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>(timeoutSeconds));
+	while (!done()) {
+		if (bench_clock::now() > until) return false;
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+	return true;
+}
+
+static void benchLoopback(bench_suite& suite, uint16_t port) {
+	if (!suite.wants("connection.")) return;
+
+	BenchServer server(port);
+	if (!server.start()) return;
+	server_runner runner(server);
+
+	hsc::net::client_interface<CustomMsgTypes> client;
+	if (!client.connect("127.0.0.1", port) || !waitFor([&]() { return server.validated == 1; }, 5.0)) {
+		std::cerr << "Loopback benchmark could not connect" << std::endl;
+		return;
+	}
+
+	const size_t payloads[] = { 64, 1024, 16384 };
+	for (size_t payload : payloads) {
+		if (!suite.wants("connection.throughput")) break;
+		const uint64_t messages = suite.count(200000 / (payload / 64 + 1) + 1000);
+		hsc::net::packets::message<CustomMsgTypes> msg;
+		msg.header.id = CustomMsgTypes::Plugin_Message;
+		std::vector<uint8_t> bytes(payload, 0x5A);
+		hsc::net::packets::message_writer(msg).writeBytes(bytes.data(), bytes.size());
+
+		uint64_t before = server.received;
+		auto start = bench_clock::now();
+		for (uint64_t i = 0; i < messages; i++) client.send(msg);
+		bool finished = waitFor([&]() { return server.received - before >= messages; }, 30.0);
+		double seconds = secondsBetween(start, bench_clock::now());
+		if (!finished) std::cerr << "Throughput run timed out" << std::endl;
+		suite.add({ "connection.throughput", { { "payload", double(payload) } }, messages, seconds,
+			{ { "mb_per_sec", double(messages) * (payload + sizeof(msg.header)) / seconds / 1e6 } } });
+	}
+
+	if (suite.wants("connection.latency")) {
+		const uint64_t roundTrips = suite.count(20000);
+		hsc::net::packets::message<CustomMsgTypes> ping;
+		ping.header.id = CustomMsgTypes::Server_GetPing;
+		hsc::net::packets::message_writer(ping).write(uint64_t(0));
+		std::vector<double> micros;
+		micros.reserve(roundTrips);
+		hsc::net::packets::owned_message<CustomMsgTypes> pong;
+		auto start = bench_clock::now();
+		for (uint64_t i = 0; i < roundTrips; i++) {
+			auto sent = bench_clock::now();
+			client.send(ping);
+			while (!client.messagesToUs().try_pop(pong)) {
+				client.messagesToUs().wait_until(bench_clock::now() + std::chrono::milliseconds(100));
+			}
+			micros.push_back(secondsBetween(sent, bench_clock::now()) * 1e6);
+		}
+		double seconds = secondsBetween(start, bench_clock::now());
+		double p50 = percentile(micros, 0.5), p99 = percentile(micros, 0.99), worst = percentile(micros, 1.0);
+		suite.add({ "connection.latency", {}, roundTrips, seconds,
+			{ { "p50_us", p50 }, { "p99_us", p99 }, { "max_us", worst } } });
+	}
+
+	client.disconnect();
+	server.stop();
+}
+
+// One server broadcasting to many clients that share an io_context
+static void benchFanOut(bench_suite& suite, uint16_t port) {
+	const size_t clientCounts[] = { 10, 100, 1000 };
+	for (size_t clientCount : clientCounts) {
+		if (!suite.wants("server.send_all")) return;
+
+		const uint16_t serverPort = port++;
+		BenchServer server(serverPort);
+		if (!server.start()) continue;
+		server_runner runner(server);
+
+		asio::io_context context;
+		auto idleWork = asio::make_work_guard(context);
+		std::vector<std::thread> threads;
+		for (unsigned i = 0; i < std::max(2u, std::thread::hardware_concurrency() / 2); i++) {
+			threads.emplace_back([&context]() { context.run(); });
+		}
+
+		std::vector<std::unique_ptr<hsc::net::client_interface<CustomMsgTypes>>> clients;
+		for (size_t i = 0; i < clientCount; i++) {
+			clients.push_back(std::make_unique<hsc::net::client_interface<CustomMsgTypes>>(context));
+			clients.back()->connect("127.0.0.1", serverPort);
+		}
+
+		if (waitFor([&]() { return server.validated == clientCount; }, 30.0)) {
+			const uint64_t broadcasts = suite.count(200);
+			hsc::net::packets::message<CustomMsgTypes> msg;
+			msg.header.id = CustomMsgTypes::Plugin_Message;
+			hsc::net::packets::message_writer(msg).write(uint64_t(0), uint64_t(0), uint64_t(0), uint64_t(0));
+
+			const uint64_t expected = broadcasts * clientCount;
+			uint64_t delivered = 0;
+			hsc::net::packets::owned_message<CustomMsgTypes> in;
+			auto start = bench_clock::now();
+			for (uint64_t i = 0; i < broadcasts; i++) server.sendMessageAll(msg);
+			auto queued = bench_clock::now();
+			waitFor([&]() {
+				for (auto& client : clients) {
+					while (client->messagesToUs().try_pop(in)) delivered++;
+				}
+				return delivered >= expected;
+			}, 60.0);
+			auto done = bench_clock::now();
+
+			suite.add({ "server.send_all", { { "clients", double(clientCount) } }, delivered, secondsBetween(start, done),
+				{ { "call_us", secondsBetween(start, queued) * 1e6 / double(broadcasts) },
+				  { "broadcast_ms", secondsBetween(start, done) * 1e3 / double(broadcasts) } } });
+		}
+		else {
+			std::cerr << "Only " << server.validated << " of " << clientCount << " clients connected" << std::endl;
+		}
+
+		// Stop the shared context before the clients go, its handlers point at them
+		for (auto& client : clients) client->disconnect();
+		idleWork.reset();
+		context.stop();
+		for (auto& thread : threads) thread.join();
+		clients.clear();
+		server.stop();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	argparse::ArgumentParser program("History Survival network benchmarks");
+	program.add_argument("--out")
+		.help("File to write the JSON results to")
+		.default_value(std::string("net_bench.json"));
+	program.add_argument("--filter")
+		.help("Only run benchmarks whose name contains this")
+		.default_value(std::string(""));
+	program.add_argument("--quick")
+		.help("Far fewer iterations, for a smoke test")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("--port")
+		.help("First loopback port to use")
+		.default_value(int(36700))
+		.scan<'i', int>();
+	try {
+		program.parse_args(argc, argv);
+	}
+	catch (const std::runtime_error& err) {
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	bench_suite suite(program.get<std::string>("--filter"), program.get<bool>("--quick"));
+	const uint16_t port = uint16_t(program.get<int>("--port"));
+
+	benchMessages(suite);
+	benchQueues(suite);
+	benchLoopback(suite, port);
+	benchFanOut(suite, uint16_t(port + 1));
+
+	const std::string path = program.get<std::string>("--out");
+	std::ofstream out(path);
+	if (!out) {
+		std::cerr << "Could not write " << path << std::endl;
+		return 1;
+	}
+	suite.writeJson(out);
+	std::cerr << "Results written to " << path << std::endl;
+	return 0;
+}
@@ -0,0 +1,226 @@
+// Mouse picking benchmark: raylib's brute force GetRayCollisionMesh over
+// every mesh of a model against asset_manager::raycast, which picks through
+// the BVHs its workers build, on every shipped OBJ model. Also checks both
+// give the same hits. Opens a hidden window for the asset manager's uploads.
+#include "bench_suite.hpp"
+#include <asset_manager.hpp>
+#include <mesh_bvh.hpp>
+#include <obj_loader.hpp>
+#include <argparse/argparse.hpp>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+// One mesh of a model as raylib's brute force test reads it
+struct pick_mesh {
+	std::vector<float> positions;
+	std::vector<uint16_t> indices;
+	Mesh mesh = { 0 }; // Points into positions and indices, raylib only reads it
+};
+
+// Every mesh of a model, and the same model resident in the asset manager
+struct pick_model {
+	std::string name;
+	std::vector<pick_mesh> meshes;
+	hsc::assets::mesh_bounds bounds;
+	hsc::assets::model_id id = 0;
+	size_t triangles = 0;
+};
+
+static bool loadModel(const std::string& path, const std::string& name, pick_model& out) {
+	hsc::assets::obj_scene scene;
+	std::string error;
+	if (!hsc::assets::parseObj(path, scene, error)) {
+		std::cerr << error << std::endl;
+		return false;
+	}
+	out.name = name;
+	out.meshes.resize(scene.meshes.size());
+	for (size_t m = 0; m < scene.meshes.size(); m++) {
+		const hsc::assets::obj_mesh& mesh = scene.meshes[m];
+		pick_mesh& into = out.meshes[m];
+		for (const hsc::assets::mesh_vertex& vertex : mesh.vertices) {
+			into.positions.insert(into.positions.end(), vertex.position, vertex.position + 3);
+		}
+		into.indices.assign(mesh.indices.begin(), mesh.indices.end());
+		into.mesh.vertexCount = int(mesh.vertices.size());
+		into.mesh.triangleCount = int(into.indices.size() / 3);
+		into.mesh.vertices = into.positions.data();
+		into.mesh.indices = into.indices.data();
+		out.triangles += into.indices.size() / 3;
+
+		hsc::assets::mesh_bounds bounds = hsc::assets::boundsOf(mesh.vertices);
+		for (int i = 0; i < 3; i++) {
+			out.bounds.min[i] = m == 0 ? bounds.min[i] : std::min(out.bounds.min[i], bounds.min[i]);
+			out.bounds.max[i] = m == 0 ? bounds.max[i] : std::max(out.bounds.max[i], bounds.max[i]);
+		}
+	}
+	return true;
+}
+
+// The closest hit over every mesh, what raylib's GetRayCollisionModel does
+static RayCollision bruteForce(const pick_model& model, Ray ray, Matrix transform) {
+	RayCollision closest = { 0 };
+	for (const pick_mesh& mesh : model.meshes) {
+		RayCollision hit = GetRayCollisionMesh(ray, mesh.mesh, transform);
+		if (hit.hit && (!closest.hit || hit.distance < closest.distance)) closest = hit;
+	}
+	return closest;
+}
+
+// Rays from outside the model through random points in its bounds, like a
+// cursor sweeping over it. Every tenth looks straight down.
+static std::vector<Ray> makeRays(const hsc::assets::mesh_bounds& bounds, size_t count) {
+	std::mt19937 random(1234);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::vector<Ray> rays;
+	for (size_t i = 0; i < count; i++) {
+		Vector3 target = {
+			bounds.min[0] + unit(random) * (bounds.max[0] - bounds.min[0]),
+			bounds.min[1] + unit(random) * (bounds.max[1] - bounds.min[1]),
+			bounds.min[2] + unit(random) * (bounds.max[2] - bounds.min[2])
+		};
+		Vector3 direction = Vector3Normalize({ unit(random) - 0.5f, unit(random) - 0.5f, unit(random) - 0.5f });
+		if (i % 10 == 0) direction = { 0.0f, -1.0f, 0.0f };
+		rays.push_back({ Vector3Subtract(target, Vector3Scale(direction, 200.0f)), direction });
+	}
+	return rays;
+}
+
+static bool sameHit(const RayCollision& a, const RayCollision& b) {
+	if (a.hit != b.hit) return false;
+	if (!a.hit) return true;
+	return std::fabs(a.distance - b.distance) <= 1e-3f * std::max(1.0f, a.distance) && Vector3DotProduct(a.normal, b.normal) > 0.999f;
+}
+
+// Returns the rays whose hit differs, so a broken pick path fails the run
+static size_t benchModel(bench_suite& suite, hsc::assets::asset_manager& assets, const pick_model& model, size_t rayCount) {
+	const double triangles = double(model.triangles);
+	const std::vector<Ray> rays = makeRays(model.bounds, rayCount);
+	const Matrix identity = MatrixIdentity();
+
+	if (suite.wants("pick.build." + model.name)) {
+		const uint64_t builds = suite.count(20);
+		hsc::spatial::mesh_bvh bvh;
+		size_t nodes = 0, packets = 0;
+		auto started = bench_clock::now();
+		for (uint64_t i = 0; i < builds; i++) {
+			nodes = packets = 0;
+			for (const pick_mesh& mesh : model.meshes) {
+				bvh.build(mesh.positions.data(), sizeof(float) * 3, uint32_t(mesh.mesh.vertexCount), mesh.indices.data(), uint32_t(mesh.indices.size()));
+				nodes += bvh.getNodeCount();
+				packets += bvh.getPacketCount();
+			}
+			keep(nodes);
+		}
+		bench_result result{ "pick.build." + model.name, { { "triangles", triangles } }, builds, secondsBetween(started, bench_clock::now()) };
+		result.metrics = { { "nodes", double(nodes) }, { "packets", double(packets) } };
+		suite.add(std::move(result));
+	}
+
+	std::vector<RayCollision> expected(rays.size());
+	auto started = bench_clock::now();
+	for (size_t i = 0; i < rays.size(); i++) expected[i] = bruteForce(model, rays[i], identity);
+	if (suite.wants("pick.raylib." + model.name)) {
+		suite.add({ "pick.raylib." + model.name, { { "triangles", triangles } }, rays.size(), secondsBetween(started, bench_clock::now()) });
+	}
+
+	std::vector<RayCollision> got(rays.size());
+	started = bench_clock::now();
+	for (size_t i = 0; i < rays.size(); i++) got[i] = assets.raycast(model.id, rays[i], identity);
+	bench_result result{ "pick.bvh." + model.name, { { "triangles", triangles } }, rays.size(), secondsBetween(started, bench_clock::now()) };
+
+	size_t hits = 0, mismatches = 0;
+	for (size_t i = 0; i < rays.size(); i++) {
+		hits += expected[i].hit;
+		mismatches += !sameHit(expected[i], got[i]);
+	}
+	result.metrics = { { "hit_rate", double(hits) / double(rays.size()) }, { "mismatches", double(mismatches) } };
+	if (suite.wants("pick.bvh." + model.name)) suite.add(std::move(result));
+	if (mismatches > 0) std::cerr << model.name << ": " << mismatches << " of " << rays.size() << " rays hit differently" << std::endl;
+	return mismatches;
+}
+
+int main(int argc, char* argv[])
+{
+	argparse::ArgumentParser program("History Survival picking benchmarks");
+	program.add_argument("--out")
+		.help("File to write the JSON results to")
+		.default_value(std::string("pick_bench.json"));
+	program.add_argument("--filter")
+		.help("Only run benchmarks whose name contains this")
+		.default_value(std::string(""));
+	program.add_argument("--quick")
+		.help("Far fewer iterations, for a smoke test")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("--models")
+		.help("Directory holding the OBJ models")
+		.default_value(std::string("resources/models/obj"));
+	program.add_argument("--rays")
+		.help("Rays cast at each model")
+		.default_value(int(2000))
+		.scan<'i', int>();
+	try {
+		program.parse_args(argc, argv);
+	}
+	catch (const std::runtime_error& err) {
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	bench_suite suite(program.get<std::string>("--filter"), program.get<bool>("--quick"));
+	const std::string models = program.get<std::string>("--models");
+	const size_t rays = size_t(suite.count(uint64_t(program.get<int>("--rays"))));
+
+	SetTraceLogLevel(LOG_WARNING);
+	SetConfigFlags(FLAG_WINDOW_HIDDEN);
+	InitWindow(64, 64, "pick-bench");
+	size_t mismatches = 0;
+	{
+		// Parse the OBJs, the same source the brute force meshes come from
+		hsc::assets::asset_manager assets("");
+		const char* names[] = { "cube", "well", "turret", "bridge", "house", "plane", "market", "castle" };
+		std::vector<pick_model> loaded;
+		for (const char* name : names) {
+			pick_model model;
+			if (!loadModel(models + "/" + name + ".obj", name, model)) return 1;
+			model.id = assets.acquireModel(models + "/" + name + ".obj");
+			loaded.push_back(std::move(model));
+		}
+		auto resident = [&]() {
+			for (const pick_model& model : loaded) {
+				hsc::assets::asset_state state = assets.getState(model.id);
+				if (state == hsc::assets::asset_state::failed) return true;
+				if (state != hsc::assets::asset_state::resident) return false;
+			}
+			return true;
+		};
+		while (!resident()) {
+			assets.update(1000.0);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		for (const pick_model& model : loaded) {
+			if (assets.getState(model.id) != hsc::assets::asset_state::resident) {
+				std::cerr << model.name << " failed to load" << std::endl;
+				return 1;
+			}
+			mismatches += benchModel(suite, assets, model, rays);
+		}
+		assets.shutdown();
+	}
+	CloseWindow();
+
+	const std::string path = program.get<std::string>("--out");
+	std::ofstream out(path);
+	if (!out) {
+		std::cerr << "Could not write " << path << std::endl;
+		return 1;
+	}
+	suite.writeJson(out);
+	std::cerr << "Results written to " << path << std::endl;
+	return mismatches > 0 ? 1 : 0;
+}
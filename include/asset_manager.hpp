@@ -0,0 +1,426 @@
+#pragma once
+
+#ifndef ASSET_MANAGER_H
+#define ASSET_MANAGER_H 1
+
+#include "raylib.h"
+#include <mesh_bvh.hpp>
+#include <model_loader.hpp>
+#include <queues.hpp>
+#include <texture_loader.hpp>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace hsc {
+	namespace assets {
+		using model_id = uint32_t;
+		using texture_id = uint32_t;
+
+		enum class asset_state {
+			unloaded,
+			loading,  //Queued or being decoded by a worker
+			resident, //Uploaded, draws use it
+			failed
+		};
+
+		struct asset_stats {
+			size_t loading = 0;
+			size_t resident = 0;
+			size_t streaming = 0; //Resident textures with finer levels still to upload
+			size_t uploadsLastFrame = 0;
+		};
+
+		//Loads models and textures in the background. Workers read and decode
+		//files, the render thread only does the GPU uploads, a few per frame
+		//in update(). Until an asset is resident its getter returns a
+		//placeholder so callers can draw straight away. Cooked textures go up
+		//with their coarse levels first and spare upload time in later frames
+		//swaps in finer ones a level at a time.
+		//
+		//Assets are shared by path and reference counted, acquiring one that
+		//is already known only bumps its count and release unloads it when
+		//the last user lets go. Everything but the workers runs on the render
+		//thread, so the entries need no locking.
+		class asset_manager {
+		public:
+			//Needs the window (and GL context) to exist for the placeholders.
+			//Cooked files are looked for in `cookedDir`, empty parses the sources.
+			asset_manager(std::string cookedDir = default_cooked_dir, size_t workerCount = std::max(1u, std::thread::hardware_concurrency() / 2)) : cookedDir(std::move(cookedDir)) {
+				placeholderModel = LoadModelFromMesh(GenMeshCube(1.0f, 1.0f, 1.0f));
+				Image checks = GenImageChecked(16, 16, 4, 4, MAGENTA, BLACK);
+				placeholderTexture = LoadTextureFromImage(checks);
+				UnloadImage(checks);
+
+				for (size_t i = 0; i < workerCount; i++) workers.emplace_back([this]() { work(); });
+			}
+
+			asset_manager(const asset_manager&) = delete;
+			asset_manager& operator=(const asset_manager&) = delete;
+
+			~asset_manager() {
+				shutdown();
+			}
+
+			//Stops the workers and unloads everything, call before CloseWindow
+			void shutdown() {
+				{
+					std::scoped_lock lock(muxJobs);
+					if (stopping) return;
+					stopping = true;
+					jobs.clear();
+				}
+				cvJobs.notify_all();
+				for (std::thread& worker : workers) worker.join();
+				workers.clear();
+
+				decoded result;
+				while (results.try_pop(result)) discard(result);
+				for (model_entry& entry : models) {
+					if (entry.state == asset_state::resident) unloadLevels(entry);
+					entry.state = asset_state::unloaded;
+				}
+				for (texture_entry& entry : textures) {
+					if (entry.state == asset_state::resident) UnloadTexture(entry.texture);
+					entry.file.close();
+					entry.state = asset_state::unloaded;
+				}
+				streaming.clear();
+				UnloadModel(placeholderModel);
+				UnloadTexture(placeholderTexture);
+			}
+
+			model_id acquireModel(const std::string& path) {
+				return acquire(models, modelIDs, path, job_kind::model);
+			}
+
+			texture_id acquireTexture(const std::string& path) {
+				return acquire(textures, textureIDs, path, job_kind::texture);
+			}
+
+			void releaseModel(model_id id) {
+				model_entry& entry = models[id];
+				if (entry.refs == 0 || --entry.refs > 0) return;
+				if (entry.state == asset_state::resident) {
+					unloadLevels(entry);
+					entry.picking.meshes.clear();
+					entry.state = asset_state::unloaded;
+				}
+				else if (entry.state == asset_state::failed) entry.state = asset_state::unloaded;
+				//Still loading: update() throws the result away when it arrives
+			}
+
+			void releaseTexture(texture_id id) {
+				texture_entry& entry = textures[id];
+				if (entry.refs == 0 || --entry.refs > 0) return;
+				if (entry.state == asset_state::resident) {
+					UnloadTexture(entry.texture);
+					entry.file.close(); //Drops it from streaming too
+					entry.state = asset_state::unloaded;
+				}
+				else if (entry.state == asset_state::failed) entry.state = asset_state::unloaded;
+			}
+
+			//Uploads what the workers finished until budgetMs is spent, at
+			//least one asset a frame so loading always makes progress. Time
+			//left over streams finer texture levels, new assets come first.
+			void update(double budgetMs = 2.0) {
+				auto started = std::chrono::steady_clock::now();
+				auto spentMs = [&]() { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count(); };
+				stats.uploadsLastFrame = 0;
+				decoded result;
+				while (results.try_pop(result)) {
+					upload(result);
+					stats.uploadsLastFrame++;
+					if (spentMs() >= budgetMs) return;
+				}
+				while (!streaming.empty() && spentMs() < budgetMs) streamNext();
+			}
+
+			asset_state getState(model_id id) const {
+				return models[id].state;
+			}
+
+			asset_state getTextureState(texture_id id) const {
+				return textures[id].state;
+			}
+
+			//The model, or a unit cube until it is resident. Levels of detail
+			//past what the model has give its coarsest.
+			const Model& getModel(model_id id, int lod = 0) const {
+				const model_entry& entry = models[id];
+				if (entry.state != asset_state::resident) return placeholderModel;
+				if (lod <= 0 || entry.lods.empty()) return entry.model;
+				return entry.lods[std::min(size_t(lod), entry.lods.size()) - 1];
+			}
+
+			//How far each level of detail may be from the full model, in model
+			//units. Just the full model's 0 until resident or without levels.
+			const std::vector<float>& getLodErrors(model_id id) const {
+				const model_entry& entry = models[id];
+				return entry.state == asset_state::resident ? entry.lodErrors : fullDetailOnly;
+			}
+
+			//Model space bounds, the placeholder's until resident
+			BoundingBox getBounds(model_id id) const {
+				const model_entry& entry = models[id];
+				if (entry.state == asset_state::resident) return entry.bounds;
+				return { { -0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, 0.5f } };
+			}
+
+			//The texture, or a checkerboard until it is resident
+			Texture2D getTexture(texture_id id) const {
+				const texture_entry& entry = textures[id];
+				return entry.state == asset_state::resident ? entry.texture : placeholderTexture;
+			}
+
+			//Picks a model placed with transform, through its BVH once resident
+			//and against the placeholder cube before that
+			RayCollision raycast(model_id id, Ray ray, Matrix transform = MatrixIdentity()) const {
+				const model_entry& entry = models[id];
+				if (entry.state == asset_state::resident) return entry.picking.raycast(ray, transform);
+				Model placeholder = placeholderModel;
+				placeholder.transform = transform;
+				return GetRayCollisionModel(ray, placeholder);
+			}
+
+			asset_stats getStats() const {
+				asset_stats current = stats;
+				current.loading = current.resident = current.streaming = 0;
+				for (const model_entry& entry : models) count(entry.state, current);
+				for (const texture_entry& entry : textures) {
+					count(entry.state, current);
+					if (entry.state == asset_state::resident && entry.file.isOpen()) current.streaming++;
+				}
+				return current;
+			}
+
+		private:
+			enum class job_kind { model, texture };
+
+			struct job {
+				job_kind kind;
+				uint32_t id;
+				std::string path;
+			};
+
+			//What a worker hands back for upload
+			struct decoded {
+				job_kind kind = job_kind::model;
+				uint32_t id = 0;
+				bool ok = false;
+				double decodeMs = 0.0;
+				model_data model;
+				spatial::model_bvh picking;
+				texture_data texture;
+			};
+
+			struct model_entry {
+				std::string path;
+				uint32_t refs = 0;
+				asset_state state = asset_state::unloaded;
+				Model model = { 0 };
+				std::vector<Model> lods; //Levels 1 and up
+				std::vector<float> lodErrors;
+				BoundingBox bounds = { 0 };
+				spatial::model_bvh picking;
+			};
+
+			struct texture_entry {
+				std::string path;
+				uint32_t refs = 0;
+				asset_state state = asset_state::unloaded;
+				Texture2D texture = { 0 };
+				cooked_texture_file file; //Mapped until its finest level is up
+				uint32_t finest = 0;      //Finest level uploaded
+			};
+
+			template <typename Entry>
+			uint32_t acquire(std::vector<Entry>& entries, std::unordered_map<std::string, uint32_t>& ids, const std::string& path, job_kind kind) {
+				auto found = ids.find(path);
+				uint32_t id;
+				if (found == ids.end()) {
+					id = uint32_t(entries.size());
+					entries.emplace_back();
+					entries.back().path = path;
+					ids.emplace(path, id);
+				}
+				else id = found->second;
+
+				Entry& entry = entries[id];
+				entry.refs++;
+				if (entry.state == asset_state::unloaded) {
+					entry.state = asset_state::loading;
+					{
+						std::scoped_lock lock(muxJobs);
+						jobs.push_back({ kind, id, path });
+					}
+					cvJobs.notify_one();
+				}
+				return id;
+			}
+
+			void work() {
+				while (true) {
+					job next;
+					{
+						std::unique_lock<std::mutex> lock(muxJobs);
+						cvJobs.wait(lock, [this]() { return stopping || !jobs.empty(); });
+						if (stopping) return;
+						next = std::move(jobs.front());
+						jobs.pop_front();
+					}
+
+					auto started = std::chrono::steady_clock::now();
+					decoded result;
+					result.kind = next.kind;
+					result.id = next.id;
+					if (next.kind == job_kind::model) {
+						std::string error;
+						result.ok = readModel(next.path, result.model, cookedDir, &error);
+						if (result.ok) buildPicking(result.model, result.picking);
+						else TraceLog(LOG_WARNING, "MODEL: [%s] Failed to load: %s", next.path.c_str(), error.c_str());
+					}
+					else {
+						std::string error;
+						result.ok = readTexture(next.path, result.texture, cookedDir, &error);
+						if (!result.ok) TraceLog(LOG_WARNING, "TEXTURE: [%s] Failed to load: %s", next.path.c_str(), error.c_str());
+					}
+					result.decodeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+					if (!deliver(result)) return;
+				}
+			}
+
+			//Hand a result to the render thread. While results is full wait
+			//for it to drain, but give up if shutdown starts, it joins us
+			//before it drains anything.
+			bool deliver(decoded& result) {
+				while (!results.try_push(std::move(result))) {
+					std::unique_lock<std::mutex> lock(muxJobs);
+					if (cvJobs.wait_for(lock, std::chrono::milliseconds(1), [this]() { return stopping; })) {
+						discard(result);
+						return false;
+					}
+				}
+				return true;
+			}
+
+			void upload(decoded& result) {
+				auto started = std::chrono::steady_clock::now();
+				if (result.kind == job_kind::model) {
+					model_entry& entry = models[result.id];
+					if (entry.refs == 0) {
+						entry.state = asset_state::unloaded;
+						return;
+					}
+					if (!result.ok) {
+						entry.state = asset_state::failed;
+						return;
+					}
+					entry.model = uploadModel(result.model);
+					for (const std::vector<model_data::part>& lod : result.model.lods) entry.lods.push_back(uploadModel(lod));
+					entry.lodErrors = result.model.lodErrors;
+					entry.bounds = toBoundingBox(result.model.bounds);
+					entry.picking = std::move(result.picking);
+					entry.state = asset_state::resident;
+					TraceLog(LOG_INFO, "MODEL: [%s] %s in %.2f ms on a worker, uploaded in %.2f ms", entry.path.c_str(),
+						result.model.cooked ? "Mapped cooked mesh" : "Parsed OBJ", result.decodeMs,
+						std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count());
+				}
+				else {
+					texture_entry& entry = textures[result.id];
+					if (entry.refs == 0 || !result.ok) {
+						discard(result);
+						entry.state = entry.refs == 0 ? asset_state::unloaded : asset_state::failed;
+						return;
+					}
+					if (result.texture.cooked) {
+						entry.finest = firstStreamedLevel(result.texture.file);
+						entry.texture = uploadLevels(result.texture.file, entry.finest, streamScratch);
+						if (entry.finest > 0) {
+							entry.file = std::move(result.texture.file);
+							if (std::find(streaming.begin(), streaming.end(), result.id) == streaming.end()) streaming.push_back(result.id);
+						}
+					}
+					else {
+						entry.texture = LoadTextureFromImage(result.texture.image);
+						UnloadImage(result.texture.image);
+						result.texture.image = { 0 };
+					}
+					entry.state = asset_state::resident;
+					TraceLog(LOG_INFO, "TEXTURE: [%s] %s in %.2f ms on a worker, uploaded %ix%i in %.2f ms", entry.path.c_str(),
+						result.texture.cooked ? "Mapped cooked texture" : "Decoded image", result.decodeMs, entry.texture.width, entry.texture.height,
+						std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count());
+				}
+			}
+
+			//Replaces the first streaming texture with one a level finer and
+			//puts it to the back of the line if it has further to go
+			void streamNext() {
+				texture_id id = streaming.front();
+				streaming.pop_front();
+				texture_entry& entry = textures[id];
+				if (entry.state != asset_state::resident || !entry.file.isOpen()) return; //Released since
+				Texture2D finer = uploadLevels(entry.file, entry.finest - 1, streamScratch);
+				UnloadTexture(entry.texture);
+				entry.texture = finer;
+				entry.finest--;
+				if (entry.finest > 0) streaming.push_back(id);
+				else entry.file.close();
+			}
+
+			//Built on the worker too, a big model's BVH takes a few milliseconds
+			static void buildPicking(const model_data& model, spatial::model_bvh& picking) {
+				picking.meshes.resize(model.parts.size());
+				for (size_t m = 0; m < model.parts.size(); m++) {
+					const model_data::part& part = model.parts[m];
+					picking.meshes[m].build(part.vertices[0].position, sizeof(mesh_vertex), part.vertexCount, part.indices, part.indexCount);
+				}
+			}
+
+			static void unloadLevels(model_entry& entry) {
+				UnloadModel(entry.model);
+				for (Model& lod : entry.lods) UnloadModel(lod);
+				entry.lods.clear();
+			}
+
+			static void discard(decoded& result) {
+				if (result.texture.image.data != nullptr) UnloadImage(result.texture.image);
+				result.texture.image = { 0 };
+			}
+
+			static void count(asset_state state, asset_stats& into) {
+				if (state == asset_state::loading) into.loading++;
+				else if (state == asset_state::resident) into.resident++;
+			}
+
+			const std::string cookedDir;
+			Model placeholderModel;
+			Texture2D placeholderTexture;
+			const std::vector<float> fullDetailOnly = { 0.0f };
+
+			std::vector<model_entry> models;
+			std::vector<texture_entry> textures;
+			std::unordered_map<std::string, uint32_t> modelIDs;
+			std::unordered_map<std::string, uint32_t> textureIDs;
+			asset_stats stats;
+			std::deque<texture_id> streaming; //Textures with finer levels to upload, in turn
+			std::vector<uint8_t> streamScratch;
+
+			std::vector<std::thread> workers;
+			std::mutex muxJobs;
+			std::condition_variable cvJobs;
+			std::deque<job> jobs;
+			bool stopping = false;
+			hsc::queues::mpsc_queue<decoded> results{ 256 };
+		};
+	}
+}
+
+#endif
@@ -9,6 +9,7 @@
 #define FLT_MAX 340282346638528859811704183484516925440.0f // Maximum value of a float, from bit pattern 01111111011111111111111111111111
 #endif
 
-int client_main(std::string addr, int port);
+//An empty cookedDir parses the OBJs and decodes the PNGs
+int client_main(std::string addr, int port, double netRate = 20.0, std::string cookedDir = "");
 
 #endif
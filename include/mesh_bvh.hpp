@@ -0,0 +1,478 @@
+#pragma once
+
+#ifndef MESH_BVH_H
+#define MESH_BVH_H 1
+
+#include "raylib.h"
+#include "raymath.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HSC_BVH_SSE 1
+#include <emmintrin.h>
+#endif
+
+namespace hsc {
+	namespace spatial {
+		//32 bytes so two share a cache line. Both children of an inner node
+		//are stored next to each other, leftOrFirst finds the pair.
+		struct bvh_node {
+			float min[3];
+			uint32_t leftOrFirst; //Left child, or the first packet of a leaf
+			float max[3];
+			uint32_t count;       //Packets in a leaf, 0 for an inner node
+		};
+		static_assert(sizeof(bvh_node) == 32, "bvh_node is meant to be packed");
+
+		//Four triangles laid out for one SIMD Moller-Trumbore test. Lanes past
+		//the end of a leaf are degenerate and can never hit.
+		struct alignas(16) triangle_packet {
+			float v0[3][4];
+			float e1[3][4];
+			float e2[3][4];
+			uint32_t triangle[4]; //Index in the source mesh
+		};
+
+		//Bounding volume hierarchy over one mesh's triangles for ray picking,
+		//built once with binned SAH and read only afterwards so any thread can
+		//query it. Positions are copied in, the mesh can be freed after build.
+		class mesh_bvh {
+		public:
+			static constexpr uint32_t no_triangle = UINT32_MAX;
+
+			//`positions` are xyz floats `stride` bytes apart, `indices` may be
+			//null for an unindexed mesh where every 3 vertices are a triangle
+			void build(const float* positions, size_t stride, uint32_t vertexCount, const uint16_t* indices, uint32_t indexCount) {
+				nodes.clear();
+				packets.clear();
+				uint32_t triangleCount = (indices != nullptr ? indexCount : vertexCount) / 3;
+				if (triangleCount == 0) return;
+
+				auto vertex = [&](uint32_t t, int corner) {
+					uint32_t index = indices != nullptr ? indices[t * 3 + corner] : t * 3 + corner;
+					const float* p = reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(positions) + size_t(index) * stride);
+					return Vector3{ p[0], p[1], p[2] };
+				};
+
+				std::vector<build_triangle> triangles(triangleCount);
+				for (uint32_t t = 0; t < triangleCount; t++) {
+					build_triangle& tri = triangles[t];
+					tri.v[0] = vertex(t, 0);
+					tri.v[1] = vertex(t, 1);
+					tri.v[2] = vertex(t, 2);
+					tri.bounds.grow(tri.v[0]);
+					tri.bounds.grow(tri.v[1]);
+					tri.bounds.grow(tri.v[2]);
+					tri.centroid = Vector3Scale(Vector3Add(Vector3Add(tri.v[0], tri.v[1]), tri.v[2]), 1.0f / 3.0f);
+				}
+				std::vector<uint32_t> order(triangleCount);
+				for (uint32_t t = 0; t < triangleCount; t++) order[t] = t;
+
+				nodes.reserve(size_t(triangleCount) * 2);
+				nodes.emplace_back();
+				std::vector<range> pending = { { 0, 0, triangleCount, 0 } };
+				while (!pending.empty()) {
+					range span = pending.back();
+					uint32_t node = span.node;
+					pending.pop_back();
+
+					aabb bounds, centroids;
+					for (uint32_t i = span.first; i < span.first + span.count; i++) {
+						bounds.grow(triangles[order[i]].bounds);
+						centroids.grow(triangles[order[i]].centroid);
+					}
+					setBounds(nodes[node], bounds);
+
+					uint32_t mid;
+					if (span.depth + 1 >= max_depth || !split(triangles, order, span, bounds, centroids, mid)) {
+						makeLeaf(nodes[node], triangles, order, span);
+						continue;
+					}
+					uint32_t left = uint32_t(nodes.size());
+					nodes.emplace_back();
+					nodes.emplace_back();
+					nodes[node].leftOrFirst = left;
+					nodes[node].count = 0;
+					pending.push_back({ left, span.first, mid - span.first, span.depth + 1 });
+					pending.push_back({ left + 1, mid, span.first + span.count - mid, span.depth + 1 });
+				}
+				nodes.shrink_to_fit();
+			}
+
+			bool empty() const {
+				return nodes.empty();
+			}
+
+			size_t getNodeCount() const {
+				return nodes.size();
+			}
+
+			size_t getPacketCount() const {
+				return packets.size();
+			}
+
+			//Closest hit in the mesh's own space, the same result raylib's
+			//GetRayCollisionMesh gives with an identity transform
+			RayCollision raycast(Ray ray) const {
+				RayCollision collision = { 0 };
+				float bestT = FLT_MAX;
+				uint32_t bestPacket = 0, bestLane = 0;
+				if (!intersect(ray, bestT, bestPacket, bestLane)) return collision;
+
+				const triangle_packet& packet = packets[bestPacket];
+				Vector3 e1 = { packet.e1[0][bestLane], packet.e1[1][bestLane], packet.e1[2][bestLane] };
+				Vector3 e2 = { packet.e2[0][bestLane], packet.e2[1][bestLane], packet.e2[2][bestLane] };
+				collision.hit = true;
+				collision.distance = bestT;
+				collision.point = Vector3Add(ray.position, Vector3Scale(ray.direction, bestT));
+				collision.normal = Vector3Normalize(Vector3CrossProduct(e1, e2));
+				return collision;
+			}
+
+			//Same, for the mesh placed by `transform` like GetRayCollisionMesh
+			RayCollision raycast(Ray ray, Matrix transform) const {
+				Matrix inverse = MatrixInvert(transform);
+				Ray local;
+				local.position = Vector3Transform(ray.position, inverse);
+				local.direction = Vector3Subtract(Vector3Transform(ray.direction, inverse), Vector3Transform({ 0.0f, 0.0f, 0.0f }, inverse));
+
+				//An affine transform keeps the ray parameter, so t carries over
+				RayCollision collision = { 0 };
+				float bestT = FLT_MAX;
+				uint32_t bestPacket = 0, bestLane = 0;
+				if (!intersect(local, bestT, bestPacket, bestLane)) return collision;
+
+				const triangle_packet& packet = packets[bestPacket];
+				Vector3 v0 = { packet.v0[0][bestLane], packet.v0[1][bestLane], packet.v0[2][bestLane] };
+				Vector3 v1 = Vector3Add(v0, { packet.e1[0][bestLane], packet.e1[1][bestLane], packet.e1[2][bestLane] });
+				Vector3 v2 = Vector3Add(v0, { packet.e2[0][bestLane], packet.e2[1][bestLane], packet.e2[2][bestLane] });
+				v0 = Vector3Transform(v0, transform);
+				v1 = Vector3Transform(v1, transform);
+				v2 = Vector3Transform(v2, transform);
+				collision.hit = true;
+				collision.distance = bestT;
+				collision.point = Vector3Add(ray.position, Vector3Scale(ray.direction, bestT));
+				collision.normal = Vector3Normalize(Vector3CrossProduct(Vector3Subtract(v1, v0), Vector3Subtract(v2, v0)));
+				return collision;
+			}
+
+		private:
+			//raylib's epsilon for the determinant and the minimum distance
+			static constexpr float epsilon = 0.000001f;
+			static constexpr int bin_count = 12;
+			static constexpr uint32_t max_leaf_triangles = 16;
+			static constexpr uint32_t max_depth = 64; //Also the traversal stack size
+			static constexpr float traversal_cost = 1.0f; //Relative to testing one packet
+
+			struct aabb {
+				Vector3 min = { FLT_MAX, FLT_MAX, FLT_MAX };
+				Vector3 max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+				void grow(Vector3 p) {
+					min = { std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z) };
+					max = { std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z) };
+				}
+				void grow(const aabb& other) {
+					if (other.min.x > other.max.x) return;
+					grow(other.min);
+					grow(other.max);
+				}
+				float area() const {
+					if (min.x > max.x) return 0.0f;
+					Vector3 e = Vector3Subtract(max, min);
+					return e.x * e.y + e.y * e.z + e.z * e.x;
+				}
+			};
+
+			struct build_triangle {
+				Vector3 v[3];
+				Vector3 centroid;
+				aabb bounds;
+			};
+
+			//Triangles order[first, first + count) belong under `node`
+			struct range {
+				uint32_t node;
+				uint32_t first;
+				uint32_t count;
+				uint32_t depth;
+			};
+
+			static float axisOf(Vector3 v, int axis) {
+				return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+			}
+
+			static uint32_t packetsFor(uint32_t triangles) {
+				return (triangles + 3) / 4;
+			}
+
+			static void setBounds(bvh_node& node, const aabb& bounds) {
+				node.min[0] = bounds.min.x;
+				node.min[1] = bounds.min.y;
+				node.min[2] = bounds.min.z;
+				node.max[0] = bounds.max.x;
+				node.max[1] = bounds.max.y;
+				node.max[2] = bounds.max.z;
+			}
+
+			//Binned SAH: bucket centroids along each axis and take the plane
+			//between buckets with the lowest expected cost, counted in packets
+			//since that is what a leaf costs to test. False makes a leaf.
+			static bool split(const std::vector<build_triangle>& triangles, std::vector<uint32_t>& order, range span, const aabb& bounds, const aabb& centroids, uint32_t& mid) {
+				if (span.count <= 4) return false;
+
+				float bestCost = FLT_MAX;
+				int bestAxis = -1, bestBin = 0;
+				for (int axis = 0; axis < 3; axis++) {
+					float low = axisOf(centroids.min, axis), high = axisOf(centroids.max, axis);
+					if (high <= low) continue;
+					float scale = float(bin_count) / (high - low);
+
+					aabb bins[bin_count];
+					uint32_t counts[bin_count] = { 0 };
+					for (uint32_t i = span.first; i < span.first + span.count; i++) {
+						const build_triangle& tri = triangles[order[i]];
+						int bin = std::min(bin_count - 1, int((axisOf(tri.centroid, axis) - low) * scale));
+						bins[bin].grow(tri.bounds);
+						counts[bin]++;
+					}
+
+					//Sweep from both ends so each plane's cost is one lookup
+					float leftArea[bin_count - 1], rightArea[bin_count - 1];
+					uint32_t leftCount[bin_count - 1], rightCount[bin_count - 1];
+					aabb leftBox, rightBox;
+					uint32_t leftSum = 0, rightSum = 0;
+					for (int i = 0; i < bin_count - 1; i++) {
+						leftBox.grow(bins[i]);
+						leftSum += counts[i];
+						leftArea[i] = leftBox.area();
+						leftCount[i] = leftSum;
+						rightBox.grow(bins[bin_count - 1 - i]);
+						rightSum += counts[bin_count - 1 - i];
+						rightArea[bin_count - 2 - i] = rightBox.area();
+						rightCount[bin_count - 2 - i] = rightSum;
+					}
+					for (int i = 0; i < bin_count - 1; i++) {
+						if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+						float cost = leftArea[i] * float(packetsFor(leftCount[i])) + rightArea[i] * float(packetsFor(rightCount[i]));
+						if (cost < bestCost) {
+							bestCost = cost;
+							bestAxis = axis;
+							bestBin = i;
+						}
+					}
+				}
+
+				float parentArea = bounds.area();
+				float leafCost = float(packetsFor(span.count));
+				bool splitPays = bestAxis >= 0 && parentArea > 0.0f && traversal_cost + bestCost / parentArea < leafCost;
+				if (!splitPays) {
+					if (span.count <= max_leaf_triangles) return false;
+					if (bestAxis < 0) {
+						//All centroids in one spot, halve the list so leaves stay small
+						mid = span.first + span.count / 2;
+						return true;
+					}
+				}
+
+				float low = axisOf(centroids.min, bestAxis), high = axisOf(centroids.max, bestAxis);
+				float scale = float(bin_count) / (high - low);
+				auto begin = order.begin() + span.first;
+				auto middle = std::partition(begin, begin + span.count, [&](uint32_t t) {
+					return std::min(bin_count - 1, int((axisOf(triangles[t].centroid, bestAxis) - low) * scale)) <= bestBin;
+				});
+				mid = uint32_t(middle - order.begin());
+				return true;
+			}
+
+			void makeLeaf(bvh_node& node, const std::vector<build_triangle>& triangles, const std::vector<uint32_t>& order, range span) {
+				node.leftOrFirst = uint32_t(packets.size());
+				node.count = packetsFor(span.count);
+				for (uint32_t i = 0; i < span.count; i += 4) {
+					triangle_packet packet;
+					std::memset(&packet, 0, sizeof(packet));
+					for (uint32_t lane = 0; lane < 4; lane++) {
+						packet.triangle[lane] = no_triangle;
+						if (i + lane >= span.count) continue;
+						uint32_t t = order[span.first + i + lane];
+						const build_triangle& tri = triangles[t];
+						Vector3 e1 = Vector3Subtract(tri.v[1], tri.v[0]);
+						Vector3 e2 = Vector3Subtract(tri.v[2], tri.v[0]);
+						for (int axis = 0; axis < 3; axis++) {
+							packet.v0[axis][lane] = axisOf(tri.v[0], axis);
+							packet.e1[axis][lane] = axisOf(e1, axis);
+							packet.e2[axis][lane] = axisOf(e2, axis);
+						}
+						packet.triangle[lane] = t;
+					}
+					packets.push_back(packet);
+				}
+			}
+
+			//Slab test, returns the entry distance or FLT_MAX on a miss
+			static float enter(const bvh_node& node, const float origin[3], const float inverse[3], float bestT) {
+				float tmin = 0.0f, tmax = bestT;
+				for (int axis = 0; axis < 3; axis++) {
+					float t1 = (node.min[axis] - origin[axis]) * inverse[axis];
+					float t2 = (node.max[axis] - origin[axis]) * inverse[axis];
+					tmin = std::max(tmin, std::min(t1, t2));
+					tmax = std::min(tmax, std::max(t1, t2));
+				}
+				return tmin <= tmax ? tmin : FLT_MAX;
+			}
+
+			bool intersect(const Ray& ray, float& bestT, uint32_t& bestPacket, uint32_t& bestLane) const {
+				if (nodes.empty()) return false;
+				const float origin[3] = { ray.position.x, ray.position.y, ray.position.z };
+				const float direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+				float inverse[3];
+				for (int axis = 0; axis < 3; axis++) {
+					//A zero component makes an infinite slab, keep it finite so 0 * inf can't NaN
+					inverse[axis] = direction[axis] != 0.0f ? 1.0f / direction[axis] : std::copysign(1e30f, direction[axis]);
+				}
+
+				bool hit = false;
+				if (enter(nodes[0], origin, inverse, bestT) == FLT_MAX) return false;
+				uint32_t stack[max_depth];
+				uint32_t depth = 0;
+				uint32_t current = 0;
+				while (true) {
+					const bvh_node& node = nodes[current];
+					if (node.count > 0) {
+						for (uint32_t p = node.leftOrFirst; p < node.leftOrFirst + node.count; p++) {
+							if (intersectPacket(packets[p], origin, direction, bestT, bestLane)) {
+								bestPacket = p;
+								hit = true;
+							}
+						}
+					}
+					else {
+						//Visit the nearer child first, the far one only if it can still beat bestT
+						uint32_t near = node.leftOrFirst, far = node.leftOrFirst + 1;
+						float nearT = enter(nodes[near], origin, inverse, bestT);
+						float farT = enter(nodes[far], origin, inverse, bestT);
+						if (farT < nearT) {
+							std::swap(near, far);
+							std::swap(nearT, farT);
+						}
+						if (nearT != FLT_MAX) {
+							if (farT != FLT_MAX) stack[depth++] = far;
+							current = near;
+							continue;
+						}
+					}
+					//Pop, skipping nodes the best hit so far already rules out
+					bool found = false;
+					while (depth > 0) {
+						uint32_t next = stack[--depth];
+						if (enter(nodes[next], origin, inverse, bestT) != FLT_MAX) {
+							current = next;
+							found = true;
+							break;
+						}
+					}
+					if (!found) break;
+				}
+				return hit;
+			}
+
+			//Moller-Trumbore on four triangles at once, updates bestT and
+			//bestLane when one of them is closer
+			static bool intersectPacket(const triangle_packet& packet, const float origin[3], const float direction[3], float& bestT, uint32_t& bestLane) {
+				float t[4];
+				int mask = 0;
+#ifdef HSC_BVH_SSE
+				const __m128 dx = _mm_set1_ps(direction[0]), dy = _mm_set1_ps(direction[1]), dz = _mm_set1_ps(direction[2]);
+				const __m128 e1x = _mm_load_ps(packet.e1[0]), e1y = _mm_load_ps(packet.e1[1]), e1z = _mm_load_ps(packet.e1[2]);
+				const __m128 e2x = _mm_load_ps(packet.e2[0]), e2y = _mm_load_ps(packet.e2[1]), e2z = _mm_load_ps(packet.e2[2]);
+
+				//p = d x e2, det = e1 . p
+				__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+				__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+				__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+				__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+				const __m128 eps = _mm_set1_ps(epsilon);
+				__m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+				__m128 valid = _mm_cmpgt_ps(absDet, eps);
+				if (_mm_movemask_ps(valid) == 0) return false;
+				__m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+				//s = o - v0, u = (s . p) / det
+				__m128 sx = _mm_sub_ps(_mm_set1_ps(origin[0]), _mm_load_ps(packet.v0[0]));
+				__m128 sy = _mm_sub_ps(_mm_set1_ps(origin[1]), _mm_load_ps(packet.v0[1]));
+				__m128 sz = _mm_sub_ps(_mm_set1_ps(origin[2]), _mm_load_ps(packet.v0[2]));
+				__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+
+				//q = s x e1, v = (d . q) / det, t = (e2 . q) / det
+				__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+				__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+				__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+				__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+				__m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+				const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+				valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+				valid = _mm_and_ps(valid, _mm_cmple_ps(u, one));
+				valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+				valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+				valid = _mm_and_ps(valid, _mm_cmpgt_ps(tt, eps));
+				valid = _mm_and_ps(valid, _mm_cmplt_ps(tt, _mm_set1_ps(bestT)));
+				mask = _mm_movemask_ps(valid);
+				if (mask == 0) return false;
+				_mm_storeu_ps(t, tt);
+#else
+				for (int lane = 0; lane < 4; lane++) {
+					const float e1[3] = { packet.e1[0][lane], packet.e1[1][lane], packet.e1[2][lane] };
+					const float e2[3] = { packet.e2[0][lane], packet.e2[1][lane], packet.e2[2][lane] };
+					float p[3] = { direction[1] * e2[2] - direction[2] * e2[1], direction[2] * e2[0] - direction[0] * e2[2], direction[0] * e2[1] - direction[1] * e2[0] };
+					float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+					if (det > -epsilon && det < epsilon) continue;
+					float invDet = 1.0f / det;
+					float s[3] = { origin[0] - packet.v0[0][lane], origin[1] - packet.v0[1][lane], origin[2] - packet.v0[2][lane] };
+					float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+					if (u < 0.0f || u > 1.0f) continue;
+					float q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0] };
+					float v = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * invDet;
+					if (v < 0.0f || u + v > 1.0f) continue;
+					t[lane] = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invDet;
+					if (t[lane] > epsilon && t[lane] < bestT) mask |= 1 << lane;
+				}
+				if (mask == 0) return false;
+#endif
+				for (int lane = 0; lane < 4; lane++) {
+					if ((mask & (1 << lane)) && t[lane] < bestT) {
+						bestT = t[lane];
+						bestLane = uint32_t(lane);
+					}
+				}
+				return true;
+			}
+
+			std::vector<bvh_node> nodes;
+			std::vector<triangle_packet> packets;
+		};
+
+		//One BVH per mesh of a model, raycast matches GetRayCollisionModel
+		class model_bvh {
+		public:
+			std::vector<mesh_bvh> meshes;
+
+			RayCollision raycast(Ray ray, Matrix transform) const {
+				RayCollision closest = { 0 };
+				closest.distance = FLT_MAX;
+				for (const mesh_bvh& mesh : meshes) {
+					RayCollision hit = mesh.raycast(ray, transform);
+					if (hit.hit && hit.distance < closest.distance) closest = hit;
+				}
+				if (!closest.hit) closest.distance = 0.0f;
+				return closest;
+			}
+		};
+	}
+}
+
+#endif
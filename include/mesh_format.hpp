@@ -0,0 +1,264 @@
+#pragma once
+
+#ifndef MESH_FORMAT_H
+#define MESH_FORMAT_H 1
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+//Keep windows.h from clashing with raylib's names
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef NOGDI
+#define NOGDI
+#endif
+#ifndef NOUSER
+#define NOUSER
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace hsc {
+	namespace assets {
+		//Cooked meshes are written by the asset-cooker tool and read in place
+		//through a memory mapping, nothing in them needs parsing. The file is a
+		//header, one mesh_record per mesh and level of detail, then each one's
+		//vertices and indices. Little endian, every block starts 16 byte aligned.
+		//
+		//Level 0 is the full model, each further level a simplified copy of
+		//every mesh with its own vertices. The records hold all meshes of
+		//level 0, then all of level 1 and so on.
+		constexpr uint32_t mesh_magic = 0x4D534348; //"HCSM" in the file
+		constexpr uint32_t mesh_version = 2;
+		constexpr uint32_t max_lod_count = 8;
+		constexpr size_t mesh_alignment = 16;
+
+		struct mesh_bounds {
+			float min[3];
+			float max[3];
+		};
+
+		//Interleaved so the whole block uploads as one vertex buffer
+		struct mesh_vertex {
+			float position[3];
+			float texcoord[2];
+			float normal[3];
+		};
+
+		struct mesh_file_header {
+			uint32_t magic;
+			uint32_t version;
+			uint32_t meshCount;    //Per level of detail
+			uint32_t vertexStride; //sizeof(mesh_vertex) when it was written
+			uint64_t fileSize;
+			mesh_bounds bounds; //Of every mesh in the file
+			uint32_t lodCount;  //At least 1
+			uint32_t reserved;
+		};
+
+		//Indices are 16 bit, relative to the mesh's own vertices, and ordered
+		//for the post-transform vertex cache
+		struct mesh_record {
+			uint64_t vertexOffset;
+			uint64_t indexOffset;
+			uint32_t vertexCount;
+			uint32_t indexCount;
+			mesh_bounds bounds;
+			uint32_t lod;
+			float error; //Furthest the simplified surface may be from the original, in model units
+		};
+
+		static_assert(sizeof(mesh_vertex) == 32, "mesh_vertex is written to disk as is");
+		static_assert(sizeof(mesh_file_header) == 56, "mesh_file_header is written to disk as is");
+		static_assert(sizeof(mesh_record) == 56, "mesh_record is written to disk as is");
+
+		inline uint64_t alignUp(uint64_t offset, uint64_t alignment = mesh_alignment) {
+			return (offset + alignment - 1) & ~(alignment - 1);
+		}
+
+		//A whole file mapped read only
+		class mapped_file {
+		public:
+			mapped_file() = default;
+			mapped_file(const mapped_file&) = delete;
+			mapped_file& operator=(const mapped_file&) = delete;
+			mapped_file(mapped_file&& other) noexcept {
+				*this = std::move(other);
+			}
+			mapped_file& operator=(mapped_file&& other) noexcept {
+				if (this != &other) {
+					close();
+					std::swap(bytes, other.bytes);
+					std::swap(length, other.length);
+#ifdef _WIN32
+					std::swap(file, other.file);
+					std::swap(mapping, other.mapping);
+#endif
+				}
+				return *this;
+			}
+			~mapped_file() {
+				close();
+			}
+
+			bool open(const std::string& path) {
+				close();
+#ifdef _WIN32
+				file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+				if (file == INVALID_HANDLE_VALUE) return false;
+				LARGE_INTEGER size;
+				if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+					close();
+					return false;
+				}
+				mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (mapping == nullptr) {
+					close();
+					return false;
+				}
+				bytes = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+				if (bytes == nullptr) {
+					close();
+					return false;
+				}
+				length = size_t(size.QuadPart);
+#else
+				int fd = ::open(path.c_str(), O_RDONLY);
+				if (fd < 0) return false;
+				struct stat info;
+				if (fstat(fd, &info) != 0 || info.st_size == 0) {
+					::close(fd);
+					return false;
+				}
+				void* view = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+				::close(fd); //The mapping keeps the file alive
+				if (view == MAP_FAILED) return false;
+				bytes = static_cast<const uint8_t*>(view);
+				length = size_t(info.st_size);
+#endif
+				return true;
+			}
+
+			void close() {
+#ifdef _WIN32
+				if (bytes != nullptr) UnmapViewOfFile(bytes);
+				if (mapping != nullptr) CloseHandle(mapping);
+				if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+				mapping = nullptr;
+				file = INVALID_HANDLE_VALUE;
+#else
+				if (bytes != nullptr) munmap(const_cast<uint8_t*>(bytes), length);
+#endif
+				bytes = nullptr;
+				length = 0;
+			}
+
+			const uint8_t* data() const {
+				return bytes;
+			}
+
+			size_t size() const {
+				return length;
+			}
+
+		private:
+			const uint8_t* bytes = nullptr;
+			size_t length = 0;
+#ifdef _WIN32
+			HANDLE file = INVALID_HANDLE_VALUE;
+			HANDLE mapping = nullptr;
+#endif
+		};
+
+		//A mapped cooked mesh file. open checks every offset once so the
+		//accessors can hand out pointers into the mapping without checks.
+		class cooked_mesh_file {
+		public:
+			bool open(const std::string& path, std::string* error = nullptr) {
+				if (!file.open(path)) return fail(error, "can't map " + path);
+				if (file.size() < sizeof(mesh_file_header)) return fail(error, path + " is too small");
+
+				const mesh_file_header& h = header();
+				if (h.magic != mesh_magic) return fail(error, path + " is not a cooked mesh");
+				if (h.version != mesh_version) return fail(error, path + " was cooked for version " + std::to_string(h.version));
+				if (h.vertexStride != sizeof(mesh_vertex)) return fail(error, path + " has a different vertex layout");
+				if (h.fileSize != file.size()) return fail(error, path + " is truncated");
+
+				if (h.lodCount == 0 || h.lodCount > max_lod_count) return fail(error, path + " has a bad level of detail count");
+				uint64_t recordsEnd = sizeof(mesh_file_header) + uint64_t(h.meshCount) * h.lodCount * sizeof(mesh_record);
+				if (recordsEnd > file.size()) return fail(error, path + " has a bad mesh table");
+				for (uint32_t i = 0; i < h.meshCount * h.lodCount; i++) {
+					const mesh_record& r = records()[i];
+					uint64_t vertexEnd = r.vertexOffset + uint64_t(r.vertexCount) * sizeof(mesh_vertex);
+					uint64_t indexEnd = r.indexOffset + uint64_t(r.indexCount) * sizeof(uint16_t);
+					if (r.vertexOffset % mesh_alignment != 0 || r.indexOffset % mesh_alignment != 0 ||
+						r.vertexOffset < recordsEnd || r.indexOffset < recordsEnd ||
+						vertexEnd > file.size() || indexEnd > file.size() ||
+						r.vertexCount > 0xFFFF || r.indexCount % 3 != 0 || r.lod != i / h.meshCount) {
+						return fail(error, path + " has a bad mesh record");
+					}
+					//Picking and the upload index the vertex block without checks,
+					//the pages are about to be read for the upload anyway
+					const uint16_t* indices = reinterpret_cast<const uint16_t*>(file.data() + r.indexOffset);
+					for (uint32_t j = 0; j < r.indexCount; j++) {
+						if (indices[j] >= r.vertexCount) return fail(error, path + " has an index past its vertices");
+					}
+				}
+				return true;
+			}
+
+			void close() {
+				file.close();
+			}
+
+			const mesh_file_header& header() const {
+				return *reinterpret_cast<const mesh_file_header*>(file.data());
+			}
+
+			uint32_t meshCount() const {
+				return header().meshCount;
+			}
+
+			uint32_t lodCount() const {
+				return header().lodCount;
+			}
+
+			const mesh_record& getRecord(uint32_t mesh, uint32_t lod = 0) const {
+				return records()[lod * meshCount() + mesh];
+			}
+
+			const mesh_vertex* getVertices(uint32_t mesh, uint32_t lod = 0) const {
+				return reinterpret_cast<const mesh_vertex*>(file.data() + getRecord(mesh, lod).vertexOffset);
+			}
+
+			const uint16_t* getIndices(uint32_t mesh, uint32_t lod = 0) const {
+				return reinterpret_cast<const uint16_t*>(file.data() + getRecord(mesh, lod).indexOffset);
+			}
+
+		private:
+			const mesh_record* records() const {
+				return reinterpret_cast<const mesh_record*>(file.data() + sizeof(mesh_file_header));
+			}
+
+			bool fail(std::string* error, const std::string& message) {
+				file.close();
+				if (error != nullptr) *error = message;
+				return false;
+			}
+
+			mapped_file file;
+		};
+	}
+}
+
+#endif
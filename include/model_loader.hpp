@@ -0,0 +1,184 @@
+#pragma once
+
+#ifndef MODEL_LOADER_H
+#define MODEL_LOADER_H 1
+
+#include "raylib.h"
+#include "rlgl.h"
+#include "raymath.h"
+#include <mesh_format.hpp>
+#include <obj_loader.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace hsc {
+	namespace assets {
+		//Slots in Mesh::vboId as UploadMesh uses them, UnloadMesh frees them all
+		constexpr int vbo_slot_vertices = 0;
+		constexpr int vbo_slot_indices = 6;
+		constexpr int vbo_slot_count = 16; //Room for every raylib version's MAX_MESH_VERTEX_BUFFERS
+
+#ifndef HSC_COOKED_DIR
+#define HSC_COOKED_DIR "resources/models/cooked"
+#endif
+		//Where the cooker's output is looked for, the build passes the
+		//directory it cooks into so the source tree stays untouched
+		constexpr const char* default_cooked_dir = HSC_COOKED_DIR;
+
+		//resources/models/obj/turret.obj is cooked to <cookedDir>/turret.hcm,
+		//textures take the cooked texture extension instead
+		inline std::string cookedPath(const std::string& cookedDir, const std::string& sourcePath, const std::string& extension = ".hcm") {
+			size_t slash = sourcePath.find_last_of("/\\");
+			std::string name = slash == std::string::npos ? sourcePath : sourcePath.substr(slash + 1);
+			size_t dot = name.find_last_of('.');
+			if (dot != std::string::npos) name = name.substr(0, dot);
+			if (cookedDir.empty() || cookedDir.back() == '/' || cookedDir.back() == '\\') return cookedDir + name + extension;
+			return cookedDir + "/" + name + extension;
+		}
+
+		//A model's meshes in CPU memory, either pointing into a mapped cooked
+		//file or owning what was parsed from the OBJ
+		struct model_data {
+			struct part {
+				const mesh_vertex* vertices;
+				uint32_t vertexCount;
+				const uint16_t* indices;
+				uint32_t indexCount;
+			};
+			std::vector<part> parts;
+			mesh_bounds bounds = {};
+			bool cooked = false;
+			//Simplified levels of detail from the cooked file, coarser each
+			//step, and how far each level may stray from the full model.
+			//lodErrors[0] is the full model's, so always 0.
+			std::vector<std::vector<part>> lods;
+			std::vector<float> lodErrors = { 0.0f };
+
+			cooked_mesh_file file;
+			std::vector<std::vector<mesh_vertex>> ownedVertices;
+			std::vector<std::vector<uint16_t>> ownedIndices;
+		};
+
+		//Reads a model without touching the GPU so it can run on any thread.
+		//Prefers the cooked file in `cookedDir` and parses the OBJ when there
+		//isn't a valid one, an empty `cookedDir` always parses.
+		inline bool readModel(const std::string& objPath, model_data& out, const std::string& cookedDir = default_cooked_dir, std::string* error = nullptr) {
+			std::string cookedError;
+			const bool allowCooked = !cookedDir.empty();
+			if (allowCooked && out.file.open(cookedPath(cookedDir, objPath), &cookedError)) {
+				out.cooked = true;
+				out.bounds = out.file.header().bounds;
+				for (uint32_t m = 0; m < out.file.meshCount(); m++) {
+					const mesh_record& record = out.file.getRecord(m);
+					out.parts.push_back({ out.file.getVertices(m), record.vertexCount, out.file.getIndices(m), record.indexCount });
+				}
+				for (uint32_t lod = 1; lod < out.file.lodCount(); lod++) {
+					out.lods.emplace_back();
+					float error = 0.0f;
+					for (uint32_t m = 0; m < out.file.meshCount(); m++) {
+						const mesh_record& record = out.file.getRecord(m, lod);
+						out.lods.back().push_back({ out.file.getVertices(m, lod), record.vertexCount, out.file.getIndices(m, lod), record.indexCount });
+						error = std::max(error, record.error);
+					}
+					out.lodErrors.push_back(error);
+				}
+				return true;
+			}
+			if (allowCooked) TraceLog(LOG_WARNING, "MODEL: [%s] No cooked mesh (%s), parsing the OBJ", objPath.c_str(), cookedError.c_str());
+
+			obj_scene scene;
+			std::string parseError;
+			if (!parseObj(objPath, scene, parseError)) {
+				if (error != nullptr) *error = parseError;
+				return false;
+			}
+			for (size_t m = 0; m < scene.meshes.size(); m++) {
+				obj_mesh& mesh = scene.meshes[m];
+				mesh_bounds bounds = boundsOf(mesh.vertices);
+				for (int i = 0; i < 3; i++) {
+					out.bounds.min[i] = m == 0 ? bounds.min[i] : std::min(out.bounds.min[i], bounds.min[i]);
+					out.bounds.max[i] = m == 0 ? bounds.max[i] : std::max(out.bounds.max[i], bounds.max[i]);
+				}
+				out.ownedVertices.push_back(std::move(mesh.vertices));
+				out.ownedIndices.emplace_back(mesh.indices.begin(), mesh.indices.end()); //parseObj keeps them under 16 bits
+			}
+			for (size_t m = 0; m < out.ownedVertices.size(); m++) {
+				out.parts.push_back({ out.ownedVertices[m].data(), uint32_t(out.ownedVertices[m].size()), out.ownedIndices[m].data(), uint32_t(out.ownedIndices[m].size()) });
+			}
+			return true;
+		}
+
+		//Uploads one mesh, has to run on the thread owning the GL context.
+		//The interleaved vertices go to the GPU as one buffer, the CPU only
+		//keeps positions and indices for raylib's picking functions.
+		inline Mesh uploadMesh(const model_data::part& part) {
+			Mesh mesh = { 0 };
+			mesh.vertexCount = int(part.vertexCount);
+			mesh.triangleCount = int(part.indexCount / 3);
+			mesh.vertices = (float*)MemAlloc(int(part.vertexCount * 3 * sizeof(float)));
+			for (uint32_t v = 0; v < part.vertexCount; v++) {
+				for (int i = 0; i < 3; i++) mesh.vertices[v * 3 + i] = part.vertices[v].position[i];
+			}
+			mesh.indices = (unsigned short*)MemAlloc(int(part.indexCount * sizeof(unsigned short)));
+			std::memcpy(mesh.indices, part.indices, part.indexCount * sizeof(unsigned short));
+
+			mesh.vaoId = rlLoadVertexArray();
+			if (mesh.vaoId == 0) {
+				//No vertex arrays (plain GLES2), let raylib upload separate buffers
+				mesh.texcoords = (float*)MemAlloc(int(part.vertexCount * 2 * sizeof(float)));
+				mesh.normals = (float*)MemAlloc(int(part.vertexCount * 3 * sizeof(float)));
+				for (uint32_t v = 0; v < part.vertexCount; v++) {
+					for (int i = 0; i < 2; i++) mesh.texcoords[v * 2 + i] = part.vertices[v].texcoord[i];
+					for (int i = 0; i < 3; i++) mesh.normals[v * 3 + i] = part.vertices[v].normal[i];
+				}
+				UploadMesh(&mesh, false);
+				return mesh;
+			}
+
+			mesh.vboId = (unsigned int*)MemAlloc(int(vbo_slot_count * sizeof(unsigned int)));
+			rlEnableVertexArray(mesh.vaoId);
+			const int stride = int(sizeof(mesh_vertex));
+			mesh.vboId[vbo_slot_vertices] = rlLoadVertexBuffer(part.vertices, int(part.vertexCount) * stride, false);
+			rlSetVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_POSITION, 3, RL_FLOAT, false, stride, int(offsetof(mesh_vertex, position)));
+			rlEnableVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_POSITION);
+			rlSetVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_TEXCOORD, 2, RL_FLOAT, false, stride, int(offsetof(mesh_vertex, texcoord)));
+			rlEnableVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_TEXCOORD);
+			rlSetVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_NORMAL, 3, RL_FLOAT, false, stride, int(offsetof(mesh_vertex, normal)));
+			rlEnableVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_NORMAL);
+			mesh.vboId[vbo_slot_indices] = rlLoadVertexBufferElement(part.indices, int(part.indexCount * sizeof(uint16_t)), false);
+			//No vertex colours, so like UploadMesh give the shader plain white
+			float white[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+			rlSetVertexAttributeDefault(RL_DEFAULT_SHADER_ATTRIB_LOCATION_COLOR, white, SHADER_ATTRIB_VEC4, 4);
+			rlDisableVertexAttribute(RL_DEFAULT_SHADER_ATTRIB_LOCATION_COLOR);
+			rlDisableVertexArray();
+			return mesh;
+		}
+
+		inline BoundingBox toBoundingBox(const mesh_bounds& bounds) {
+			return { { bounds.min[0], bounds.min[1], bounds.min[2] }, { bounds.max[0], bounds.max[1], bounds.max[2] } };
+		}
+
+		//Turns one level of what readModel produced into a raylib Model with
+		//one default material, on the thread owning the GL context
+		inline Model uploadModel(const std::vector<model_data::part>& parts) {
+			Model model = { 0 };
+			model.transform = MatrixIdentity();
+			model.meshCount = int(parts.size());
+			model.meshes = (Mesh*)MemAlloc(int(model.meshCount * sizeof(Mesh)));
+			for (size_t m = 0; m < parts.size(); m++) model.meshes[m] = uploadMesh(parts[m]);
+			model.materialCount = 1;
+			model.materials = (Material*)MemAlloc(int(sizeof(Material)));
+			model.materials[0] = LoadMaterialDefault();
+			model.meshMaterial = (int*)MemAlloc(int(model.meshCount * sizeof(int))); //All use material 0
+			return model;
+		}
+
+		inline Model uploadModel(const model_data& data) {
+			return uploadModel(data.parts);
+		}
+	}
+}
+
+#endif
@@ -6,6 +6,8 @@
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <deque>
 #include <optional>
 #include <vector>
@@ -13,6 +15,13 @@
 #include <algorithm>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <array>
+#include <functional>
+#include <unordered_map>
+#include <new>
+#include <random>
 
 #ifndef NET_COMMOM_H_DEFS
 #define NET_COMMON_H_DEFS
@@ -31,22 +40,27 @@
 #include "raylib.h"
 #include "raymath.h"
 #include <asio.hpp>
+#include <net_compress.hpp>
+#include <queues.hpp>
+#include <server_metrics.hpp>
 #include <asio/ts/buffer.hpp>
 #include <asio/ts/internet.hpp>
 
 
 enum class CustomMsgTypes : uint32_t
 {
-	Server_GetStatus,
+	Server_GetStatus, //Empty request, the reply body is the server's metrics as Prometheus text
 	Server_GetPing,
 	Client_Accepted,
 	Client_SetID,
 	Client_Register,
 	Client_Unregister,
-	Game_AddPlayer,
+	Game_AddPlayer, //One or more player records back to back
 	Game_RemovePlayer,
 	Game_UpdatePlayer,
-	Plugin_Message
+	Plugin_Message,
+	Game_Snapshot,
+	Game_SnapshotAck
 };
 struct player {
 	uint32_t ID = 0;
@@ -57,87 +71,6 @@ struct player {
 	};
 };
 
-namespace hsc {
-	namespace queues {
-		template <typename T>
-		class thread_safe_queue{
-		public:
-			thread_safe_queue() = default;
-			thread_safe_queue(const thread_safe_queue<T>&) = delete;
-			virtual ~thread_safe_queue() {clear();}
-
-		public:
-			const T& front(){
-				std::scoped_lock lock(muxQueue);
-				return deqQueue.front();
-			}
-
-			const T& back(){
-				std::scoped_lock lock(muxQueue);
-				return deqQueue.back();
-			}
-
-			void push_back(const T& item){
-				std::scoped_lock lock(muxQueue);
-				deqQueue.emplace_back(std::move(item));
-				std::unique_lock<std::mutex> ul(muxBlocking);
-				cvBlocking.notify_one();
-			}
-
-			void push_front(const T& item){
-				std::scoped_lock lock(muxQueue);
-				deqQueue.emplace_front(std::move(item));
-				std::unique_lock<std::mutex> ul(muxBlocking);
-				cvBlocking.notify_one();
-			}
-
-			bool empty(){
-				std::scoped_lock lock(muxQueue);
-				return deqQueue.empty();
-			}
-
-			size_t count(){
-				std::scoped_lock lock(muxQueue);
-				return deqQueue.size();
-			}
-
-			void clear(){
-				std::scoped_lock lock(muxQueue);
-				deqQueue.clear();
-			}
-
-			void wait()
-			{
-				while (empty())
-				{
-					std::unique_lock<std::mutex> ul(muxBlocking);
-					cvBlocking.wait(ul);
-				}
-			}
-
-			T pop_front(){
-				std::scoped_lock lock(muxQueue);
-				auto t = std::move(deqQueue.front());
-				deqQueue.pop_front();
-				return t;
-			}
-
-			T pop_back(){
-				std::scoped_lock lock(muxQueue);
-				auto t = std::move(deqQueue.back());
-				deqQueue.pop_back();
-				return t;
-			}
-
-		protected:
-			std::mutex muxQueue;
-			std::deque<T> deqQueue;
-			std::condition_variable cvBlocking;
-			std::mutex muxBlocking;
-		};
-	}
-}
-
 
 
 //Foward Declare the server interface
@@ -145,6 +78,9 @@ namespace hsc {
 	namespace net {
 		template <typename T>
 		class server_interface;
+
+		template <typename T>
+		class udp_channel;
 	}
 }
 //Foward Declare the server interface
@@ -164,6 +100,15 @@ namespace hsc {
 				uint32_t size = 0;
 			};
 
+			//Set in a header's size on the wire when the body is compressed,
+			//the body is then the raw size as a uint32_t and an LZ4 block.
+			//Only a connection's read and write chains ever see it.
+			constexpr uint32_t message_compressed_flag = 0x80000000u;
+			constexpr uint32_t max_decompressed_size = 64 * 1024 * 1024;
+			//Largest compressed body a peer may announce, checked before
+			//anything is allocated for it
+			constexpr uint32_t max_compressed_size = uint32_t(sizeof(uint32_t) + hsc::net::lz_bound(max_decompressed_size));
+
 			//Messages contain a body made of bytes and a header at the
 			//start, they can be serialised and deserialsised. by using
 			//special functions.
@@ -198,8 +143,8 @@ namespace hsc {
 					msg.body.resize(msg.body.size() + sizeof(DataType));
 					//Copy the new data into the free space
 					std::memcpy(msg.body.data() + size, &data, sizeof(DataType));
-					//Update the size in message's header
-					msg.header.size = msg.size();
+					//Update the size in message's header, it only counts the body
+					msg.header.size = uint32_t(msg.body.size());
 
 					//Return the message so we can chain pushes
 					return msg;
@@ -218,12 +163,320 @@ namespace hsc {
 					std::memcpy(&data, msg.body.data() + size, sizeof(DataType));
 					//Update the size in message's header
 					msg.body.resize(size);
-					msg.header.size = msg.size();
+					msg.header.size = uint32_t(msg.body.size());
 
 					//Return the message so we can chain pushes
 					return msg;
 				}
 			};
+			//Writes fields onto the end of a message's body, front to back.
+			//The size of each write call is known at compile time, so the
+			//body grows once per call however many fields are passed.
+			template <typename T>
+			class message_writer {
+			public:
+				explicit message_writer(message<T>& m) : msg(m) {}
+
+				//Make room up front for fields written over several calls
+				message_writer<T>& reserve(size_t bytes) {
+					msg.body.reserve(msg.body.size() + bytes);
+					return *this;
+				}
+
+				template <typename... DataTypes>
+				message_writer<T>& write(const DataTypes&... data) {
+					static_assert((std::is_standard_layout<DataTypes>::value && ...), "Data is to complex to push!");
+					constexpr size_t total = (sizeof(DataTypes) + ... + 0);
+					uint8_t* out = grow(total);
+					((std::memcpy(out, &data, sizeof(DataTypes)), out += sizeof(DataTypes)), ...);
+					return *this;
+				}
+
+				//Copy already encoded bytes onto the body
+				message_writer<T>& writeBytes(const void* data, size_t size) {
+					if (size > 0) std::memcpy(grow(size), data, size);
+					return *this;
+				}
+
+			private:
+				uint8_t* grow(size_t bytes) {
+					size_t offset = msg.body.size();
+					msg.body.resize(offset + bytes);
+					msg.header.size = uint32_t(msg.body.size());
+					return msg.body.data() + offset;
+				}
+
+				message<T>& msg;
+			};
+
+			//Reads fields from a message's body front to back without changing
+			//it. A read that would run past the end fails and reads nothing.
+			template <typename T>
+			class message_reader {
+			public:
+				explicit message_reader(const message<T>& m) : msg(m) {}
+
+				template <typename... DataTypes>
+				bool read(DataTypes&... data) {
+					static_assert((std::is_standard_layout<DataTypes>::value && ...), "Data is to complex to poped!");
+					constexpr size_t total = (sizeof(DataTypes) + ... + 0);
+					if (remaining() < total) return false;
+					const uint8_t* in = msg.body.data() + cursor;
+					((std::memcpy(&data, in, sizeof(DataTypes)), in += sizeof(DataTypes)), ...);
+					cursor += total;
+					return true;
+				}
+
+				bool readBytes(void* data, size_t size) {
+					if (remaining() < size) return false;
+					if (size > 0) std::memcpy(data, msg.body.data() + cursor, size);
+					cursor += size;
+					return true;
+				}
+
+				size_t remaining() const {
+					return msg.body.size() - cursor;
+				}
+
+				size_t position() const {
+					return cursor;
+				}
+
+			private:
+				const message<T>& msg;
+				size_t cursor = 0;
+			};
+
+			//Counters for the buffer pools, a miss is a real heap allocation
+			struct pool_stats {
+				std::atomic<uint64_t> hits{ 0 };
+				std::atomic<uint64_t> misses{ 0 };
+			};
+
+			//Pooled buffers come in a few size classes, each 4x the last.
+			//Anything bigger than the last class goes straight to the heap.
+			constexpr size_t pool_class_count = 5;
+			constexpr size_t pool_smallest_class = 64;
+
+			inline size_t poolClassFor(size_t size) {
+				size_t cls = 0;
+				size_t capacity = pool_smallest_class;
+				while (capacity < size && cls < pool_class_count) {
+					capacity <<= 2;
+					cls++;
+				}
+				return cls;
+			}
+
+			inline size_t poolClassCapacity(size_t cls) {
+				return pool_smallest_class << (2 * cls);
+			}
+
+			//Recycles the allocations behind shared_frame. Frames are built on
+			//game threads and freed on io threads, so each class is a short
+			//locked free list.
+			class frame_allocator {
+			public:
+				static frame_allocator& get() {
+					static frame_allocator instance;
+					return instance;
+				}
+
+				~frame_allocator() {
+					for (auto& list : freeLists) {
+						for (void* block : list.blocks) ::operator delete(block);
+					}
+				}
+
+				//`cls` is set to the class the block must be returned to
+				void* allocate(size_t bytes, size_t& cls) {
+					cls = poolClassFor(bytes);
+					if (cls < pool_class_count) {
+						free_list& list = freeLists[cls];
+						std::lock_guard<std::mutex> lock(list.mux);
+						if (!list.blocks.empty()) {
+							void* block = list.blocks.back();
+							list.blocks.pop_back();
+							stats.hits.fetch_add(1, std::memory_order_relaxed);
+							return block;
+						}
+						bytes = poolClassCapacity(cls);
+					}
+					stats.misses.fetch_add(1, std::memory_order_relaxed);
+					return ::operator new(bytes);
+				}
+
+				void deallocate(void* block, size_t cls) {
+					if (cls < pool_class_count) {
+						free_list& list = freeLists[cls];
+						std::lock_guard<std::mutex> lock(list.mux);
+						if (list.blocks.size() < max_free_per_class) {
+							list.blocks.push_back(block);
+							return;
+						}
+					}
+					::operator delete(block);
+				}
+
+				const pool_stats& getStats() const {
+					return stats;
+				}
+
+			private:
+				static constexpr size_t max_free_per_class = 1024;
+
+				struct free_list {
+					std::mutex mux;
+					std::vector<void*> blocks;
+				};
+
+				std::array<free_list, pool_class_count> freeLists;
+				pool_stats stats;
+			};
+
+			//Recycles message bodies for one connection. Bodies are taken by
+			//the connection's read chain and given back from whichever thread
+			//consumed the message, so each class is a lock-free MPSC queue.
+			class body_pool {
+			public:
+				body_pool() {
+					for (auto& list : freeLists) {
+						list.reset(new hsc::queues::mpsc_queue<std::vector<uint8_t>>(max_free_per_class));
+					}
+				}
+
+				//Only call from the owning connection's read chain
+				std::vector<uint8_t> acquire(size_t size) {
+					std::vector<uint8_t> body;
+					size_t cls = poolClassFor(size);
+					if (cls < pool_class_count && freeLists[cls]->try_pop(body)) {
+						stats.hits.fetch_add(1, std::memory_order_relaxed);
+					}
+					else {
+						stats.misses.fetch_add(1, std::memory_order_relaxed);
+						body.reserve(cls < pool_class_count ? poolClassCapacity(cls) : size);
+					}
+					body.resize(size);
+					return body;
+				}
+
+				//Safe from any thread, bodies that do not fit a class are freed
+				void release(std::vector<uint8_t>&& body) {
+					size_t cls = poolClassFor(body.capacity());
+					if (cls < pool_class_count && body.capacity() == poolClassCapacity(cls)) {
+						body.clear();
+						freeLists[cls]->try_push(std::move(body));
+					}
+					body = std::vector<uint8_t>();
+				}
+
+				const pool_stats& getStats() const {
+					return stats;
+				}
+
+			private:
+				static constexpr size_t max_free_per_class = 32;
+
+				std::array<std::unique_ptr<hsc::queues::mpsc_queue<std::vector<uint8_t>>>, pool_class_count> freeLists;
+				pool_stats stats;
+			};
+
+			//A message serialised once into its wire bytes, header then body,
+			//in a single ref-counted allocation. Copies only bump the count,
+			//so any number of connections can queue the same frame and it is
+			//freed when the last write using it completes.
+			template <typename T>
+			class shared_frame {
+			public:
+				shared_frame() = default;
+
+				explicit shared_frame(const message<T>& msg) {
+					allocate(msg.size());
+					std::memcpy(block->bytes(), &msg.header, sizeof(message_header<T>));
+					if (!msg.body.empty()) {
+						std::memcpy(block->bytes() + sizeof(message_header<T>), msg.body.data(), msg.body.size());
+					}
+				}
+
+				//Several messages back to back in one frame, on a stream this
+				//reads exactly as if they had been sent one by one
+				static shared_frame<T> batch(const message<T>* msgs, size_t count) {
+					size_t size = 0;
+					for (size_t i = 0; i < count; i++) size += msgs[i].size();
+					shared_frame<T> frame;
+					frame.allocate(size);
+					uint8_t* out = frame.block->bytes();
+					for (size_t i = 0; i < count; i++) {
+						std::memcpy(out, &msgs[i].header, sizeof(message_header<T>));
+						out += sizeof(message_header<T>);
+						if (!msgs[i].body.empty()) {
+							std::memcpy(out, msgs[i].body.data(), msgs[i].body.size());
+							out += msgs[i].body.size();
+						}
+					}
+					return frame;
+				}
+
+				shared_frame(const shared_frame<T>& other) : block(other.block) {
+					if (block) block->refs.fetch_add(1, std::memory_order_relaxed);
+				}
+
+				shared_frame(shared_frame<T>&& other) noexcept : block(other.block) {
+					other.block = nullptr;
+				}
+
+				shared_frame<T>& operator = (shared_frame<T> other) noexcept {
+					std::swap(block, other.block);
+					return *this;
+				}
+
+				~shared_frame() {
+					if (block && block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+						size_t cls = block->sizeClass;
+						block->~frame_block();
+						frame_allocator::get().deallocate(block, cls);
+					}
+				}
+
+				explicit operator bool() const {
+					return block != nullptr;
+				}
+
+				//The whole frame as it goes on the wire
+				const uint8_t* data() const {
+					return block->bytes();
+				}
+
+				size_t size() const {
+					return block->size;
+				}
+
+				const message_header<T>& header() const {
+					return *reinterpret_cast<const message_header<T>*>(block->bytes());
+				}
+
+			private:
+				//Lives at the front of the allocation, the bytes follow it
+				struct frame_block {
+					std::atomic<uint32_t> refs{ 1 };
+					uint32_t sizeClass = 0;
+					size_t size = 0;
+
+					uint8_t* bytes() {
+						return reinterpret_cast<uint8_t*>(this + 1);
+					}
+				};
+
+				void allocate(size_t size) {
+					size_t cls = 0;
+					block = new (frame_allocator::get().allocate(sizeof(frame_block) + size, cls)) frame_block();
+					block->size = size;
+					block->sizeClass = uint32_t(cls);
+				}
+
+				frame_block* block = nullptr;
+			};
+
 			//Just the same as a normal message but contains a pointer
 			//to the remote connection.
 			template <typename T>
@@ -231,6 +484,184 @@ namespace hsc {
 			//This is a forward decleare
 		}
 
+		//Tuning for a connection's write path
+		struct write_options {
+			size_t maxBytesPerFlush = 64 * 1024; //Upper bound gathered into one flush
+			bool noDelay = true; //Disable Nagle, messages are already batched by us
+			bool cork = false; //Linux only, hold partial segments until a flush ends
+		};
+
+		//Compression of message bodies sent over TCP. Each end offers it in
+		//the handshake and it is only used when both did, then every message
+		//at least minSize bytes is compressed unless it doesn't shrink.
+		struct compression_options {
+			bool enabled = true;
+			uint32_t minSize = 512;
+			std::unordered_map<uint32_t, uint32_t> minSizeByType; //Overrides minSize for a message id, UINT32_MAX never compresses it
+
+			uint32_t thresholdFor(uint32_t type) const {
+				auto found = minSizeByType.find(type);
+				return found != minSizeByType.end() ? found->second : minSize;
+			}
+		};
+
+		//What each end sends to validate a connection, the server its
+		//challenge and the client the scrambled answer. features are the
+		//handshake_feature bits the sender offers, the client answers with
+		//the ones both ends offered.
+		struct handshake_payload {
+			uint64_t value = 0;
+			uint32_t features = 0;
+			uint32_t reserved = 0;
+		};
+
+		enum handshake_feature : uint32_t {
+			feature_compression = 1,
+			feature_unreliable = 2 //The server has a UDP channel, the client can open one
+		};
+
+		//64 bits an observer can't predict, random_device draws from the
+		//OS entropy source
+		inline uint64_t unpredictableToken() {
+			static thread_local std::random_device device;
+			return (uint64_t(device()) << 32) ^ uint64_t(device());
+		}
+
+		//Counters for a connection's write path, safe to read from any thread
+		struct write_stats {
+			std::atomic<uint64_t> flushes{ 0 }; //Batches gathered from messagesOut
+			std::atomic<uint64_t> syscalls{ 0 }; //Completed write_some calls
+			std::atomic<uint64_t> messages{ 0 };
+			std::atomic<uint64_t> bytes{ 0 };
+			std::atomic<uint64_t> datagrams{ 0 }; //Sent on the unreliable channel instead
+			std::atomic<uint64_t> datagramBytes{ 0 };
+
+			double messagesPerSyscall() const {
+				uint64_t calls = syscalls.load(std::memory_order_relaxed);
+				return calls ? double(messages.load(std::memory_order_relaxed)) / double(calls) : 0.0;
+			}
+		};
+
+		//Counters for everything a connection received, over TCP or UDP
+		struct read_stats {
+			std::atomic<uint64_t> messages{ 0 };
+			std::atomic<uint64_t> bytes{ 0 }; //Headers included
+			std::atomic<uint64_t> stalls{ 0 }; //Times reading paused on a full inbound queue
+		};
+
+		//How far away the other end of a connection is, in time
+		struct latency_estimate {
+			double rttMs = 0.0; //Smoothed round trip
+			double jitterMs = 0.0; //Smoothed change between consecutive round trips
+			double offsetMs = 0.0; //Their clock minus ours
+			uint32_t samples = 0;
+		};
+
+		//One ping exchange, every time is in nanoseconds of the steady clock
+		//of whichever end took it
+		struct ping_payload {
+			uint32_t sequence = 0;
+			uint32_t isReply = 0;
+			int64_t origin = 0; //Requester's clock when it sent the request
+			int64_t receive = 0; //Responder's clock when the request arrived
+			int64_t transmit = 0; //Responder's clock when it sent the reply
+		};
+
+		//Estimates round trip time, jitter and clock offset to the other end
+		//of a connection from periodic NTP style ping exchanges. The offset
+		//comes from the lowest round trip of the last few samples, queueing
+		//delay only ever adds to a round trip so that one is the least skewed.
+		class clock_sync {
+		public:
+			static int64_t now() {
+				return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+			}
+
+			void setInterval(double seconds) {
+				interval = int64_t(std::max(seconds, 0.01) * 1e9);
+			}
+
+			//Requests are made by one thread, the one handling messages
+			bool isDue(int64_t at = now()) const {
+				return at >= nextPing;
+			}
+
+			ping_payload makeRequest(int64_t at = now()) {
+				nextPing = at + interval;
+				ping_payload request;
+				request.sequence = ++sequence;
+				request.origin = at;
+				return request;
+			}
+
+			//What to send back for a request, `receivedAt` is when it arrived
+			static ping_payload makeReply(const ping_payload& request, int64_t receivedAt) {
+				ping_payload reply = request;
+				reply.isReply = 1;
+				reply.receive = receivedAt;
+				reply.transmit = now();
+				return reply;
+			}
+
+			//Fold in the reply to one of our requests, false if it makes no sense
+			bool onReply(const ping_payload& reply, int64_t receivedAt) {
+				if (!reply.isReply || reply.origin > receivedAt || reply.transmit < reply.receive) return false;
+				int64_t rtt = (receivedAt - reply.origin) - (reply.transmit - reply.receive);
+				int64_t offset = ((reply.receive - reply.origin) + (reply.transmit - receivedAt)) / 2;
+				rtt = std::max<int64_t>(rtt, 0);
+
+				std::scoped_lock lock(muxEstimate);
+				window[filled % window.size()] = { rtt, offset };
+				filled++;
+				double rttMs = double(rtt) / 1e6;
+				if (estimate.samples == 0) {
+					estimate.rttMs = rttMs;
+				}
+				else {
+					estimate.rttMs += (rttMs - estimate.rttMs) / 8.0;
+					estimate.jitterMs += (std::abs(rttMs - lastRttMs) - estimate.jitterMs) / 16.0;
+				}
+				lastRttMs = rttMs;
+				estimate.samples++;
+
+				const sample* best = &window[0];
+				for (size_t i = 1; i < std::min<size_t>(filled, window.size()); i++) {
+					if (window[i].rtt < best->rtt) best = &window[i];
+				}
+				offsetNs = best->offset;
+				estimate.offsetMs = double(offsetNs) / 1e6;
+				return true;
+			}
+
+			latency_estimate getEstimate() const {
+				std::scoped_lock lock(muxEstimate);
+				return estimate;
+			}
+
+			//A time taken on the other end's clock, moved onto ours
+			int64_t toLocal(int64_t remote) const {
+				std::scoped_lock lock(muxEstimate);
+				return remote - offsetNs;
+			}
+
+		private:
+			struct sample {
+				int64_t rtt;
+				int64_t offset;
+			};
+
+			int64_t interval = 1000000000; //One second
+			int64_t nextPing = 0;
+			uint32_t sequence = 0;
+
+			mutable std::mutex muxEstimate; //Read from any thread
+			std::array<sample, 8> window{};
+			size_t filled = 0;
+			double lastRttMs = 0.0;
+			int64_t offsetNs = 0;
+			latency_estimate estimate;
+		};
+
 		//Used to represent a connection to a client or server
 		template <typename T>
 		class connection : public std::enable_shared_from_this<connection<T>> {
@@ -253,12 +684,14 @@ namespace hsc {
 				return os;
 			}
 
-			connection(owner parent, asio::io_context& context, asio::ip::tcp::socket sock, hsc::queues::thread_safe_queue<hsc::net::packets::owned_message<T>>& messages_in) :
+			connection(owner parent, asio::io_context& context, asio::ip::tcp::socket sock, hsc::queues::inbound_queue<hsc::net::packets::owned_message<T>>& messages_in) :
 				asioContext(context), my_socket(std::move(sock)), messagesIn(messages_in) {
 				owner_type = parent;
 
 				if (owner_type == owner::server) {
-					handshakeOut = uint64_t(std::chrono::system_clock::now().time_since_epoch().count());
+					//The UDP token derives from this, so it can't be guessable the
+					//way a timestamp is
+					handshakeOut = unpredictableToken();
 					handshakeCheck = scramble(handshakeOut);
 				}
 				else {
@@ -278,6 +711,7 @@ namespace hsc {
 					if (my_socket.is_open()) {
 						id = uid;
 						connectionEstablished = true;
+						applySocketOptions();
 						writeValidation();
 						readValidation(server);
 					}
@@ -287,9 +721,10 @@ namespace hsc {
 			void connectToServer(const asio::ip::tcp::resolver::results_type& endpoints) {
 				if (owner_type == owner::client) {
 					asio::async_connect(my_socket, endpoints,
-						[this](std::error_code ec, asio::ip::tcp::endpoint endpoint) {
+						[this, self = this->shared_from_this()](std::error_code ec, asio::ip::tcp::endpoint endpoint) {
 							if (!ec) {
 								connectionEstablished = true;
+								applySocketOptions();
 								readValidation();
 							}
 						});
@@ -298,23 +733,40 @@ namespace hsc {
 
 			void disconnect() {
 				if (isConnected()) {
-					asio::post(asioContext, [this]() {my_socket.close(); });
+					//Keep ourselves alive until the close runs, the owner may drop us right away
+					asio::post(my_socket.get_executor(), [self = this->shared_from_this()]() {self->my_socket.close(); });
 				}
 			}
 			bool isConnected() const {
 				return my_socket.is_open();
 			}
 			void send(const hsc::net::packets::message<T>& msg) {
-				asio::post(asioContext,
-					[this, msg]()
-					{
-						bool writingMessages = !messagesOut.empty();
-						messagesOut.push_back(msg);
-						if (!writingMessages) {
-							writeHeader();
-						}
-					});
+				send(hsc::net::packets::shared_frame<T>(msg));
+			}
 
+			//Queue an already serialised frame, only the reference is copied.
+			//Frames go through the lock-free outbox and only the send that
+			//finds it empty posts to our strand, so a broadcast to many
+			//clients costs each one a push rather than a posted handler.
+			void send(hsc::net::packets::shared_frame<T> frame) {
+				//Once the outbox has overflowed every send is posted until those
+				//frames are on messagesOut, so nothing overtakes a frame that
+				//went this way
+				if (overflowPosts.load(std::memory_order_acquire) != 0 || !outbox.try_push(std::move(frame))) {
+					overflowPosts.fetch_add(1, std::memory_order_acq_rel);
+					asio::post(my_socket.get_executor(),
+						[this, self = this->shared_from_this(), frame = std::move(frame)]() mutable
+						{
+							//Behind every push that returned before this ran, the
+							//sender's earlier frames among them
+							overflowFrames.push_back({ std::move(frame), outbox.pushPosition() });
+							drainOutbox();
+						});
+					return;
+				}
+				if (outboxCount.fetch_add(1, std::memory_order_acq_rel) == 0) {
+					asio::post(my_socket.get_executor(), [this, self = this->shared_from_this()]() { drainOutbox(); });
+				}
 			}
 
 			std::shared_ptr<connection<T>> getConnectionPtr() {
@@ -325,11 +777,143 @@ namespace hsc {
 				return validHandshake;
 			}
 
+			//Both ends derive this from the handshake, it proves a datagram on
+			//the unreliable channel belongs to this connection
+			uint64_t getUdpToken() const {
+				return owner_type == owner::server ? handshakeCheck : handshakeOut;
+			}
+
+			//Where the TCP connection goes, used to find the same host over UDP
+			asio::ip::tcp::endpoint getRemoteEndpoint() const {
+				asio::error_code ec;
+				return my_socket.remote_endpoint(ec);
+			}
+
+			//Attach the unreliable channel. The client knows the server's
+			//address up front, the server learns each client's from its first
+			//datagram. Call before sending anything unreliably.
+			void attachUdpChannel(std::shared_ptr<hsc::net::udp_channel<T>> channel, uint32_t connectionID, const asio::ip::udp::endpoint* remote = nullptr) {
+				id = connectionID;
+				if (remote) {
+					udpEndpoint = *remote;
+					udpHasEndpoint = true;
+				}
+				udpChannel = std::move(channel);
+			}
+
+			//Send a latest-wins message, over UDP once both ends have heard
+			//from each other on it and over TCP until then
+			void sendUnreliable(const hsc::net::packets::message<T>& msg) {
+				sendUnreliable(hsc::net::packets::shared_frame<T>(msg));
+			}
+
+			void sendUnreliable(hsc::net::packets::shared_frame<T> frame) {
+				if (udpChannel) {
+					udpChannel->send(this->shared_from_this(), std::move(frame));
+				}
+				else {
+					send(std::move(frame));
+				}
+			}
+
+			//Change how writes are flushed, call before connecting
+			void setWriteOptions(const write_options& options) {
+				writeOptions = options;
+			}
+
+			//What to offer in the handshake and when to compress, call before
+			//connecting. stats may be shared with other connections.
+			void setCompression(const compression_options& options, std::shared_ptr<compression_stats> stats = nullptr) {
+				compressionOptions = options;
+				if (stats) compressionStats = std::move(stats);
+			}
+
+			//True once the handshake agreed on compression
+			bool isCompressing() const {
+				return compressionAgreed.load(std::memory_order_relaxed);
+			}
+
+			//Whether a client offers to open a UDP channel, call before
+			//connecting. The server offers it whenever one is attached.
+			void setOfferUnreliable(bool offer) {
+				offerUnreliable = offer;
+			}
+
+			//True once the handshake agreed both ends can use the UDP channel
+			bool isUnreliableAgreed() const {
+				return unreliableAgreed.load(std::memory_order_relaxed);
+			}
+
+			const compression_stats& getCompressionStats() const {
+				return *compressionStats;
+			}
+
+			const write_stats& getWriteStats() const {
+				return writeStats;
+			}
+
+			const read_stats& getReadStats() const {
+				return readStats;
+			}
+
+			//Round trip and clock offset to the other end, fed by pings
+			clock_sync& getClockSync() {
+				return clockSync;
+			}
+
+			const clock_sync& getClockSync() const {
+				return clockSync;
+			}
+
+			//Frames waiting in messagesOut, as of the last push or flush
+			uint32_t getQueuedFrames() const {
+				return queuedOut.load(std::memory_order_relaxed);
+			}
+
+			//Misses here are heap allocations made for received bodies
+			const hsc::net::packets::pool_stats& getBodyPoolStats() const {
+				return bodyPool->getStats();
+			}
+
 		private:
+			//On our strand, moves what send() left in the outbox onto
+			//messagesOut and starts one write for all of it. A send that
+			//pushed while we drained either finds the count above zero and
+			//leaves its frame to us, so we go round again, or its frame was
+			//taken before it counted it.
+			void drainOutbox() {
+				bool writingMessages = !messagesOut.empty();
+				for (;;) {
+					outboxBatch.clear();
+					int64_t taken = int64_t(outbox.drain(outboxBatch));
+					for (auto& frame : outboxBatch) messagesOut.push_back(std::move(frame));
+					if (outboxCount.fetch_sub(taken, std::memory_order_acq_rel) - taken <= 0) break;
+					if (taken == 0) {
+						//A send claimed the next slot and hasn't filled it yet, come
+						//back after the other handlers rather than spin here
+						asio::post(my_socket.get_executor(), [this, self = this->shared_from_this()]() { drainOutbox(); });
+						break;
+					}
+				}
+				outboxBatch.clear();
+				//An overflowed frame waits until the outbox is drained past it
+				size_t drained = outbox.popPosition();
+				while (!overflowFrames.empty() && int64_t(drained - overflowFrames.front().after) >= 0) {
+					messagesOut.push_back(std::move(overflowFrames.front().frame));
+					overflowFrames.pop_front();
+					overflowPosts.fetch_sub(1, std::memory_order_acq_rel);
+				}
+				queuedOut.store(uint32_t(messagesOut.size()), std::memory_order_relaxed);
+				if (!writingMessages && !messagesOut.empty()) {
+					writeMessages();
+				}
+			}
+
 			//AYSNC- Write Validation
 			void writeValidation() {
-				asio::async_write(my_socket, asio::buffer(&handshakeOut, sizeof(uint64_t)),
-					[this](std::error_code ec, std::size_t length)
+				if (owner_type == owner::server) validationOut = { handshakeOut, offeredFeatures(), 0 };
+				asio::async_write(my_socket, asio::buffer(&validationOut, sizeof(handshake_payload)),
+					[this, self = this->shared_from_this()](std::error_code ec, std::size_t length)
 					{
 						if (!ec) {
 							if (owner_type == owner::client) {
@@ -343,57 +927,164 @@ namespace hsc {
 					});
 			}
 
-			//AYSNC- Write message headers
-			void writeHeader() {
-				asio::async_write(my_socket, asio::buffer(&messagesOut.front().header, sizeof(hsc::net::packets::message_header<T>)),
-					[this](std::error_code ec, std::size_t length)
-					{
-						if (!ec) {
-							if (messagesOut.front().body.size() > 0) {
-								writeBody();
-							}
-							else {
-								messagesOut.pop_front();
+			//Apply the write options to the socket once it is connected
+			void applySocketOptions() {
+				asio::error_code ec;
+				my_socket.set_option(asio::ip::tcp::no_delay(writeOptions.noDelay), ec);
+				if (ec) {
+					std::cerr << ec.message() << "Error while setting TCP_NODELAY on " << id << std::endl;
+				}
+			}
 
-								if (!messagesOut.empty()) {
-									writeHeader();
-								}
-							}
+			//Hold or release partial segments around a flush
+			void setCork(bool on) {
+#ifdef __linux__
+				if (writeOptions.cork) {
+					asio::error_code ec;
+					my_socket.set_option(asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_CORK>(on), ec);
+				}
+#endif
+			}
+
+			//AYSNC- Write as many queued frames as fit in one flush, they are
+			//gathered into one buffer sequence so they go out in a single
+			//writev instead of one write each.
+			void writeMessages() {
+				writeBuffers.clear();
+				writeSegments.clear();
+				compressedOut.clear();
+				size_t bytes = 0;
+				flushMessages = 0;
+				for (auto& frame : messagesOut) {
+					//Always take at least one frame, even an oversized one
+					if (flushMessages > 0 && bytes + frame.size() > writeOptions.maxBytesPerFlush) break;
+					if (compressing) gatherCompressed(frame);
+					else writeBuffers.push_back(asio::buffer(frame.data(), frame.size()));
+					bytes += frame.size();
+					flushMessages++;
+				}
+				//compressedOut has stopped growing, so pointers into it hold now
+				for (const write_segment& segment : writeSegments) {
+					writeBuffers.push_back(asio::buffer(segment.frame ? segment.frame : compressedOut.data() + segment.offset, segment.size));
+				}
+				setCork(true);
+				writeGathered();
+			}
+
+			//Splits a frame into its messages and compresses the ones over the
+			//threshold into compressedOut, runs of messages sent raw stay
+			//pointing into the frame. Always on the io thread, so the encoder
+			//and its dictionary need no locking.
+			void gatherCompressed(const hsc::net::packets::shared_frame<T>& frame) {
+				using header_type = hsc::net::packets::message_header<T>;
+				const uint8_t* at = frame.data();
+				const uint8_t* const end = at + frame.size();
+				const uint8_t* raw = at; //Start of the current run of raw messages
+				while (at < end) {
+					header_type header;
+					std::memcpy(&header, at, sizeof(header));
+					const uint8_t* next = at + sizeof(header) + header.size;
+					const uint32_t type = uint32_t(header.id);
+					if (header.size > 0 && header.size >= compressionOptions.thresholdFor(type)) {
+						auto started = std::chrono::steady_clock::now();
+						size_t offset = compressedOut.size();
+						compressedOut.resize(offset + sizeof(header) + sizeof(uint32_t));
+						size_t packed = encoder.compress(at + sizeof(header), header.size, compressedOut);
+						if (packed > 0) {
+							if (at > raw) writeSegments.push_back({ raw, 0, size_t(at - raw) });
+							header_type wire = header;
+							wire.size = uint32_t(sizeof(uint32_t) + packed) | hsc::net::packets::message_compressed_flag;
+							std::memcpy(compressedOut.data() + offset, &wire, sizeof(wire));
+							std::memcpy(compressedOut.data() + offset + sizeof(wire), &header.size, sizeof(uint32_t));
+							writeSegments.push_back({ nullptr, offset, compressedOut.size() - offset });
+							raw = next;
 						}
-						else {
-							std::cout << ec.message() << "Error while writing packet header to " << id << std::endl;
-							my_socket.close();
+						else compressedOut.resize(offset);
+						if (type < compression_stats::max_types) {
+							compression_counters& counters = compressionStats->sent[type];
+							if (packed > 0) {
+								counters.messages.fetch_add(1, std::memory_order_relaxed);
+								counters.rawBytes.fetch_add(header.size, std::memory_order_relaxed);
+								counters.wireBytes.fetch_add(sizeof(uint32_t) + packed, std::memory_order_relaxed);
+							}
+							else counters.skipped.fetch_add(1, std::memory_order_relaxed);
+							counters.nanoseconds.fetch_add(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count()), std::memory_order_relaxed);
 						}
-					});
+					}
+					at = next;
+				}
+				if (end > raw) writeSegments.push_back({ raw, 0, size_t(end - raw) });
 			}
-			//AYSNC- Write message bodys
-			void writeBody() {
-				asio::async_write(my_socket, asio::buffer(messagesOut.front().body.data(), messagesOut.front().body.size()),
-					[this](std::error_code ec, std::size_t length)
+
+			//AYSNC- Write whatever is left of the gathered buffers
+			void writeGathered() {
+				my_socket.async_write_some(writeBuffers,
+					[this, self = this->shared_from_this()](std::error_code ec, std::size_t length)
 					{
 						if (!ec) {
-							messagesOut.pop_front();
+							writeStats.syscalls.fetch_add(1, std::memory_order_relaxed);
+							writeStats.bytes.fetch_add(length, std::memory_order_relaxed);
+							consumeWritten(length);
+							if (!writeBuffers.empty()) {
+								writeGathered();
+								return;
+							}
 
+							setCork(false);
+							writeStats.flushes.fetch_add(1, std::memory_order_relaxed);
+							writeStats.messages.fetch_add(flushMessages, std::memory_order_relaxed);
+							for (size_t i = 0; i < flushMessages; i++) {
+								messagesOut.pop_front();
+							}
+							queuedOut.store(uint32_t(messagesOut.size()), std::memory_order_relaxed);
 							if (!messagesOut.empty()) {
-								writeHeader();
+								writeMessages();
 							}
 						}
 						else {
 							connectionEstablished = false;
-							std::cout << ec.message() << "Error while writing packet header to " << id << std::endl;
+							std::cout << ec.message() << "Error while writing packets to " << id << std::endl;
 							my_socket.close();
 						}
 					});
 			}
 
+			//Drop the buffers a partial write finished and trim the next one
+			void consumeWritten(size_t length) {
+				size_t done = 0;
+				while (done < writeBuffers.size() && length >= writeBuffers[done].size()) {
+					length -= writeBuffers[done].size();
+					done++;
+				}
+				if (done < writeBuffers.size()) {
+					writeBuffers[done] += length;
+				}
+				writeBuffers.erase(writeBuffers.begin(), writeBuffers.begin() + done);
+			}
+
 			//AYSNC- Read message headers
 			void readHeader() {
 				asio::async_read(my_socket, asio::buffer(&msgIn.header, sizeof(hsc::net::packets::message_header<T>)),
-					[this](std::error_code ec, std::size_t length)
+					[this, self = this->shared_from_this()](std::error_code ec, std::size_t length)
 					{
 						if (!ec) {
-							if (msgIn.header.size > 0) {
-								msgIn.body.resize(msgIn.header.size);
+							if (msgIn.header.size & hsc::net::packets::message_compressed_flag) {
+								if (!compressing) {
+									std::cerr << "Compressed packet from " << id << " without agreeing to compression" << std::endl;
+									my_socket.close();
+									return;
+								}
+								uint32_t wireSize = msgIn.header.size & ~hsc::net::packets::message_compressed_flag;
+								if (wireSize <= sizeof(uint32_t) || wireSize > hsc::net::packets::max_compressed_size) {
+									std::cerr << "Compressed packet of " << wireSize << " bytes from " << id << " is out of bounds" << std::endl;
+									my_socket.close();
+									return;
+								}
+								compressedIn.resize(wireSize);
+								readCompressedBody();
+							}
+							else if (msgIn.header.size > 0) {
+								msgIn.body = bodyPool->acquire(msgIn.header.size);
 								readBody();
 							}
 							else {
@@ -409,7 +1100,7 @@ namespace hsc {
 			//AYSNC- Read message bodys
 			void readBody() {
 				asio::async_read(my_socket, asio::buffer(msgIn.body.data(), msgIn.body.size()),
-					[this](std::error_code ec, std::size_t length)
+					[this, self = this->shared_from_this()](std::error_code ec, std::size_t length)
 					{
 						if (!ec) {
 							addMessageToQueue();
@@ -420,15 +1111,48 @@ namespace hsc {
 						}
 					});
 			}
+			//AYSNC- Read a compressed body and decompress it into a pooled one
+			void readCompressedBody() {
+				asio::async_read(my_socket, asio::buffer(compressedIn.data(), compressedIn.size()),
+					[this, self = this->shared_from_this()](std::error_code ec, std::size_t length)
+					{
+						if (ec) {
+							std::cerr << ec.message() << "Error while reading packet body from " << id << std::endl;
+							my_socket.close();
+							return;
+						}
+						auto started = std::chrono::steady_clock::now();
+						uint32_t rawSize = 0;
+						if (compressedIn.size() >= sizeof(uint32_t)) std::memcpy(&rawSize, compressedIn.data(), sizeof(uint32_t));
+						if (rawSize > 0 && rawSize <= hsc::net::packets::max_decompressed_size) msgIn.body = bodyPool->acquire(rawSize);
+						if (rawSize == 0 || rawSize > hsc::net::packets::max_decompressed_size ||
+							!decoder.decompress(compressedIn.data() + sizeof(uint32_t), compressedIn.size() - sizeof(uint32_t), msgIn.body.data(), rawSize)) {
+							std::cerr << "Corrupt compressed packet from " << id << std::endl;
+							my_socket.close();
+							return;
+						}
+						msgIn.header.size = rawSize;
+						const uint32_t type = uint32_t(msgIn.header.id);
+						if (type < compression_stats::max_types) {
+							compression_counters& counters = compressionStats->received[type];
+							counters.messages.fetch_add(1, std::memory_order_relaxed);
+							counters.rawBytes.fetch_add(rawSize, std::memory_order_relaxed);
+							counters.wireBytes.fetch_add(compressedIn.size(), std::memory_order_relaxed);
+							counters.nanoseconds.fetch_add(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count()), std::memory_order_relaxed);
+						}
+						addMessageToQueue(compressedIn.size());
+					});
+			}
 
 			//ASYNC- Read validation
 			void readValidation(hsc::net::server_interface<T>* server = nullptr)
 			{
-				asio::async_read(my_socket, asio::buffer(&handshakeIn, sizeof(uint64_t)),
-					[=](std::error_code ec, std::size_t length)
+				asio::async_read(my_socket, asio::buffer(&validationIn, sizeof(handshake_payload)),
+					[=, self = this->shared_from_this()](std::error_code ec, std::size_t length)
 					{
 						if (!ec)
 						{
+							handshakeIn = validationIn.value;
 							if (owner_type == owner::server)
 							{
 								std::shared_ptr<hsc::net::connection<T>> connection = this->getConnectionPtr();
@@ -436,6 +1160,7 @@ namespace hsc {
 								{
 									std::cout << "Client Validated" << std::endl;
 									validHandshake = true;
+									agreeFeatures(validationIn.features);
 									server->onClientValidates(connection);
 									readHeader();
 								}
@@ -449,6 +1174,7 @@ namespace hsc {
 							else
 							{
 								handshakeOut = scramble(handshakeIn);
+								validationOut = { handshakeOut, agreeFeatures(validationIn.features), 0 };
 								writeValidation();
 							}
 						}
@@ -460,6 +1186,22 @@ namespace hsc {
 					});
 			}
 
+			uint32_t offeredFeatures() const {
+				uint32_t features = compressionOptions.enabled ? feature_compression : 0;
+				if (owner_type == owner::server ? udpChannel != nullptr : offerUnreliable) features |= feature_unreliable;
+				return features;
+			}
+
+			//Keep the features both ends offered, before any message is read
+			//or written so both chains see the same answer
+			uint32_t agreeFeatures(uint32_t theirs) {
+				uint32_t agreed = theirs & offeredFeatures();
+				compressing = (agreed & feature_compression) != 0;
+				compressionAgreed.store(compressing, std::memory_order_relaxed);
+				unreliableAgreed.store((agreed & feature_unreliable) != 0, std::memory_order_relaxed);
+				return agreed;
+			}
+
 			// "Encrypt" data
 			uint64_t scramble(uint64_t input)
 			{
@@ -469,47 +1211,146 @@ namespace hsc {
 			}
 
 
-			//Once a full message is received, add it to the incoming queue
-			void addMessageToQueue() {
+			//Once a full message is received, add it to the incoming queue.
+			//wireBody is what the body took on the wire when it was compressed.
+			void addMessageToQueue(size_t wireBody = SIZE_MAX) {
 				try {
-					if (owner_type == owner::server) {
-						messagesIn.push_back({ this->getConnectionPtr(), msgIn });
-					}
-					else {
-						messagesIn.push_back({ nullptr, msgIn });
-					}
-					readHeader();
+					readStats.messages.fetch_add(1, std::memory_order_relaxed);
+					readStats.bytes.fetch_add(sizeof(msgIn.header) + (wireBody == SIZE_MAX ? msgIn.body.size() : wireBody), std::memory_order_relaxed);
+					//The body moves into the queue, msgIn gets a fresh one from
+					//the pool on the next header
+					std::shared_ptr<hsc::net::connection<T>> remote = owner_type == owner::server ? this->getConnectionPtr() : nullptr;
+					stalledIn = { std::move(remote), std::move(msgIn), bodyPool, clock_sync::now() };
+					msgIn.body.clear();
+					queueStalledAndRead();
 				}
 				catch (std::exception e) {
 					std::cerr << e.what() << std::endl;
 				}
 			}
+
+			//Hands stalledIn to the queue and reads the next header. When the
+			//queue is full the socket is left unread until the consumer pops,
+			//so TCP flow control slows the sender down rather than this
+			//thread spinning or memory growing.
+			void queueStalledAndRead() {
+				if (!messagesIn.try_push(std::move(stalledIn))) {
+					readStats.stalls.fetch_add(1, std::memory_order_relaxed);
+					messagesIn.whenSpace([this, self = this->shared_from_this()]() {
+						asio::post(my_socket.get_executor(), [this, self]() { queueStalledAndRead(); });
+					});
+					return;
+				}
+				readHeader();
+			}
 		protected:
-			asio::ip::tcp::socket my_socket; //This socket points to the remote end
+			asio::ip::tcp::socket my_socket; //This socket points to the remote end, its executor is our strand
 			asio::io_context& asioContext; //There should be one shared one.
-			hsc::queues::thread_safe_queue<hsc::net::packets::message<T>> messagesOut; //Messages to remote end
-			hsc::queues::thread_safe_queue<hsc::net::packets::owned_message<T>>& messagesIn; //Messages to our end
+			std::deque<hsc::net::packets::shared_frame<T>> messagesOut; //Messages to remote end, only touched on the io thread
+			hsc::queues::mpsc_queue<hsc::net::packets::shared_frame<T>> outbox{ 1024 }; //Sent from any thread, drained on our strand
+			std::atomic<int64_t> outboxCount{ 0 }; //Pushes counted minus frames drained, see drainOutbox
+			std::atomic<uint32_t> overflowPosts{ 0 }; //Sends posted because the outbox was full, not yet on messagesOut
+			struct overflow_frame {
+				hsc::net::packets::shared_frame<T> frame;
+				size_t after; //Outbox push position the frame has to wait for
+			};
+			std::deque<overflow_frame> overflowFrames; //Strand only, in the order the sends were posted
+			std::vector<hsc::net::packets::shared_frame<T>> outboxBatch; //Reused by drainOutbox
+			std::vector<asio::const_buffer> writeBuffers; //Gathered frames of the current flush
+			size_t flushMessages = 0; //How many messages the current flush covers
+			write_options writeOptions;
+			write_stats writeStats;
+			read_stats readStats;
+			clock_sync clockSync;
+			std::atomic<uint32_t> queuedOut{ 0 }; //messagesOut.size() for other threads to read
+			hsc::queues::inbound_queue<hsc::net::packets::owned_message<T>>& messagesIn; //Messages to our end
 			hsc::net::packets::message<T> msgIn; //Temporary message holder 
+			hsc::net::packets::owned_message<T> stalledIn; //Received, waiting for room in messagesIn
+			std::shared_ptr<hsc::net::packets::body_pool> bodyPool = std::make_shared<hsc::net::packets::body_pool>(); //Recycles msgIn bodies
 			owner owner_type = owner::server; //The "owner" decides how the connection behaves
 
+			//Compression, the encoder and compressedOut belong to the write
+			//chain and the decoder and compressedIn to the read chain
+			struct write_segment {
+				const uint8_t* frame; //Into a queued frame, or nullptr for compressedOut
+				size_t offset;        //Into compressedOut
+				size_t size;
+			};
+			compression_options compressionOptions;
+			std::shared_ptr<compression_stats> compressionStats = std::make_shared<compression_stats>();
+			bool compressing = false; //Agreed in the handshake, only touched on our strand
+			std::atomic<bool> compressionAgreed{ false }; //compressing for other threads to read
+			bool offerUnreliable = false; //Client only, see setOfferUnreliable
+			std::atomic<bool> unreliableAgreed{ false };
+			lz_encoder encoder;
+			lz_decoder decoder;
+			std::vector<write_segment> writeSegments; //The current flush before it becomes writeBuffers
+			std::vector<uint8_t> compressedOut; //Compressed messages of the current flush
+			std::vector<uint8_t> compressedIn; //Body of the compressed message being read
+
 			// Handshake Validation			
 			uint64_t handshakeOut = 0;
 			uint64_t handshakeIn = 0;
 			uint64_t handshakeCheck = 0;
+			handshake_payload validationOut; //What goes on the wire for the values above
+			handshake_payload validationIn;
 
 			bool validHandshake = false;
 			bool connectionEstablished = false;
 
 			uint32_t id = 0; //Or ID
+
+			//Unreliable channel state, apart from udpReady only the channel's
+			//strand touches these
+			friend class hsc::net::udp_channel<T>;
+			std::shared_ptr<hsc::net::udp_channel<T>> udpChannel;
+			asio::ip::udp::endpoint udpEndpoint; //Where our datagrams go
+			bool udpHasEndpoint = false;
+			std::atomic<bool> udpReady{ false }; //Set once we have heard from the other end over UDP
+			uint32_t udpSendSequence = 0;
+			uint32_t udpProbeCountdown = 0; //Sends left until the next probe while not ready
+			std::unordered_map<uint32_t, uint32_t> udpLastSequence; //Newest sequence received per message id
 		};
 
 		namespace packets {
 			//Just the same as a normal message but contains a pointer
 			//to the remote connection.
+			//
+			//If the body was borrowed from a body_pool it goes back there when
+			//the owned_message is destroyed or overwritten, so move these
+			//around rather than copying them.
 			template <typename T>
 			struct owned_message {
 				std::shared_ptr<hsc::net::connection<T>> remote = nullptr;
 				message<T> msg;
+				std::shared_ptr<body_pool> pool = nullptr; //Where msg.body is returned to
+				int64_t receivedAt = 0; //clock_sync::now() when it came off the socket
+
+				owned_message() = default;
+				owned_message(std::shared_ptr<hsc::net::connection<T>> from, message<T>&& m, std::shared_ptr<body_pool> bodies = nullptr, int64_t received = 0) :
+					remote(std::move(from)), msg(std::move(m)), pool(std::move(bodies)), receivedAt(received) {}
+				owned_message(owned_message<T>&&) = default;
+				owned_message(const owned_message<T>&) = delete;
+
+				owned_message<T>& operator = (owned_message<T>&& other) {
+					recycle();
+					remote = std::move(other.remote);
+					msg = std::move(other.msg);
+					pool = std::move(other.pool);
+					receivedAt = other.receivedAt;
+					return *this;
+				}
+
+				~owned_message() {
+					recycle();
+				}
+
+				//Give the body back to its pool now instead of on destruction
+				void recycle() {
+					if (pool && msg.body.capacity() > 0) {
+						pool->release(std::move(msg.body));
+					}
+				}
 
 				//Overide for bit sift left `<<`, allows us to use `std::cout`
 				//for message debuging - as an example.
@@ -524,12 +1365,208 @@ namespace hsc {
 
 
 
+namespace hsc {
+	namespace net {
+		//Counters for the unreliable channel, safe to read from any thread
+		struct udp_stats {
+			std::atomic<uint64_t> sent{ 0 };
+			std::atomic<uint64_t> received{ 0 };
+			std::atomic<uint64_t> stale{ 0 }; //Dropped because a newer one of the same id already arrived
+			std::atomic<uint64_t> rejected{ 0 }; //Unknown connection, bad token or malformed
+			std::atomic<uint64_t> fellBack{ 0 }; //Sent over TCP instead
+			std::atomic<uint64_t> overflowed{ 0 }; //Dropped because the inbound queue was full
+		};
+
+		//Optional unreliable side channel next to the TCP connections, for
+		//latest-wins messages like player updates. Every datagram starts with
+		//the connection ID, the handshake token and a sequence number, late
+		//datagrams are dropped per message id. A datagram with nothing after
+		//that prefix is a probe, the client sends them until the server
+		//answers, and neither side sends messages over UDP before it has
+		//heard from the other, so a blocked port just means everything stays
+		//on TCP.
+		template <typename T>
+		class udp_channel : public std::enable_shared_from_this<udp_channel<T>> {
+		public:
+			struct datagram_header {
+				uint32_t connectionID = 0;
+				uint32_t sequence = 0;
+				uint64_t token = 0;
+			};
+
+			//Finds the connection a datagram claims to belong to
+			using connection_resolver = std::function<std::shared_ptr<connection<T>>(uint32_t)>;
+
+			//`ownedRemote` says whether received messages carry their
+			//connection, the server wants that and the client does not
+			udp_channel(asio::io_context& context, const asio::ip::udp::endpoint& bindTo,
+				hsc::queues::inbound_queue<hsc::net::packets::owned_message<T>>& messages_in,
+				connection_resolver resolver, bool ownedRemote, size_t maxDatagram = 1200) :
+				socket(asio::make_strand(context), bindTo), messagesIn(messages_in),
+				resolveConnection(std::move(resolver)), attachRemote(ownedRemote), maxDatagramSize(maxDatagram) {}
+
+			void start() {
+				receive();
+			}
+
+			void close() {
+				asio::post(socket.get_executor(), [self = this->shared_from_this()]() {
+					asio::error_code ec;
+					self->socket.close(ec);
+				});
+			}
+
+			const udp_stats& getStats() const {
+				return stats;
+			}
+
+			void send(std::shared_ptr<connection<T>> conn, hsc::net::packets::shared_frame<T> frame) {
+				asio::post(socket.get_executor(),
+					[self = this->shared_from_this(), conn = std::move(conn), frame = std::move(frame)]() mutable
+					{
+						self->sendNow(*conn, std::move(frame));
+					});
+			}
+
+		private:
+			static constexpr uint32_t probe_interval = 30; //Sends between probes while not ready
+
+			void sendNow(connection<T>& conn, hsc::net::packets::shared_frame<T> frame) {
+				if (!conn.udpReady.load(std::memory_order_acquire) || frame.size() + sizeof(datagram_header) > maxDatagramSize) {
+					if (!conn.udpReady.load(std::memory_order_acquire) && conn.udpProbeCountdown-- == 0) {
+						conn.udpProbeCountdown = probe_interval;
+						sendProbe(conn);
+					}
+					stats.fellBack.fetch_add(1, std::memory_order_relaxed);
+					conn.send(std::move(frame));
+					return;
+				}
+				datagram_header header;
+				header.connectionID = conn.getID();
+				header.sequence = ++conn.udpSendSequence;
+				header.token = conn.getUdpToken();
+				std::array<asio::const_buffer, 2> buffers = {
+					asio::buffer(&header, sizeof(header)),
+					asio::buffer(frame.data(), frame.size())
+				};
+				asio::error_code ec;
+				socket.send_to(buffers, conn.udpEndpoint, 0, ec);
+				if (!ec) {
+					stats.sent.fetch_add(1, std::memory_order_relaxed);
+					conn.writeStats.datagrams.fetch_add(1, std::memory_order_relaxed);
+					conn.writeStats.datagramBytes.fetch_add(frame.size(), std::memory_order_relaxed);
+				}
+			}
+
+			void sendProbe(connection<T>& conn) {
+				if (!conn.udpHasEndpoint) return;
+				datagram_header header;
+				header.connectionID = conn.getID();
+				header.token = conn.getUdpToken();
+				asio::error_code ec;
+				socket.send_to(asio::buffer(&header, sizeof(header)), conn.udpEndpoint, 0, ec);
+			}
+
+			//AYSNC- Read datagrams until the socket closes
+			void receive() {
+				socket.async_receive_from(asio::buffer(receiveBuffer), sender,
+					[self = this->shared_from_this()](std::error_code ec, std::size_t length)
+					{
+						if (!ec) {
+							self->handleDatagram(length);
+						}
+						//Errors like an ICMP unreachable are not fatal to a datagram
+						//socket, only stop once it has been closed
+						if (self->socket.is_open()) {
+							self->receive();
+						}
+					});
+			}
+
+			void handleDatagram(size_t length) {
+				datagram_header header;
+				if (length < sizeof(header)) {
+					stats.rejected.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+				std::memcpy(&header, receiveBuffer.data(), sizeof(header));
+				std::shared_ptr<connection<T>> conn = resolveConnection(header.connectionID);
+				if (!conn || header.token != conn->getUdpToken()) {
+					stats.rejected.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+
+				//The server follows the client's address, it may change behind NAT
+				if (attachRemote) {
+					conn->udpEndpoint = sender;
+					conn->udpHasEndpoint = true;
+				}
+				conn->udpReady.store(true, std::memory_order_release);
+
+				if (length == sizeof(header)) {
+					if (attachRemote) sendProbe(*conn); //Answer so the client knows we hear it
+					return;
+				}
+
+				hsc::net::packets::message<T> msg;
+				if (length < sizeof(header) + sizeof(msg.header)) {
+					stats.rejected.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+				std::memcpy(&msg.header, receiveBuffer.data() + sizeof(header), sizeof(msg.header));
+				size_t bodyAt = sizeof(header) + sizeof(msg.header);
+				if (length - bodyAt != msg.header.size) {
+					stats.rejected.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+
+				//Latest wins, anything not newer than what we have is dropped
+				auto last = conn->udpLastSequence.find(uint32_t(msg.header.id));
+				if (last != conn->udpLastSequence.end() && int32_t(header.sequence - last->second) <= 0) {
+					stats.stale.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+				conn->udpLastSequence[uint32_t(msg.header.id)] = header.sequence;
+
+				if (msg.header.size > 0) {
+					msg.body = bodyPool->acquire(msg.header.size);
+					std::memcpy(msg.body.data(), receiveBuffer.data() + bodyAt, msg.header.size);
+				}
+				stats.received.fetch_add(1, std::memory_order_relaxed);
+				conn->readStats.messages.fetch_add(1, std::memory_order_relaxed);
+				conn->readStats.bytes.fetch_add(sizeof(msg.header) + msg.body.size(), std::memory_order_relaxed);
+				//Unreliable anyway, a full queue drops it rather than pausing every connection's datagrams
+				if (!messagesIn.try_push({ attachRemote ? conn : nullptr, std::move(msg), bodyPool, clock_sync::now() })) {
+					stats.overflowed.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+
+			asio::ip::udp::socket socket; //Its executor is our strand
+			asio::ip::udp::endpoint sender; //Who sent the datagram being read
+			std::array<uint8_t, 65536> receiveBuffer;
+			hsc::queues::inbound_queue<hsc::net::packets::owned_message<T>>& messagesIn;
+			connection_resolver resolveConnection;
+			bool attachRemote;
+			size_t maxDatagramSize; //Bigger frames go over TCP
+			std::shared_ptr<hsc::net::packets::body_pool> bodyPool = std::make_shared<hsc::net::packets::body_pool>(); //Only our strand acquires
+			udp_stats stats;
+		};
+	}
+}
+
+
+
 namespace hsc {
 	namespace net {
 		template <typename T>
 		class client_interface {
 		public:
-			client_interface() {}
+			client_interface() : context(ownContext) {}
+
+			//Run on a context owned and run by the caller, so many clients can
+			//share a few threads. Stop the context before destroying the client,
+			//handlers still queued on it push to our messagesIn.
+			explicit client_interface(asio::io_context& shared) : context(shared), sharedContext(true) {}
 			virtual ~client_interface() {
 				disconnect();
 			}
@@ -542,16 +1579,21 @@ namespace hsc {
 					asio::ip::tcp::resolver resolver(context);
 					asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
 
-					connection = std::make_unique<hsc::net::connection<T>>(
+					connection = std::make_shared<hsc::net::connection<T>>(
 						hsc::net::connection<T>::owner::client,
 						context,
-						asio::ip::tcp::socket(context),
+						asio::ip::tcp::socket(asio::make_strand(context)),
 						messagesIn
 						);
+					connection->setWriteOptions(writeOptions);
+					connection->setCompression(compressionOptions, compressionStats);
+					connection->setOfferUnreliable(!sharedContext);
 
 					//Actually connect
 					connection->connectToServer(endpoints);
-					asio_thread = std::thread([this]() {context.run(); });
+					if (!sharedContext) {
+						asio_thread = std::thread([this]() {context.run(); });
+					}
 
 				}
 				catch (std::exception& e) {
@@ -566,11 +1608,17 @@ namespace hsc {
 				if (isConnected()) {
 					connection->disconnect();
 				}
-				context.stop();
+				if (udpChannel) {
+					udpChannel->close();
+				}
+				if (!sharedContext) {
+					context.stop();
+				}
 				if (asio_thread.joinable()) {
 					asio_thread.join();
 				}
-				connection.release();
+				udpChannel.reset();
+				connection.reset();
 			}
 
 			bool isConnected() {
@@ -587,18 +1635,185 @@ namespace hsc {
 					connection->send(msg);
 			}
 
+			void send(hsc::net::packets::shared_frame<T> frame)
+			{
+				if (isConnected())
+					connection->send(std::move(frame));
+			}
+
+			//Send a latest-wins message, over UDP once the server has answered
+			//on it and over TCP until then
+			void sendUnreliable(const hsc::net::packets::message<T>& msg)
+			{
+				if (isConnected())
+					connection->sendUnreliable(msg);
+			}
+
+			//True once the handshake says the server has a UDP channel for us
+			bool isUnreliableOffered() const {
+				return connection && connection->isUnreliableAgreed();
+			}
+
+			//Open the unreliable channel to the same address and port as the
+			//TCP connection. Needs the ID the server gave this connection, and
+			//the server to have said in the handshake that it has a channel.
+			//Not available on a shared context, its threads could have the
+			//channel and the connection push to messagesIn at the same time.
+			bool openUnreliable(uint32_t connectionID) {
+				if (!isConnected() || udpChannel || sharedContext || !isUnreliableOffered()) return false;
+				try {
+					asio::ip::tcp::endpoint server = connection->getRemoteEndpoint();
+					asio::ip::udp::endpoint remote(server.address(), server.port());
+					asio::ip::udp::endpoint local(server.address().is_v6() ? asio::ip::udp::v6() : asio::ip::udp::v4(), 0);
+					//Weak so the connection and channel do not keep each other alive
+					std::weak_ptr<hsc::net::connection<T>> ours = connection;
+					udpChannel = std::make_shared<hsc::net::udp_channel<T>>(context, local, messagesIn,
+						[ours](uint32_t) { return ours.lock(); }, false);
+					connection->attachUdpChannel(udpChannel, connectionID, &remote);
+					udpChannel->start();
+				}
+				catch (std::exception& e) {
+					std::cerr << "Exception while opening the unreliable channel: " << e.what() << std::endl;
+					udpChannel.reset();
+					return false;
+				}
+				return true;
+			}
+
+			//Change how writes to the server are flushed, call before connect()
+			void setWriteOptions(const hsc::net::write_options& options) {
+				writeOptions = options;
+			}
+
+			//Whether to offer compression and what to compress, call before connect()
+			void setCompression(const hsc::net::compression_options& options) {
+				compressionOptions = options;
+			}
+
+			//Compression of what we sent and received, per message type
+			const hsc::net::compression_stats& getCompressionStats() const {
+				return *compressionStats;
+			}
+
+			//Round trip and clock offset to the server, only while connected
+			hsc::net::clock_sync& getClockSync() {
+				return connection->getClockSync();
+			}
+
 			//Retrive the mesage input queue
-			hsc::queues::thread_safe_queue<hsc::net::packets::owned_message<T>>& messagesToUs() {
+			hsc::queues::spsc_queue<hsc::net::packets::owned_message<T>>& messagesToUs() {
 				return messagesIn;
 			}
 
 		protected:
-			asio::io_context context; //This will be pased to our connection
+			asio::io_context ownContext; //Used unless a shared context was given
+			asio::io_context& context; //This will be pased to our connection
+			bool sharedContext = false; //Run by someone else, we start no thread for it
 			std::thread asio_thread; //This is where asio stuff will ocur
-			std::unique_ptr<hsc::net::connection<T>> connection; //Our connection
+			std::shared_ptr<hsc::net::connection<T>> connection; //Our connection
+			std::shared_ptr<hsc::net::udp_channel<T>> udpChannel; //Optional, runs on the same thread as connection so messagesIn keeps one producer
+			hsc::net::write_options writeOptions; //Applied to our connection
+			hsc::net::compression_options compressionOptions; //Applied to our connection
+			std::shared_ptr<hsc::net::compression_stats> compressionStats = std::make_shared<hsc::net::compression_stats>(); //Outlives each connection
 
 		private:
-			hsc::queues::thread_safe_queue<hsc::net::packets::owned_message<T>> messagesIn; //Messages to our end
+			hsc::queues::spsc_queue<hsc::net::packets::owned_message<T>> messagesIn; //Messages to our end
+		};
+
+		//Counters for a send_scheduler
+		struct send_stats {
+			uint64_t flushes = 0; //Network ticks that sent something
+			uint64_t statesSent = 0;
+			uint64_t statesResent = 0; //Of statesSent, repeats of an unchanged state
+			uint64_t messagesBatched = 0; //Reliable messages sent inside batches
+			uint64_t framesSent = 0; //Batches, one per flush at most
+		};
+
+		//Paces what a client sends at a network rate of its own, separate from
+		//the frame rate. Reliable messages queued between network ticks go out
+		//together in one frame, and the latest-wins state message only goes
+		//out if it was set since the last send. The state may go over UDP, so
+		//while it stays unchanged it is resent at a low rate, otherwise losing
+		//the last datagram before the player stops would leave everyone else
+		//with a stale state for good.
+		template <typename T>
+		class send_scheduler {
+		public:
+			using clock = std::chrono::steady_clock;
+
+			explicit send_scheduler(double rateHz = 20.0, double idleResendHz = 1.0) {
+				setRate(rateHz);
+				setIdleResendRate(idleResendHz);
+			}
+
+			void setRate(double rateHz) {
+				period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / std::max(rateHz, 1.0)));
+			}
+
+			//How often an unchanged state is sent again
+			void setIdleResendRate(double rateHz) {
+				idlePeriod = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / std::max(rateHz, 0.01)));
+			}
+
+			//Send with the next batch
+			void queue(const hsc::net::packets::message<T>& msg) {
+				pending.push_back(msg);
+			}
+
+			//Replace the pending state, the caller decides when it is dirty
+			void setState(const hsc::net::packets::message<T>& msg) {
+				state = msg;
+				stateDirty = true;
+				hasState = true;
+			}
+
+			//Call every frame, sends whatever is due and returns true if
+			//anything went out
+			bool update(client_interface<T>& client, clock::time_point now = clock::now()) {
+				if (now < next) return false;
+				next += period;
+				if (next < now) next = now + period;
+
+				bool sent = false;
+				if (stateDirty || (hasState && now - stateSentAt >= idlePeriod)) {
+					//Later datagrams of the same id win, so a resend can't undo a newer state
+					client.sendUnreliable(state);
+					if (!stateDirty) stats.statesResent++;
+					stateDirty = false;
+					stateSentAt = now;
+					stats.statesSent++;
+					sent = true;
+				}
+				if (!pending.empty()) {
+					client.send(hsc::net::packets::shared_frame<T>::batch(pending.data(), pending.size()));
+					stats.messagesBatched += pending.size();
+					stats.framesSent++;
+					pending.clear();
+					sent = true;
+				}
+				if (sent) stats.flushes++;
+				return sent;
+			}
+
+			//When update() will next send, a network thread can sleep until then
+			clock::time_point nextSend() const {
+				return next;
+			}
+
+			const send_stats& getStats() const {
+				return stats;
+			}
+
+		private:
+			clock::duration period{};
+			clock::duration idlePeriod{};
+			clock::time_point next;
+			std::vector<hsc::net::packets::message<T>> pending;
+			hsc::net::packets::message<T> state;
+			clock::time_point stateSentAt; //Last time the state went out, changed or not
+			bool stateDirty = false;
+			bool hasState = false; //Nothing to resend until the first setState
+			send_stats stats;
 		};
 	}
 
@@ -611,7 +1826,9 @@ namespace hsc {
 		template <typename T>
 		class server_interface {
 		public:
-			server_interface(uint16_t port, const char* address) :asio_acceptor(context, asio::ip::tcp::endpoint(asio::ip::address::from_string(address), port)) {
+			server_interface(uint16_t port, const char* address, size_t inboundCapacity = 8192) :
+				asio_acceptor(asio::make_strand(context), asio::ip::tcp::endpoint(asio::ip::address::from_string(address), port)),
+				messagesIn(inboundCapacity) {
 
 			}
 
@@ -622,7 +1839,10 @@ namespace hsc {
 			bool start() {
 				try {
 					acceptClient();
-					asio_thread = std::thread([this]() {context.run(); });
+					if (udpChannel) udpChannel->start();
+					for (size_t i = 0; i < ioThreads; i++) {
+						asio_threads.emplace_back([this]() {context.run(); });
+					}
 				}
 				catch (const std::exception& e) {
 					std::cerr << "Exception while starting server: " << e.what() << std::endl;
@@ -633,16 +1853,62 @@ namespace hsc {
 				return true;
 			}
 			void stop() {
+				if (udpChannel) udpChannel->close();
 				context.stop();
-				if (asio_thread.joinable()) asio_thread.join();
+				for (auto& thread : asio_threads) {
+					if (thread.joinable()) thread.join();
+				}
+				asio_threads.clear();
 				std::cout << "Server stopped!" << std::endl;
 			}
 
-			//AYSNC- Wait for client connection
+			//How many threads run the io_context, call before start(). Every
+			//connection has its own strand so its reads and writes stay in
+			//order while different connections run in parallel.
+			void setIoThreads(size_t threads) {
+				ioThreads = std::max<size_t>(threads, 1);
+			}
+
+			//Open the unreliable channel on the same address and port as the
+			//acceptor, call before start()
+			bool enableUnreliable(size_t maxDatagram = 1200) {
+				try {
+					asio::ip::tcp::endpoint local = asio_acceptor.local_endpoint();
+					udpChannel = std::make_shared<hsc::net::udp_channel<T>>(context,
+						asio::ip::udp::endpoint(local.address(), local.port()), messagesIn,
+						[this](uint32_t id) { return findClient(id); }, true, maxDatagram);
+				}
+				catch (std::exception& e) {
+					std::cerr << "Exception while opening the unreliable channel: " << e.what() << std::endl;
+					return false;
+				}
+				return true;
+			}
+
+			//Look a connected client up by its ID
+			std::shared_ptr<hsc::net::connection<T>> findClient(uint32_t id) {
+				std::scoped_lock lock(muxConnections);
+				auto found = connectionsByID.find(id);
+				return found != connectionsByID.end() ? found->second : nullptr;
+			}
+
+			//Change how writes to new clients are flushed
+			void setWriteOptions(const hsc::net::write_options& options) {
+				writeOptions = options;
+			}
+
+			//Whether new clients are offered compression and what to compress
+			void setCompression(const hsc::net::compression_options& options) {
+				compressionOptions = options;
+			}
+
+			//AYSNC- Wait for client connection, each accepted socket gets a
+			//strand of its own so its handlers can run on any io thread
 			void acceptClient() {
-				asio_acceptor.async_accept(
+				asio_acceptor.async_accept(asio::make_strand(context),
 					[this](std::error_code ec, asio::ip::tcp::socket socket) {
 						if (!ec) {
+							metrics.accepts.mark();
 							std::cout << "New connection: " << socket.remote_endpoint() << std::endl;
 
 							std::shared_ptr<connection<T>> new_connection =
@@ -653,9 +1919,17 @@ namespace hsc {
 									messagesIn
 									);
 							if (onClientConnect(new_connection)) {
-								connections.push_back(std::move(new_connection));
-								connections.back()->connectToClient(this, idCounter++);
-								std::cout << "Connection made with ID:" << connections.back()->getID() << std::endl;
+								new_connection->setWriteOptions(writeOptions);
+								new_connection->setCompression(compressionOptions, compressionStats);
+								uint32_t uid = idCounter++;
+								if (udpChannel) new_connection->attachUdpChannel(udpChannel, uid);
+								{
+									std::scoped_lock lock(muxConnections);
+									connections.push_back(new_connection);
+									connectionsByID[uid] = new_connection;
+								}
+								new_connection->connectToClient(this, uid);
+								std::cout << "Connection made with ID:" << new_connection->getID() << std::endl;
 							}
 							else {
 								std::cout << "The new connection was denied" << std::endl;
@@ -671,45 +1945,214 @@ namespace hsc {
 			}
 
 			//Send a message to a client
-			void sendMessage(std::shared_ptr<hsc::net::connection<T>> client, const hsc::net::packets::message<T> msg) {
+			void sendMessage(std::shared_ptr<hsc::net::connection<T>> client, const hsc::net::packets::message<T>& msg) {
+				sendMessage(std::move(client), hsc::net::packets::shared_frame<T>(msg));
+			}
+
+			void sendMessage(std::shared_ptr<hsc::net::connection<T>> client, hsc::net::packets::shared_frame<T> frame) {
 				if (client && client->isConnected()) {
-					client->send(msg);
+					client->send(std::move(frame));
 				}
-				else {
-					onClientDisconnect(client);
-					client.reset();
-					connections.erase(std::remove(connections.begin(), connections.end(), client), connections.end());
+				else if (client) {
+					bool removed = false;
+					{
+						std::scoped_lock lock(muxConnections);
+						auto found = std::find(connections.begin(), connections.end(), client);
+						if (found != connections.end()) {
+							connectionsByID.erase(client->getID());
+							connections.erase(found);
+							removed = true;
+						}
+					}
+					//Whoever took it out of the list calls the hook, once
+					if (removed) onClientDisconnect(client);
 				}
 			}
 
-			//Send a message to all clients, and or specify one to ignore
-			void sendMessageAll(const hsc::net::packets::message<T> msg, std::shared_ptr<hsc::net::connection<T>> ignoredClient = nullptr) {
-				bool isInvalidClient = false;
-				for (auto& client : connections) {
-					if (client && client->isConnected()) {
-						if (client != ignoredClient) {
-							client->send(msg);
+			//Send a message to all clients, and or specify one to ignore. The
+			//message is serialised once and every client shares that frame.
+			void sendMessageAll(const hsc::net::packets::message<T>& msg, std::shared_ptr<hsc::net::connection<T>> ignoredClient = nullptr) {
+				sendMessageAll(hsc::net::packets::shared_frame<T>(msg), std::move(ignoredClient));
+			}
+
+			void sendMessageAll(const hsc::net::packets::shared_frame<T>& frame, std::shared_ptr<hsc::net::connection<T>> ignoredClient = nullptr) {
+				std::vector<std::shared_ptr<hsc::net::connection<T>>> dead;
+				{
+					std::scoped_lock lock(muxConnections);
+					for (auto& client : connections) {
+						if (client && client->isConnected()) {
+							if (client != ignoredClient) {
+								client->send(frame);
+							}
 						}
+						else dead.push_back(client);
 					}
-					else {
-						onClientDisconnect(client);
-						client.reset();
-						isInvalidClient = true;
+					takeDeadClients(dead);
+				}
+				for (auto& client : dead) onClientDisconnect(client);
+			}
+
+			//Drop connections whose socket has closed, calling
+			//onClientDisconnect for each one
+			void removeDeadClients() {
+				std::vector<std::shared_ptr<hsc::net::connection<T>>> dead;
+				{
+					std::scoped_lock lock(muxConnections);
+					for (auto& client : connections) {
+						if (!client || !client->isConnected()) dead.push_back(client);
+					}
+					takeDeadClients(dead);
+				}
+				for (auto& client : dead) onClientDisconnect(client);
+			}
+
+			//Call `fn` for every connected, validated client while holding the
+			//connections lock, so `fn` must not call back into sendMessage
+			template <typename Fn>
+			void forEachClient(Fn fn) {
+				std::scoped_lock lock(muxConnections);
+				for (auto& client : connections) {
+					if (client && client->isConnected() && client->isValidated()) {
+						fn(client);
+					}
+				}
+			}
+
+			size_t connectedClients() {
+				std::scoped_lock lock(muxConnections);
+				return connections.size();
+			}
+
+			const hsc::metrics::server_metrics& getMetrics() const {
+				return metrics;
+			}
+
+			//Record how long one game tick took, for the tick histogram
+			void observeTick(double ms) {
+				metrics.tickMs.observe(ms);
+			}
+
+			//Every metric in the Prometheus text format, per connection ones are
+			//labelled with the client ID
+			void writeMetrics(std::ostream& out) {
+				out << "# HELP hsc_connected_clients Open connections\n# TYPE hsc_connected_clients gauge\n"
+					<< "hsc_connected_clients " << connectedClients() << "\n";
+				out << "# HELP hsc_accepts_total Accepted sockets\n# TYPE hsc_accepts_total counter\n"
+					<< "hsc_accepts_total " << metrics.accepts.getTotal() << "\n";
+				out << "# HELP hsc_accepts_per_second Accepts per second over the last "
+					<< hsc::metrics::rate_window::window_seconds << " seconds\n# TYPE hsc_accepts_per_second gauge\n"
+					<< "hsc_accepts_per_second " << metrics.accepts.perSecond() << "\n";
+				out << "# HELP hsc_inbound_queue_depth Messages waiting for update()\n# TYPE hsc_inbound_queue_depth gauge\n"
+					<< "hsc_inbound_queue_depth " << messagesIn.count() << "\n";
+				metrics.updateMs.writePrometheus(out, "hsc_update_duration_ms", "Time handling one batch of inbound messages");
+				metrics.tickMs.writePrometheus(out, "hsc_tick_duration_ms", "Time spent in one game tick");
+
+				struct per_connection {
+					const char* name;
+					const char* type;
+					const char* help;
+					uint64_t (*value)(const connection<T>&);
+				};
+				static const per_connection columns[] = {
+					{ "hsc_connection_messages_in_total", "counter", "Messages received", [](const connection<T>& c) { return uint64_t(c.getReadStats().messages); } },
+					{ "hsc_connection_bytes_in_total", "counter", "Bytes received", [](const connection<T>& c) { return uint64_t(c.getReadStats().bytes); } },
+					{ "hsc_connection_read_stalls_total", "counter", "Times reading paused on a full inbound queue", [](const connection<T>& c) { return uint64_t(c.getReadStats().stalls); } },
+					{ "hsc_connection_messages_out_total", "counter", "Messages sent over TCP", [](const connection<T>& c) { return uint64_t(c.getWriteStats().messages); } },
+					{ "hsc_connection_bytes_out_total", "counter", "Bytes sent over TCP", [](const connection<T>& c) { return uint64_t(c.getWriteStats().bytes); } },
+					{ "hsc_connection_datagrams_out_total", "counter", "Messages sent over UDP", [](const connection<T>& c) { return uint64_t(c.getWriteStats().datagrams); } },
+					{ "hsc_connection_datagram_bytes_out_total", "counter", "Bytes sent over UDP", [](const connection<T>& c) { return uint64_t(c.getWriteStats().datagramBytes); } },
+					{ "hsc_connection_send_queue_depth", "gauge", "Frames waiting to be written", [](const connection<T>& c) { return uint64_t(c.getQueuedFrames()); } },
+				};
+				std::scoped_lock lock(muxConnections);
+				for (const per_connection& column : columns) {
+					out << "# HELP " << column.name << " " << column.help << "\n# TYPE " << column.name << " " << column.type << "\n";
+					for (const auto& client : connections) {
+						if (client) out << column.name << "{client=\"" << client->getID() << "\"} " << column.value(*client) << "\n";
+					}
+				}
+
+				//Latency is fractional, kept apart from the integer counters
+				static const char* const latencyNames[] = { "hsc_connection_rtt_ms", "hsc_connection_jitter_ms", "hsc_connection_clock_offset_ms" };
+				static const char* const latencyHelp[] = { "Smoothed ping round trip", "Smoothed round trip variation", "Client clock minus server clock" };
+				for (size_t i = 0; i < 3; i++) {
+					out << "# HELP " << latencyNames[i] << " " << latencyHelp[i] << "\n# TYPE " << latencyNames[i] << " gauge\n";
+					for (const auto& client : connections) {
+						if (!client) continue;
+						latency_estimate latency = client->getClockSync().getEstimate();
+						if (latency.samples == 0) continue;
+						double value = i == 0 ? latency.rttMs : i == 1 ? latency.jitterMs : latency.offsetMs;
+						out << latencyNames[i] << "{client=\"" << client->getID() << "\"} " << value << "\n";
 					}
 				}
-				if (isInvalidClient) {
-					connections.erase(std::remove(connections.begin(), connections.end(), nullptr), connections.end());
+
+				writeCompressionMetrics(out);
+			}
+
+			//Compression by message type and direction, over every connection
+			//there has been. Types never compressed are left out.
+			void writeCompressionMetrics(std::ostream& out) const {
+				struct per_type {
+					const char* name;
+					const char* type;
+					const char* help;
+					double (*value)(const hsc::net::compression_counters&);
+				};
+				static const per_type columns[] = {
+					{ "hsc_compression_messages_total", "counter", "Messages sent or received compressed", [](const hsc::net::compression_counters& c) { return double(c.messages); } },
+					{ "hsc_compression_skipped_total", "counter", "Messages over the threshold sent raw because they did not shrink", [](const hsc::net::compression_counters& c) { return double(c.skipped); } },
+					{ "hsc_compression_raw_bytes_total", "counter", "Body bytes before compression", [](const hsc::net::compression_counters& c) { return double(c.rawBytes); } },
+					{ "hsc_compression_wire_bytes_total", "counter", "Body bytes after compression", [](const hsc::net::compression_counters& c) { return double(c.wireBytes); } },
+					{ "hsc_compression_ratio", "gauge", "Raw bytes over wire bytes", [](const hsc::net::compression_counters& c) { return c.ratio(); } },
+					{ "hsc_compression_cpu_seconds_total", "counter", "Time spent compressing or decompressing on io threads", [](const hsc::net::compression_counters& c) { return double(c.nanoseconds) / 1e9; } },
+				};
+				for (const per_type& column : columns) {
+					out << "# HELP " << column.name << " " << column.help << "\n# TYPE " << column.name << " " << column.type << "\n";
+					for (size_t type = 0; type < hsc::net::compression_stats::max_types; type++) {
+						const hsc::net::compression_counters* directions[2] = { &compressionStats->sent[type], &compressionStats->received[type] };
+						for (int d = 0; d < 2; d++) {
+							const hsc::net::compression_counters& counters = *directions[d];
+							if (counters.messages.load(std::memory_order_relaxed) == 0 && counters.skipped.load(std::memory_order_relaxed) == 0) continue;
+							out << column.name << "{type=\"" << type << "\",direction=\"" << (d == 0 ? "sent" : "received") << "\"} " << column.value(counters) << "\n";
+						}
+					}
 				}
 			}
 
 			void update(size_t maxMessages = -1, bool wait = false) {
 				if (wait) messagesIn.wait();
-				size_t message_count = 0;
-				while (message_count < maxMessages && !messagesIn.empty()) {
-					auto msg = messagesIn.pop_front();
+				handleInbound(maxMessages);
+			}
+
+			//Handle messages as they arrive until `deadline`, used to fill the
+			//time between fixed rate ticks
+			template <typename Clock, typename Duration>
+			void updateUntil(const std::chrono::time_point<Clock, Duration>& deadline, size_t maxMessages = -1) {
+				while (Clock::now() < deadline) {
+					if (messagesIn.wait_until(deadline)) {
+						handleInbound(maxMessages);
+					}
+				}
+			}
+
+		protected:
+			void handleInbound(size_t maxMessages) {
+				//Take the whole backlog at once, then handle it without
+				//touching the queue again
+				inboundBatch.clear();
+				if (messagesIn.drain(inboundBatch, maxMessages) == 0) return;
+				auto started = std::chrono::steady_clock::now();
+				for (auto& msg : inboundBatch) {
+					handlingReceivedAt = msg.receivedAt;
 					onMessage(msg.remote, msg.msg);
-					message_count++;
 				}
+				inboundBatch.clear();
+				metrics.updateMs.observe(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count());
+			}
+
+			//When the message onMessage is handling came off the socket, in
+			//clock_sync::now() time
+			int64_t getReceivedAt() const {
+				return handlingReceivedAt;
 			}
 
 		public:
@@ -718,6 +2161,21 @@ namespace hsc {
 
 			}
 		protected:
+			//Takes the connections in `dead` out of the lists, muxConnections
+			//must be held. Empty slots are dropped from `dead` so what's left
+			//gets onClientDisconnect once the lock is released, a hook that
+			//sends or looks clients up would deadlock under it.
+			void takeDeadClients(std::vector<std::shared_ptr<hsc::net::connection<T>>>& dead) {
+				if (dead.empty()) return;
+				for (auto& client : dead) {
+					if (client) connectionsByID.erase(client->getID());
+				}
+				connections.erase(std::remove_if(connections.begin(), connections.end(), [&](const std::shared_ptr<hsc::net::connection<T>>& client) {
+					return !client || std::find(dead.begin(), dead.end(), client) != dead.end();
+				}), connections.end());
+				dead.erase(std::remove(dead.begin(), dead.end(), nullptr), dead.end());
+			}
+
 			//Called when a client joins, return true to accept them
 			virtual bool onClientConnect(std::shared_ptr<hsc::net::connection<T>> client) {
 				return false;
@@ -732,13 +2190,23 @@ namespace hsc {
 			}
 
 			asio::io_context context; //This is shared across all clients
-			std::thread asio_thread; //This is where asio stuff will ocur
-			asio::ip::tcp::acceptor asio_acceptor; //This accepts our clients
+			std::vector<std::thread> asio_threads; //This is where asio stuff will ocur
+			size_t ioThreads = 1; //How many asio_threads start() runs
+			asio::ip::tcp::acceptor asio_acceptor; //This accepts our clients, on its own strand
 
-			hsc::queues::thread_safe_queue<hsc::net::packets::owned_message<T>> messagesIn; //Messages to our end
+			hsc::queues::mpsc_queue<hsc::net::packets::owned_message<T>> messagesIn; //Messages to our end
+			std::vector<hsc::net::packets::owned_message<T>> inboundBatch; //Reused by update()
 			std::deque<std::shared_ptr<hsc::net::connection<T>>> connections; //This holds all active connections
+			std::unordered_map<uint32_t, std::shared_ptr<hsc::net::connection<T>>> connectionsByID; //Same connections, for datagram lookups
+			std::mutex muxConnections; //Accepts on io threads and sends from the game thread both touch connections
+			std::shared_ptr<hsc::net::udp_channel<T>> udpChannel; //Optional, see enableUnreliable
 
+			hsc::net::write_options writeOptions; //Applied to every new connection
+			hsc::net::compression_options compressionOptions; //Applied to every new connection
+			std::shared_ptr<hsc::net::compression_stats> compressionStats = std::make_shared<hsc::net::compression_stats>(); //Shared by every connection
 			uint32_t idCounter = 10000; //All clients will have an ID
+			hsc::metrics::server_metrics metrics;
+			int64_t handlingReceivedAt = 0; //See getReceivedAt
 		};
 	}
 }
@@ -0,0 +1,250 @@
+#pragma once
+
+#ifndef NET_COMPRESS_H
+#define NET_COMPRESS_H 1
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace hsc {
+	namespace net {
+		//A fast LZ compressor for message bodies, writing the LZ4 block
+		//format. Each end of a connection keeps the last lz_window bytes it
+		//compressed (or decompressed) as a dictionary for the next message,
+		//TCP delivers them in order so both dictionaries stay the same and a
+		//message much like an earlier one shrinks to a few matches.
+		constexpr size_t lz_window = 64 * 1024;
+
+		//Most an LZ4 block of size bytes can take, every byte a literal
+		constexpr size_t lz_bound(size_t size) {
+			return size + size / 255 + 16;
+		}
+
+		class lz_encoder {
+		public:
+			lz_encoder() {
+				table.fill(0);
+			}
+
+			//Appends the compressed form of data to out. Returns the bytes
+			//appended, or 0 and leaves out and the dictionary as they were
+			//when it doesn't come out smaller.
+			size_t compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+				const size_t history = window.size();
+				const size_t outStart = out.size();
+				window.insert(window.end(), data, data + size);
+				out.resize(outStart + lz_bound(size));
+
+				const uint8_t* const begin = window.data();
+				const uint8_t* const start = begin + history;
+				const uint8_t* const end = start + size;
+				const uint8_t* ip = start;
+				const uint8_t* anchor = start;
+				uint8_t* op = out.data() + outStart;
+
+				if (size >= min_input) {
+					const uint8_t* const matchLimit = end - last_literals;
+					const uint8_t* const searchLimit = end - match_find_limit;
+					uint32_t misses = 0;
+					while (ip < searchLimit) {
+						uint32_t position = positionOf(ip);
+						uint32_t& slot = table[hash(read32(ip))];
+						uint32_t candidate = slot;
+						slot = position;
+						uint32_t distance = position - candidate;
+						//Candidates from before the window or a rolled back message fail here
+						if (distance == 0 || distance > max_distance || distance > uint32_t(ip - begin) || read32(ip - distance) != read32(ip)) {
+							//Step further through data that isn't matching
+							ip += 1 + (misses++ >> skip_trigger);
+							continue;
+						}
+						misses = 0;
+						const uint8_t* match = ip - distance;
+						while (ip > anchor && match > begin && ip[-1] == match[-1]) {
+							ip--;
+							match--;
+						}
+						size_t length = min_match;
+						while (ip + length < matchLimit && ip[length] == match[length]) length++;
+
+						op = writeSequence(op, anchor, size_t(ip - anchor), uint16_t(distance), length);
+						ip += length;
+						anchor = ip;
+						if (ip - 2 > begin) table[hash(read32(ip - 2))] = positionOf(ip - 2);
+					}
+				}
+				op = writeLiterals(op, anchor, size_t(end - anchor));
+
+				size_t written = size_t(op - (out.data() + outStart));
+				if (written >= size) {
+					out.resize(outStart);
+					window.resize(history);
+					return 0;
+				}
+				out.resize(outStart + written);
+				trim();
+				return written;
+			}
+
+		private:
+			static constexpr size_t min_match = 4;
+			static constexpr size_t last_literals = 5;     //The format ends on at least this many literals
+			static constexpr size_t match_find_limit = 12; //and no match starts this close to the end
+			static constexpr size_t min_input = match_find_limit + 1;
+			static constexpr uint32_t max_distance = 65535;
+			static constexpr uint32_t skip_trigger = 6;
+			static constexpr int hash_bits = 12;
+
+			static uint32_t read32(const uint8_t* p) {
+				uint32_t value;
+				std::memcpy(&value, p, sizeof(value));
+				return value;
+			}
+
+			static uint32_t hash(uint32_t value) {
+				return (value * 2654435761u) >> (32 - hash_bits);
+			}
+
+			//Positions count every byte this encoder has kept, wrapping is fine
+			//as only differences between them are used
+			uint32_t positionOf(const uint8_t* p) const {
+				return base + uint32_t(p - window.data());
+			}
+
+			static uint8_t* writeLength(uint8_t* op, size_t length) {
+				while (length >= 255) {
+					*op++ = 255;
+					length -= 255;
+				}
+				*op++ = uint8_t(length);
+				return op;
+			}
+
+			static uint8_t* writeSequence(uint8_t* op, const uint8_t* literals, size_t literalCount, uint16_t distance, size_t matchLength) {
+				uint8_t* token = op++;
+				size_t extra = matchLength - min_match;
+				*token = uint8_t((std::min<size_t>(literalCount, 15) << 4) | std::min<size_t>(extra, 15));
+				if (literalCount >= 15) op = writeLength(op, literalCount - 15);
+				std::memcpy(op, literals, literalCount);
+				op += literalCount;
+				*op++ = uint8_t(distance);
+				*op++ = uint8_t(distance >> 8);
+				if (extra >= 15) op = writeLength(op, extra - 15);
+				return op;
+			}
+
+			static uint8_t* writeLiterals(uint8_t* op, const uint8_t* literals, size_t literalCount) {
+				*op++ = uint8_t(std::min<size_t>(literalCount, 15) << 4);
+				if (literalCount >= 15) op = writeLength(op, literalCount - 15);
+				std::memcpy(op, literals, literalCount);
+				return op + literalCount;
+			}
+
+			//Drop what matches can no longer reach, only once there's a whole
+			//window of it so the move is paid for rarely
+			void trim() {
+				if (window.size() <= 2 * lz_window) return;
+				size_t drop = window.size() - lz_window;
+				window.erase(window.begin(), window.begin() + drop);
+				base += uint32_t(drop);
+			}
+
+			std::vector<uint8_t> window; //Dictionary, then the message being compressed
+			uint32_t base = 0;           //Position of window[0]
+			std::array<uint32_t, size_t(1) << hash_bits> table;
+		};
+
+		class lz_decoder {
+		public:
+			//Decompresses exactly rawSize bytes into out, false if the input is
+			//malformed or doesn't decode to that size
+			bool decompress(const uint8_t* in, size_t inSize, uint8_t* out, size_t rawSize) {
+				const size_t history = window.size();
+				window.resize(history + rawSize);
+				uint8_t* const begin = window.data();
+				uint8_t* op = begin + history;
+				uint8_t* const outEnd = op + rawSize;
+				const uint8_t* ip = in;
+				const uint8_t* const inEnd = in + inSize;
+
+				bool ok = false;
+				while (ip < inEnd) {
+					uint8_t token = *ip++;
+					size_t literals = token >> 4;
+					if (literals == 15 && !readLength(ip, inEnd, literals)) break;
+					if (literals > size_t(inEnd - ip) || literals > size_t(outEnd - op)) break;
+					std::memcpy(op, ip, literals);
+					ip += literals;
+					op += literals;
+					if (ip == inEnd) {
+						ok = op == outEnd;
+						break;
+					}
+
+					if (inEnd - ip < 2) break;
+					size_t distance = size_t(ip[0]) | (size_t(ip[1]) << 8);
+					ip += 2;
+					if (distance == 0 || distance > size_t(op - begin)) break;
+					size_t length = token & 15;
+					if (length == 15 && !readLength(ip, inEnd, length)) break;
+					length += 4;
+					if (length > size_t(outEnd - op)) break;
+					//Matches may overlap what they write, so byte by byte
+					const uint8_t* match = op - distance;
+					for (size_t i = 0; i < length; i++) op[i] = match[i];
+					op += length;
+				}
+
+				if (!ok) {
+					window.resize(history);
+					return false;
+				}
+				std::memcpy(out, begin + history, rawSize);
+				if (window.size() > 2 * lz_window) window.erase(window.begin(), window.end() - lz_window);
+				return true;
+			}
+
+		private:
+			static bool readLength(const uint8_t*& ip, const uint8_t* inEnd, size_t& length) {
+				uint8_t more;
+				do {
+					if (ip == inEnd) return false;
+					more = *ip++;
+					length += more;
+				} while (more == 255);
+				return true;
+			}
+
+			std::vector<uint8_t> window; //Dictionary, then the message being decompressed
+		};
+
+		//Per message type counts for one direction of compression. Counted on
+		//io threads, read from anywhere.
+		struct compression_counters {
+			std::atomic<uint64_t> messages{ 0 };
+			std::atomic<uint64_t> rawBytes{ 0 };
+			std::atomic<uint64_t> wireBytes{ 0 };
+			std::atomic<uint64_t> nanoseconds{ 0 };
+			std::atomic<uint64_t> skipped{ 0 }; //Tried and sent raw, it didn't shrink
+
+			double ratio() const {
+				uint64_t wire = wireBytes.load(std::memory_order_relaxed);
+				return wire ? double(rawBytes.load(std::memory_order_relaxed)) / double(wire) : 0.0;
+			}
+		};
+
+		//Shared by every connection of a server, or owned by one client
+		struct compression_stats {
+			static constexpr size_t max_types = 32; //Message ids past this aren't counted
+
+			std::array<compression_counters, max_types> sent;
+			std::array<compression_counters, max_types> received;
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,229 @@
+#pragma once
+
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H 1
+
+#include <mesh_format.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace hsc {
+	namespace assets {
+		//One mesh read from an OBJ, indices still in file order
+		struct obj_mesh {
+			std::vector<mesh_vertex> vertices;
+			std::vector<uint32_t> indices;
+			std::vector<bool> needsNormal; //The OBJ gave no vn for this vertex
+		};
+
+		struct obj_scene {
+			std::vector<obj_mesh> meshes;
+			size_t faces = 0;
+		};
+
+		//Position, texcoord and normal index of one face corner, -1 when absent
+		struct obj_corner {
+			long v = -1, vt = -1, vn = -1;
+			bool operator==(const obj_corner& other) const {
+				return v == other.v && vt == other.vt && vn == other.vn;
+			}
+		};
+
+		struct obj_corner_hash {
+			size_t operator()(const obj_corner& c) const {
+				size_t h = std::hash<long>()(c.v);
+				h = h * 1000003u ^ std::hash<long>()(c.vt);
+				return h * 1000003u ^ std::hash<long>()(c.vn);
+			}
+		};
+
+		//OBJ indices are 1 based, negative ones count back from the end
+		inline long resolveObjIndex(long index, size_t count) {
+			if (index > 0) return index - 1;
+			if (index < 0) return long(count) + index;
+			return -1;
+		}
+
+		//Area weighted face normals for the vertices the OBJ left without one
+		inline void fillMissingNormals(obj_mesh& mesh) {
+			if (std::find(mesh.needsNormal.begin(), mesh.needsNormal.end(), true) == mesh.needsNormal.end()) return;
+			for (size_t t = 0; t < mesh.indices.size(); t += 3) {
+				const float* a = mesh.vertices[mesh.indices[t]].position;
+				const float* b = mesh.vertices[mesh.indices[t + 1]].position;
+				const float* c = mesh.vertices[mesh.indices[t + 2]].position;
+				float e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+				float e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+				float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+				for (size_t k = 0; k < 3; k++) {
+					uint32_t index = mesh.indices[t + k];
+					if (!mesh.needsNormal[index]) continue;
+					for (int i = 0; i < 3; i++) mesh.vertices[index].normal[i] += n[i];
+				}
+			}
+			for (size_t v = 0; v < mesh.vertices.size(); v++) {
+				if (!mesh.needsNormal[v]) continue;
+				float* n = mesh.vertices[v].normal;
+				float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				if (length > 0.0f) for (int i = 0; i < 3; i++) n[i] /= length;
+			}
+		}
+
+		//Reads the parts of OBJ the shipped models use: v, vt, vn, polygon f and
+		//o/g to start a new mesh. Corners are deduplicated into indexed vertices,
+		//meshes are split where they would overflow 16 bit indices. Safe to call
+		//from any thread.
+		inline bool parseObj(const std::string& path, obj_scene& scene, std::string& error) {
+			std::ifstream in(path, std::ios::binary);
+			if (!in) {
+				error = "can't open " + path;
+				return false;
+			}
+			std::stringstream text;
+			text << in.rdbuf();
+			const std::string source = text.str();
+
+			std::vector<float> positions, texcoords, normals;
+			std::unordered_map<obj_corner, uint32_t, obj_corner_hash> seen;
+			scene.meshes.emplace_back();
+
+			auto startMesh = [&]() {
+				if (!scene.meshes.back().indices.empty()) scene.meshes.emplace_back();
+				seen.clear();
+			};
+
+			auto addCorner = [&](const obj_corner& c) -> uint32_t {
+				obj_mesh& mesh = scene.meshes.back();
+				auto found = seen.find(c);
+				if (found != seen.end()) return found->second;
+
+				mesh_vertex vertex = {};
+				for (int i = 0; i < 3; i++) vertex.position[i] = positions[size_t(c.v) * 3 + i];
+				if (c.vt >= 0) {
+					vertex.texcoord[0] = texcoords[size_t(c.vt) * 2];
+					vertex.texcoord[1] = 1.0f - texcoords[size_t(c.vt) * 2 + 1]; //Flipped like raylib's own OBJ loader
+				}
+				if (c.vn >= 0) {
+					for (int i = 0; i < 3; i++) vertex.normal[i] = normals[size_t(c.vn) * 3 + i];
+				}
+				uint32_t index = uint32_t(mesh.vertices.size());
+				mesh.vertices.push_back(vertex);
+				mesh.needsNormal.push_back(c.vn < 0);
+				seen.emplace(c, index);
+				return index;
+			};
+
+			size_t lineNumber = 0;
+			std::vector<obj_corner> face;
+			const char* cursor = source.c_str();
+			const char* end = cursor + source.size();
+			while (cursor < end) {
+				const char* lineEnd = std::find(cursor, end, '\n');
+				std::string line(cursor, lineEnd);
+				cursor = lineEnd + 1;
+				lineNumber++;
+
+				const char* p = line.c_str();
+				while (*p == ' ' || *p == '\t') p++;
+				char* next = nullptr;
+				if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+					for (int i = 0; i < 3; i++) {
+						positions.push_back(std::strtof(p + 1, &next));
+						p = next - 1;
+					}
+				}
+				else if (p[0] == 'v' && p[1] == 't') {
+					p += 1;
+					for (int i = 0; i < 2; i++) {
+						texcoords.push_back(std::strtof(p + 1, &next));
+						p = next - 1;
+					}
+				}
+				else if (p[0] == 'v' && p[1] == 'n') {
+					p += 1;
+					for (int i = 0; i < 3; i++) {
+						normals.push_back(std::strtof(p + 1, &next));
+						p = next - 1;
+					}
+				}
+				else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+					face.clear();
+					p++;
+					while (true) {
+						while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+						if (*p == '\0') break;
+						obj_corner c;
+						c.v = resolveObjIndex(std::strtol(p, &next, 10), positions.size() / 3);
+						if (next == p) {
+							error = path + ":" + std::to_string(lineNumber) + ": bad face";
+							return false;
+						}
+						p = next;
+						if (*p == '/') {
+							p++;
+							if (*p != '/') {
+								c.vt = resolveObjIndex(std::strtol(p, &next, 10), texcoords.size() / 2);
+								p = next;
+							}
+							if (*p == '/') {
+								p++;
+								c.vn = resolveObjIndex(std::strtol(p, &next, 10), normals.size() / 3);
+								p = next;
+							}
+						}
+						if (c.v < 0 || size_t(c.v) >= positions.size() / 3 || size_t(c.vt + 1) > texcoords.size() / 2 || size_t(c.vn + 1) > normals.size() / 3) {
+							error = path + ":" + std::to_string(lineNumber) + ": face index out of range";
+							return false;
+						}
+						face.push_back(c);
+					}
+					if (face.size() < 3) continue;
+
+					//A fan of up to face.size() new vertices has to fit
+					if (scene.meshes.back().vertices.size() + face.size() > 0xFFFF) startMesh();
+					uint32_t first = addCorner(face[0]);
+					uint32_t previous = addCorner(face[1]);
+					for (size_t i = 2; i < face.size(); i++) {
+						uint32_t current = addCorner(face[i]);
+						auto& indices = scene.meshes.back().indices;
+						indices.push_back(first);
+						indices.push_back(previous);
+						indices.push_back(current);
+						previous = current;
+					}
+					scene.faces++;
+				}
+				else if ((p[0] == 'o' || p[0] == 'g') && (p[1] == ' ' || p[1] == '\t' || p[1] == '\r' || p[1] == '\0')) {
+					startMesh();
+				}
+			}
+			if (scene.meshes.back().indices.empty()) scene.meshes.pop_back();
+			if (scene.meshes.empty()) {
+				error = path + " has no faces";
+				return false;
+			}
+			for (obj_mesh& mesh : scene.meshes) fillMissingNormals(mesh);
+			return true;
+		}
+
+		inline mesh_bounds boundsOf(const std::vector<mesh_vertex>& vertices) {
+			mesh_bounds bounds = { { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f } };
+			if (vertices.empty()) return bounds;
+			for (int i = 0; i < 3; i++) bounds.min[i] = bounds.max[i] = vertices[0].position[i];
+			for (const mesh_vertex& vertex : vertices) {
+				for (int i = 0; i < 3; i++) {
+					bounds.min[i] = std::min(bounds.min[i], vertex.position[i]);
+					bounds.max[i] = std::max(bounds.max[i], vertex.position[i]);
+				}
+			}
+			return bounds;
+		}
+	}
+}
+
+#endif
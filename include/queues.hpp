@@ -0,0 +1,415 @@
+#pragma once
+
+#ifndef QUEUES_H
+#define QUEUES_H 1
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hsc {
+	namespace queues {
+		template <typename T>
+		class thread_safe_queue{
+		public:
+			thread_safe_queue() = default;
+			thread_safe_queue(const thread_safe_queue<T>&) = delete;
+			virtual ~thread_safe_queue() {clear();}
+
+		public:
+			const T& front(){
+				std::scoped_lock lock(muxQueue);
+				return deqQueue.front();
+			}
+
+			const T& back(){
+				std::scoped_lock lock(muxQueue);
+				return deqQueue.back();
+			}
+
+			void push_back(const T& item){
+				std::scoped_lock lock(muxQueue);
+				deqQueue.emplace_back(std::move(item));
+				std::unique_lock<std::mutex> ul(muxBlocking);
+				cvBlocking.notify_one();
+			}
+
+			void push_front(const T& item){
+				std::scoped_lock lock(muxQueue);
+				deqQueue.emplace_front(std::move(item));
+				std::unique_lock<std::mutex> ul(muxBlocking);
+				cvBlocking.notify_one();
+			}
+
+			bool empty(){
+				std::scoped_lock lock(muxQueue);
+				return deqQueue.empty();
+			}
+
+			size_t count(){
+				std::scoped_lock lock(muxQueue);
+				return deqQueue.size();
+			}
+
+			void clear(){
+				std::scoped_lock lock(muxQueue);
+				deqQueue.clear();
+			}
+
+			void wait()
+			{
+				while (empty())
+				{
+					std::unique_lock<std::mutex> ul(muxBlocking);
+					cvBlocking.wait(ul);
+				}
+			}
+
+			T pop_front(){
+				std::scoped_lock lock(muxQueue);
+				auto t = std::move(deqQueue.front());
+				deqQueue.pop_front();
+				return t;
+			}
+
+			T pop_back(){
+				std::scoped_lock lock(muxQueue);
+				auto t = std::move(deqQueue.back());
+				deqQueue.pop_back();
+				return t;
+			}
+
+		protected:
+			std::mutex muxQueue;
+			std::deque<T> deqQueue;
+			std::condition_variable cvBlocking;
+			std::mutex muxBlocking;
+		};
+
+		//Size of a cache line, used to keep indices written by different
+		//threads from sharing one.
+		constexpr size_t cache_line_size = 64;
+
+		//Lets a consumer sleep on a lock-free queue without spinning.
+		//Producers only take the mutex when the consumer is actually parked,
+		//so the fast path of a push is one fence and one atomic load.
+		class event_count {
+		public:
+			//Called by a producer after it has published an item
+			void notify() {
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (waiters.load(std::memory_order_relaxed) != 0) {
+					//Taking the lock makes sure the consumer is either still
+					//checking its predicate or already asleep, never in between
+					{ std::lock_guard<std::mutex> lock(muxBlocking); }
+					cvBlocking.notify_all();
+				}
+			}
+
+			//Called by the consumer, sleeps until `ready` returns true
+			template <typename Predicate>
+			void wait(Predicate ready) {
+				if (ready()) return;
+				std::unique_lock<std::mutex> ul(muxBlocking);
+				waiters.fetch_add(1, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				cvBlocking.wait(ul, ready);
+				waiters.fetch_sub(1, std::memory_order_relaxed);
+			}
+
+			//Same as wait but gives up at `deadline`, returns ready()
+			template <typename Clock, typename Duration, typename Predicate>
+			bool wait_until(const std::chrono::time_point<Clock, Duration>& deadline, Predicate ready) {
+				if (ready()) return true;
+				std::unique_lock<std::mutex> ul(muxBlocking);
+				waiters.fetch_add(1, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				bool result = cvBlocking.wait_until(ul, deadline, ready);
+				waiters.fetch_sub(1, std::memory_order_relaxed);
+				return result;
+			}
+
+		private:
+			std::atomic<uint32_t> waiters{ 0 };
+			std::condition_variable cvBlocking;
+			std::mutex muxBlocking;
+		};
+
+		//The producer side of a queue, connections push received messages
+		//into this without caring which kind of queue is behind it.
+		template <typename T>
+		class inbound_queue {
+		public:
+			virtual ~inbound_queue() {}
+
+			//Returns false without touching `item` if the queue is full
+			virtual bool try_push(T&& item) = 0;
+
+			//Whether every slot is taken, approximate from producers
+			virtual bool full() const = 0;
+
+			//Sleeps until there is space, only for threads that may block
+			//like the asset decoders. An io thread must not, it stops reading
+			//with whenSpace instead.
+			void push_back(T item) {
+				while (!try_push(std::move(item))) {
+					space.wait([this]() { return !full(); });
+				}
+			}
+
+			//Calls `resume` once, on the consumer thread after it next pops
+			//or right here if a slot is already free again. A producer whose
+			//try_push failed keeps the item and parks here, so it needs no
+			//thread of its own to wait on.
+			void whenSpace(std::function<void()> resume) {
+				{
+					std::lock_guard<std::mutex> lock(muxParked);
+					parked.push_back(std::move(resume));
+					hasParked.store(true, std::memory_order_relaxed);
+				}
+				//Pairs with the fence space.notify() makes in released(), either
+				//the consumer sees hasParked or we see the slot it freed
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (!full()) resumeParked();
+			}
+
+		protected:
+			//Called by the consumer after taking items out
+			void released() {
+				space.notify();
+				if (hasParked.load(std::memory_order_relaxed)) resumeParked();
+			}
+
+		private:
+			void resumeParked() {
+				std::vector<std::function<void()>> resuming;
+				{
+					std::lock_guard<std::mutex> lock(muxParked);
+					resuming.swap(parked);
+					hasParked.store(false, std::memory_order_relaxed);
+				}
+				for (auto& resume : resuming) resume();
+			}
+
+			event_count space; //Producers blocked in push_back
+			std::atomic<bool> hasParked{ false };
+			std::mutex muxParked;
+			std::vector<std::function<void()>> parked; //From whenSpace
+		};
+
+		//Bounded lock-free multi-producer/single-consumer ring queue. Each
+		//cell carries a sequence number that says whether it is free for
+		//the producer at `pos` or filled for the consumer at `pos`.
+		template <typename T>
+		class mpsc_queue : public inbound_queue<T> {
+		public:
+			explicit mpsc_queue(size_t capacity = 8192) {
+				//Round up to a power of two so indices can be masked
+				size_t size = 2;
+				while (size < capacity) size <<= 1;
+				mask = size - 1;
+				cells.reset(new cell[size]);
+				for (size_t i = 0; i < size; i++) {
+					cells[i].sequence.store(i, std::memory_order_relaxed);
+				}
+			}
+			mpsc_queue(const mpsc_queue<T>&) = delete;
+
+		public:
+			bool try_push(T&& item) override {
+				cell* c;
+				size_t pos = tail.load(std::memory_order_relaxed);
+				for (;;) {
+					c = &cells[pos & mask];
+					size_t seq = c->sequence.load(std::memory_order_acquire);
+					intptr_t diff = intptr_t(seq) - intptr_t(pos);
+					if (diff == 0) {
+						if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+					}
+					else if (diff < 0) {
+						return false; //Full
+					}
+					else {
+						pos = tail.load(std::memory_order_relaxed);
+					}
+				}
+				c->data = std::move(item);
+				c->sequence.store(pos + 1, std::memory_order_release);
+				signal.notify();
+				return true;
+			}
+
+			//Only call these from the consumer thread
+			bool empty() const {
+				size_t pos = head.load(std::memory_order_relaxed);
+				return cells[pos & mask].sequence.load(std::memory_order_acquire) != pos + 1;
+			}
+
+			bool try_pop(T& item) {
+				if (!drain_one([&item](T&& t) { item = std::move(t); })) return false;
+				this->released();
+				return true;
+			}
+
+			//Move up to `max` messages onto the end of `batch` in one go,
+			//returns how many were taken
+			size_t drain(std::vector<T>& batch, size_t max = -1) {
+				size_t taken = 0;
+				while (taken < max && drain_one([&batch](T&& t) { batch.emplace_back(std::move(t)); })) {
+					taken++;
+				}
+				if (taken > 0) this->released();
+				return taken;
+			}
+
+			//Sleep until there is something to pop
+			void wait() {
+				signal.wait([this]() { return !empty(); });
+			}
+
+			//Sleep until there is something to pop or `deadline` passes
+			template <typename Clock, typename Duration>
+			bool wait_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+				return signal.wait_until(deadline, [this]() { return !empty(); });
+			}
+
+			//Approximate, safe to call from any thread
+			size_t count() const {
+				return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_relaxed);
+			}
+
+			//Every push claims the next position, any thread may read this. A
+			//push that returned before the read is below it.
+			size_t pushPosition() const {
+				return tail.load(std::memory_order_acquire);
+			}
+
+			//Everything below this has been popped, consumer thread only
+			size_t popPosition() const {
+				return head.load(std::memory_order_relaxed);
+			}
+
+			size_t capacity() const {
+				return mask + 1;
+			}
+
+			bool full() const override {
+				//Head first, tail only grows so this can't wrap below zero
+				size_t pos = head.load(std::memory_order_acquire);
+				return tail.load(std::memory_order_acquire) - pos > mask;
+			}
+
+		private:
+			struct cell {
+				std::atomic<size_t> sequence;
+				T data;
+			};
+
+			template <typename Sink>
+			bool drain_one(Sink sink) {
+				size_t pos = head.load(std::memory_order_relaxed);
+				cell& c = cells[pos & mask];
+				if (c.sequence.load(std::memory_order_acquire) != pos + 1) return false;
+				sink(std::move(c.data));
+				c.sequence.store(pos + mask + 1, std::memory_order_release);
+				head.store(pos + 1, std::memory_order_relaxed);
+				return true;
+			}
+
+			std::unique_ptr<cell[]> cells;
+			size_t mask = 0;
+			alignas(cache_line_size) std::atomic<size_t> tail{ 0 }; //Shared by producers
+			alignas(cache_line_size) std::atomic<size_t> head{ 0 }; //Owned by the consumer
+			event_count signal;
+		};
+
+		//Bounded lock-free single-producer/single-consumer ring queue, used
+		//by the client where only one connection ever pushes.
+		template <typename T>
+		class spsc_queue : public inbound_queue<T> {
+		public:
+			explicit spsc_queue(size_t capacity = 4096) {
+				size_t size = 2;
+				while (size < capacity) size <<= 1;
+				mask = size - 1;
+				items.reset(new T[size]);
+			}
+			spsc_queue(const spsc_queue<T>&) = delete;
+
+		public:
+			bool try_push(T&& item) override {
+				size_t pos = tail.load(std::memory_order_relaxed);
+				if (pos - head.load(std::memory_order_acquire) > mask) return false; //Full
+				items[pos & mask] = std::move(item);
+				tail.store(pos + 1, std::memory_order_release);
+				signal.notify();
+				return true;
+			}
+
+			bool empty() const {
+				return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+			}
+
+			bool try_pop(T& item) {
+				size_t pos = head.load(std::memory_order_relaxed);
+				if (pos == tail.load(std::memory_order_acquire)) return false;
+				item = std::move(items[pos & mask]);
+				head.store(pos + 1, std::memory_order_release);
+				this->released();
+				return true;
+			}
+
+			size_t drain(std::vector<T>& batch, size_t max = -1) {
+				size_t pos = head.load(std::memory_order_relaxed);
+				size_t available = tail.load(std::memory_order_acquire) - pos;
+				size_t taken = std::min(available, max);
+				for (size_t i = 0; i < taken; i++) {
+					batch.emplace_back(std::move(items[(pos + i) & mask]));
+				}
+				head.store(pos + taken, std::memory_order_release);
+				if (taken > 0) this->released();
+				return taken;
+			}
+
+			void wait() {
+				signal.wait([this]() { return !empty(); });
+			}
+
+			template <typename Clock, typename Duration>
+			bool wait_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+				return signal.wait_until(deadline, [this]() { return !empty(); });
+			}
+
+			size_t count() const {
+				return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_relaxed);
+			}
+
+			size_t capacity() const {
+				return mask + 1;
+			}
+
+			bool full() const override {
+				//Head first, tail only grows so this can't wrap below zero
+				size_t pos = head.load(std::memory_order_acquire);
+				return tail.load(std::memory_order_acquire) - pos > mask;
+			}
+
+		private:
+			std::unique_ptr<T[]> items;
+			size_t mask = 0;
+			alignas(cache_line_size) std::atomic<size_t> tail{ 0 }; //Owned by the producer
+			alignas(cache_line_size) std::atomic<size_t> head{ 0 }; //Owned by the consumer
+			event_count signal;
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,281 @@
+#pragma once
+
+#ifndef RENDER_BATCH_H
+#define RENDER_BATCH_H 1
+
+#include "raylib.h"
+#include "rlgl.h"
+#include "raymath.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace hsc {
+	namespace render {
+		//The six planes of a camera's view volume, normals pointing inwards.
+		//Pure maths so culling can be tested without a window.
+		struct frustum {
+			Vector4 planes[6]; //left, right, bottom, top, near, far as ax + by + cz + d >= 0
+
+			//Same projection BeginMode3D sets up, near and far default to rlgl's
+			static frustum fromCamera(const Camera& camera, float aspect, float nearPlane = 0.01f, float farPlane = 1000.0f) {
+				Matrix view = MatrixLookAt(camera.position, camera.target, camera.up);
+				Matrix projection;
+				if (camera.projection == CAMERA_ORTHOGRAPHIC) {
+					double top = camera.fovy / 2.0;
+					projection = MatrixOrtho(-top * aspect, top * aspect, -top, top, nearPlane, farPlane);
+				}
+				else projection = MatrixPerspective(camera.fovy * DEG2RAD, aspect, nearPlane, farPlane);
+				return fromMatrix(MatrixMultiply(view, projection));
+			}
+
+			//Gribb and Hartmann: each plane is the last row of the view
+			//projection matrix plus or minus one of the others
+			static frustum fromMatrix(const Matrix& m) {
+				const Vector4 rows[4] = {
+					{ m.m0, m.m4, m.m8, m.m12 },
+					{ m.m1, m.m5, m.m9, m.m13 },
+					{ m.m2, m.m6, m.m10, m.m14 },
+					{ m.m3, m.m7, m.m11, m.m15 }
+				};
+				frustum result;
+				for (int axis = 0; axis < 3; axis++) {
+					result.planes[axis * 2] = normalize(add(rows[3], rows[axis], 1.0f));
+					result.planes[axis * 2 + 1] = normalize(add(rows[3], rows[axis], -1.0f));
+				}
+				return result;
+			}
+
+			//False only when the box is entirely outside one plane, boxes near
+			//a corner can pass without being visible which only costs a draw
+			bool intersects(const BoundingBox& box) const {
+				for (const Vector4& plane : planes) {
+					//The corner furthest along the plane's normal
+					Vector3 positive = {
+						plane.x >= 0.0f ? box.max.x : box.min.x,
+						plane.y >= 0.0f ? box.max.y : box.min.y,
+						plane.z >= 0.0f ? box.max.z : box.min.z
+					};
+					if (plane.x * positive.x + plane.y * positive.y + plane.z * positive.z + plane.w < 0.0f) return false;
+				}
+				return true;
+			}
+
+			bool intersects(Vector3 center, float radius) const {
+				for (const Vector4& plane : planes) {
+					if (plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w < -radius) return false;
+				}
+				return true;
+			}
+
+		private:
+			static Vector4 add(Vector4 a, Vector4 b, float sign) {
+				return { a.x + sign * b.x, a.y + sign * b.y, a.z + sign * b.z, a.w + sign * b.w };
+			}
+
+			static Vector4 normalize(Vector4 plane) {
+				float length = sqrtf(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+				if (length == 0.0f) return plane;
+				return { plane.x / length, plane.y / length, plane.z / length, plane.w / length };
+			}
+		};
+
+		//How many pixels a length in the world covers on screen
+		struct screen_projection {
+			float pixelsPerUnit; //At distance 1 for a perspective camera
+			bool perspective;
+
+			static screen_projection fromCamera(const Camera& camera, float screenHeight) {
+				if (camera.projection == CAMERA_ORTHOGRAPHIC) return { screenHeight / camera.fovy, false };
+				return { screenHeight / (2.0f * tanf(camera.fovy * DEG2RAD * 0.5f)), true };
+			}
+
+			float pixels(float length, float distance) const {
+				return perspective ? length * pixelsPerUnit / std::max(distance, 0.01f) : length * pixelsPerUnit;
+			}
+		};
+
+		//Picks a level of detail from how many pixels each level's error
+		//covers at this distance, the coarsest one under tolerancePixels.
+		//errors are in model units growing with the level, scale is the
+		//instance's. A level is only left once its error is `hysteresis`
+		//past the tolerance either way, so an instance sitting right on a
+		//switching distance keeps its level instead of flickering.
+		inline int selectLod(const std::vector<float>& errors, int current, float scale, float distance, const screen_projection& projection,
+			float tolerancePixels = 4.0f, float hysteresis = 0.25f) {
+			const int last = int(errors.size()) - 1;
+			int lod = std::max(0, std::min(current, last));
+			auto projected = [&](int level) { return projection.pixels(errors[size_t(level)] * scale, distance); };
+			while (lod > 0 && projected(lod) > tolerancePixels * (1.0f + hysteresis)) lod--;
+			while (lod < last && projected(lod + 1) < tolerancePixels * (1.0f - hysteresis)) lod++;
+			return lod;
+		}
+
+		//What drawing a group took
+		struct draw_counts {
+			size_t drawCalls = 0;
+			size_t triangles = 0;
+		};
+
+		struct batch_stats {
+			size_t submitted = 0;
+			size_t culled = 0;
+			size_t groups = 0;    //Groups with at least one visible instance
+			size_t drawCalls = 0; //What the flush callback reported
+			size_t triangles = 0;
+		};
+
+		//Culls instances against the frustum and sorts the visible ones into
+		//groups by a caller chosen key, one group per mesh and material
+		//combination. Needs no GL, the transforms are handed to a renderer.
+		//Groups keep their storage between frames so steady scenes don't
+		//allocate.
+		class instance_groups {
+		public:
+			struct group {
+				uint64_t key;
+				std::vector<Matrix> transforms;
+			};
+
+			void begin(const frustum& view) {
+				current = view;
+				for (group& g : groups) g.transforms.clear();
+				stats = batch_stats();
+			}
+
+			//True when the instance is visible and was queued
+			bool submit(uint64_t key, const BoundingBox& worldBounds, const Matrix& transform) {
+				stats.submitted++;
+				if (!current.intersects(worldBounds)) {
+					stats.culled++;
+					return false;
+				}
+				auto found = index.find(key);
+				if (found == index.end()) {
+					found = index.emplace(key, groups.size()).first;
+					groups.push_back({ key, {} });
+				}
+				std::vector<Matrix>& transforms = groups[found->second].transforms;
+				if (transforms.empty()) stats.groups++;
+				transforms.push_back(transform);
+				return true;
+			}
+
+			//Calls draw(key, transforms, count) once per group with visible
+			//instances, it returns the draw_counts it took
+			template <typename Draw>
+			void flush(Draw&& draw) {
+				for (const group& g : groups) {
+					if (g.transforms.empty()) continue;
+					draw_counts counts = draw(g.key, g.transforms.data(), int(g.transforms.size()));
+					stats.drawCalls += counts.drawCalls;
+					stats.triangles += counts.triangles;
+				}
+			}
+
+			const batch_stats& getStats() const {
+				return stats;
+			}
+
+		private:
+			frustum current = {};
+			std::vector<group> groups;
+			std::unordered_map<uint64_t, size_t> index;
+			batch_stats stats;
+		};
+
+		//Draws a group of instances with one DrawMeshInstanced per mesh. Owns
+		//the instancing shader, where it can't be compiled (GLES2 without
+		//instancing) every instance gets its own DrawMesh instead.
+		class instanced_renderer {
+		public:
+			//Needs the window (and GL context) to exist
+			instanced_renderer() {
+				shader = LoadShaderFromMemory(vertex_shader, fragment_shader);
+				instancing = shader.id != rlGetShaderIdDefault();
+				if (instancing) {
+					shader.locs[SHADER_LOC_MATRIX_MVP] = GetShaderLocation(shader, "mvp");
+					shader.locs[SHADER_LOC_MATRIX_MODEL] = GetShaderLocationAttrib(shader, "instanceTransform");
+				}
+				else TraceLog(LOG_WARNING, "RENDER: Instancing shader unavailable, drawing instances one by one");
+			}
+
+			instanced_renderer(const instanced_renderer&) = delete;
+			instanced_renderer& operator=(const instanced_renderer&) = delete;
+
+			~instanced_renderer() {
+				unload();
+			}
+
+			//Call before CloseWindow
+			void unload() {
+				if (instancing) UnloadShader(shader);
+				instancing = false;
+				shader = { 0 };
+			}
+
+			//Every mesh of the model with its own material, the diffuse map
+			//swapped for `texture` and tinted
+			draw_counts draw(const Model& model, Texture2D texture, Color tint, const Matrix* transforms, int count) {
+				draw_counts counts;
+				for (int m = 0; m < model.meshCount; m++) {
+					//The maps array belongs to the model, put it back as it was
+					MaterialMap& diffuse = model.materials[model.meshMaterial[m]].maps[MATERIAL_MAP_DIFFUSE];
+					MaterialMap saved = diffuse;
+					diffuse.texture = texture;
+					diffuse.color = tint;
+					counts.drawCalls += drawMesh(model.meshes[m], model.materials[model.meshMaterial[m]], transforms, count);
+					counts.triangles += size_t(model.meshes[m].triangleCount) * size_t(count);
+					diffuse = saved;
+				}
+				return counts;
+			}
+
+			size_t drawMesh(const Mesh& mesh, Material material, const Matrix* transforms, int count) {
+				if (!instancing) {
+					for (int i = 0; i < count; i++) DrawMesh(mesh, material, transforms[i]);
+					return size_t(count);
+				}
+				material.shader = shader;
+				DrawMeshInstanced(mesh, material, transforms, count);
+				return 1;
+			}
+
+		private:
+			//raylib's default shader with a per-instance model matrix
+			static constexpr const char* vertex_shader = R"(#version 330
+in vec3 vertexPosition;
+in vec2 vertexTexCoord;
+in vec4 vertexColor;
+in mat4 instanceTransform;
+uniform mat4 mvp;
+out vec2 fragTexCoord;
+out vec4 fragColor;
+void main()
+{
+    fragTexCoord = vertexTexCoord;
+    fragColor = vertexColor;
+    gl_Position = mvp*instanceTransform*vec4(vertexPosition, 1.0);
+}
+)";
+			static constexpr const char* fragment_shader = R"(#version 330
+in vec2 fragTexCoord;
+in vec4 fragColor;
+uniform sampler2D texture0;
+uniform vec4 colDiffuse;
+out vec4 finalColor;
+void main()
+{
+    finalColor = texture(texture0, fragTexCoord)*colDiffuse*fragColor;
+}
+)";
+
+			Shader shader = { 0 };
+			bool instancing = false;
+		};
+	}
+}
+
+#endif
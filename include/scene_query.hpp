@@ -0,0 +1,509 @@
+#pragma once
+
+#ifndef SCENE_QUERY_H
+#define SCENE_QUERY_H 1
+
+#include "raylib.h"
+#include "raymath.h"
+#include <asset_manager.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace hsc {
+	namespace spatial {
+		//Dynamic bounding volume tree over boxes that come, go and move, the
+		//top level above the per-mesh BVHs. Leaves are inserted where they
+		//grow the tree's surface area least and AVL style rotations keep it
+		//balanced, so queries stay logarithmic in the number of leaves.
+		//
+		//Leaves store their box grown by a margin. Moving a leaf inside its
+		//margin costs nothing, leaving it takes the leaf out and reinserts
+		//it, which refits and rebalances only the ancestors on the way.
+		class aabb_tree {
+		public:
+			static constexpr uint32_t null_node = UINT32_MAX;
+
+			explicit aabb_tree(float margin = 0.5f) : margin(margin) {}
+
+			//Returns the leaf's id, stable until it is removed
+			uint32_t insert(BoundingBox bounds, uint32_t userData) {
+				uint32_t leaf = allocate();
+				nodes[leaf].bounds = fatten(bounds);
+				nodes[leaf].userData = userData;
+				nodes[leaf].height = 0;
+				insertLeaf(leaf);
+				leafCount++;
+				return leaf;
+			}
+
+			void remove(uint32_t leaf) {
+				removeLeaf(leaf);
+				release(leaf);
+				leafCount--;
+			}
+
+			//True when the leaf had to be reinserted
+			bool move(uint32_t leaf, BoundingBox bounds) {
+				if (contains(nodes[leaf].bounds, bounds)) return false;
+				removeLeaf(leaf);
+				nodes[leaf].bounds = fatten(bounds);
+				insertLeaf(leaf);
+				return true;
+			}
+
+			uint32_t getUserData(uint32_t leaf) const {
+				return nodes[leaf].userData;
+			}
+
+			//The stored box, grown by the margin
+			BoundingBox getFatBounds(uint32_t leaf) const {
+				return nodes[leaf].bounds;
+			}
+
+			size_t size() const {
+				return leafCount;
+			}
+
+			int getHeight() const {
+				return root == null_node ? 0 : nodes[root].height;
+			}
+
+			//Calls visit(userData) for every leaf whose box overlaps `box`
+			template <typename Visit>
+			void queryBox(BoundingBox box, Visit&& visit) const {
+				query([&](const BoundingBox& bounds) { return overlaps(bounds, box); }, visit);
+			}
+
+			//Calls visit(userData) for every leaf whose box the sphere touches
+			template <typename Visit>
+			void querySphere(Vector3 center, float radius, Visit&& visit) const {
+				query([&](const BoundingBox& bounds) { return distanceSquared(bounds, center) <= radius * radius; }, visit);
+			}
+
+			//Visits leaves the ray enters within maxDistance, nearer subtrees
+			//first. visit(userData, entryDistance) returns the distance the
+			//search still has to cover, so a hit found early prunes the rest.
+			template <typename Visit>
+			void queryRay(Ray ray, float maxDistance, Visit&& visit) const {
+				if (root == null_node) return;
+				//A large finite inverse for axes the ray runs parallel to, an
+				//infinite one makes 0 * inf a NaN for boxes whose face the origin is on
+				auto invert = [](float d) { return d != 0.0f ? 1.0f / d : std::copysign(parallel_inverse, d); };
+				Vector3 inverse = { invert(ray.direction.x), invert(ray.direction.y), invert(ray.direction.z) };
+				float entry;
+				if (!rayEnters(nodes[root].bounds, ray.position, inverse, maxDistance, entry)) return;
+
+				std::vector<std::pair<uint32_t, float>>& stack = scratch;
+				stack.clear();
+				stack.push_back({ root, entry });
+				while (!stack.empty()) {
+					std::pair<uint32_t, float> top = stack.back();
+					stack.pop_back();
+					if (top.second > maxDistance) continue;
+					const tree_node& node = nodes[top.first];
+					if (node.isLeaf()) {
+						maxDistance = std::min(maxDistance, visit(node.userData, top.second));
+						continue;
+					}
+					float entry1, entry2;
+					bool hit1 = rayEnters(nodes[node.child1].bounds, ray.position, inverse, maxDistance, entry1);
+					bool hit2 = rayEnters(nodes[node.child2].bounds, ray.position, inverse, maxDistance, entry2);
+					//Push the far child first so the near one is popped next
+					if (hit1 && hit2) {
+						if (entry1 <= entry2) {
+							stack.push_back({ node.child2, entry2 });
+							stack.push_back({ node.child1, entry1 });
+						}
+						else {
+							stack.push_back({ node.child1, entry1 });
+							stack.push_back({ node.child2, entry2 });
+						}
+					}
+					else if (hit1) stack.push_back({ node.child1, entry1 });
+					else if (hit2) stack.push_back({ node.child2, entry2 });
+				}
+			}
+
+			//Slab test, entry is 0 when the ray starts inside the box
+			static bool rayEnters(const BoundingBox& box, Vector3 origin, Vector3 inverse, float maxDistance, float& entry) {
+				float near = -FLT_MAX, far = FLT_MAX;
+				if (!slab(box.min.x, box.max.x, origin.x, inverse.x, near, far)) return false;
+				if (!slab(box.min.y, box.max.y, origin.y, inverse.y, near, far)) return false;
+				if (!slab(box.min.z, box.max.z, origin.z, inverse.z, near, far)) return false;
+				entry = std::max(near, 0.0f);
+				return far >= entry && entry <= maxDistance;
+			}
+
+			static bool overlaps(const BoundingBox& a, const BoundingBox& b) {
+				return a.min.x <= b.max.x && a.max.x >= b.min.x &&
+					a.min.y <= b.max.y && a.max.y >= b.min.y &&
+					a.min.z <= b.max.z && a.max.z >= b.min.z;
+			}
+
+			static float distanceSquared(const BoundingBox& box, Vector3 p) {
+				float dx = std::max({ box.min.x - p.x, 0.0f, p.x - box.max.x });
+				float dy = std::max({ box.min.y - p.y, 0.0f, p.y - box.max.y });
+				float dz = std::max({ box.min.z - p.z, 0.0f, p.z - box.max.z });
+				return dx * dx + dy * dy + dz * dz;
+			}
+
+		private:
+			static constexpr float parallel_inverse = 1e30f;
+
+			//Narrows [near, far] to where the ray is between one axis' planes.
+			//Parallel to the axis only the origin decides, a ray along a face
+			//counts as touching the box.
+			static bool slab(float min, float max, float origin, float inverse, float& near, float& far) {
+				if (std::fabs(inverse) >= parallel_inverse) return origin >= min && origin <= max;
+				float t1 = (min - origin) * inverse, t2 = (max - origin) * inverse;
+				near = std::max(near, std::min(t1, t2));
+				far = std::min(far, std::max(t1, t2));
+				return true;
+			}
+
+			struct tree_node {
+				BoundingBox bounds = { 0 };
+				uint32_t parent = null_node; //Next free node while on the free list
+				uint32_t child1 = null_node;
+				uint32_t child2 = null_node;
+				int32_t height = -1;         //0 for a leaf, -1 when free
+				uint32_t userData = 0;
+
+				bool isLeaf() const {
+					return child1 == null_node;
+				}
+			};
+
+			template <typename Test, typename Visit>
+			void query(Test&& test, Visit&& visit) const {
+				if (root == null_node) return;
+				std::vector<std::pair<uint32_t, float>>& stack = scratch;
+				stack.clear();
+				stack.push_back({ root, 0.0f });
+				while (!stack.empty()) {
+					const tree_node& node = nodes[stack.back().first];
+					stack.pop_back();
+					if (!test(node.bounds)) continue;
+					if (node.isLeaf()) visit(node.userData);
+					else {
+						stack.push_back({ node.child1, 0.0f });
+						stack.push_back({ node.child2, 0.0f });
+					}
+				}
+			}
+
+			static BoundingBox merge(const BoundingBox& a, const BoundingBox& b) {
+				return { Vector3{ std::min(a.min.x, b.min.x), std::min(a.min.y, b.min.y), std::min(a.min.z, b.min.z) },
+					Vector3{ std::max(a.max.x, b.max.x), std::max(a.max.y, b.max.y), std::max(a.max.z, b.max.z) } };
+			}
+
+			static float area(const BoundingBox& box) {
+				Vector3 e = Vector3Subtract(box.max, box.min);
+				return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+			}
+
+			static bool contains(const BoundingBox& outer, const BoundingBox& inner) {
+				return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y && outer.min.z <= inner.min.z &&
+					outer.max.x >= inner.max.x && outer.max.y >= inner.max.y && outer.max.z >= inner.max.z;
+			}
+
+			BoundingBox fatten(BoundingBox box) const {
+				return { Vector3SubtractValue(box.min, margin), Vector3AddValue(box.max, margin) };
+			}
+
+			uint32_t allocate() {
+				if (freeList == null_node) {
+					nodes.emplace_back();
+					return uint32_t(nodes.size() - 1);
+				}
+				uint32_t node = freeList;
+				freeList = nodes[node].parent;
+				nodes[node] = tree_node();
+				return node;
+			}
+
+			void release(uint32_t node) {
+				nodes[node].parent = freeList;
+				nodes[node].height = -1;
+				freeList = node;
+			}
+
+			//Walks down towards the cheapest sibling, a branch is only worth
+			//following while what it would add stays under pairing up here
+			void insertLeaf(uint32_t leaf) {
+				if (root == null_node) {
+					root = leaf;
+					nodes[root].parent = null_node;
+					return;
+				}
+
+				const BoundingBox leafBounds = nodes[leaf].bounds;
+				uint32_t index = root;
+				while (!nodes[index].isLeaf()) {
+					const tree_node& node = nodes[index];
+					float nodeArea = area(node.bounds);
+					float combinedArea = area(merge(node.bounds, leafBounds));
+					float cost = 2.0f * combinedArea;               //New parent for this node and the leaf
+					float inheritance = 2.0f * (combinedArea - nodeArea); //Growth every child below pays
+
+					auto descendCost = [&](uint32_t child) {
+						BoundingBox grown = merge(leafBounds, nodes[child].bounds);
+						if (nodes[child].isLeaf()) return area(grown) + inheritance;
+						return area(grown) - area(nodes[child].bounds) + inheritance;
+					};
+					float cost1 = descendCost(node.child1);
+					float cost2 = descendCost(node.child2);
+					if (cost < cost1 && cost < cost2) break;
+					index = cost1 < cost2 ? node.child1 : node.child2;
+				}
+
+				uint32_t sibling = index;
+				uint32_t oldParent = nodes[sibling].parent;
+				uint32_t newParent = allocate();
+				nodes[newParent].parent = oldParent;
+				nodes[newParent].bounds = merge(leafBounds, nodes[sibling].bounds);
+				nodes[newParent].height = nodes[sibling].height + 1;
+				nodes[newParent].child1 = sibling;
+				nodes[newParent].child2 = leaf;
+				nodes[sibling].parent = newParent;
+				nodes[leaf].parent = newParent;
+				if (oldParent == null_node) root = newParent;
+				else if (nodes[oldParent].child1 == sibling) nodes[oldParent].child1 = newParent;
+				else nodes[oldParent].child2 = newParent;
+
+				refit(nodes[leaf].parent);
+			}
+
+			void removeLeaf(uint32_t leaf) {
+				if (leaf == root) {
+					root = null_node;
+					return;
+				}
+				uint32_t parent = nodes[leaf].parent;
+				uint32_t grandParent = nodes[parent].parent;
+				uint32_t sibling = nodes[parent].child1 == leaf ? nodes[parent].child2 : nodes[parent].child1;
+				release(parent);
+				if (grandParent == null_node) {
+					root = sibling;
+					nodes[sibling].parent = null_node;
+					return;
+				}
+				if (nodes[grandParent].child1 == parent) nodes[grandParent].child1 = sibling;
+				else nodes[grandParent].child2 = sibling;
+				nodes[sibling].parent = grandParent;
+				refit(grandParent);
+			}
+
+			//Rebalances and recomputes boxes and heights up to the root
+			void refit(uint32_t index) {
+				while (index != null_node) {
+					index = balance(index);
+					tree_node& node = nodes[index];
+					node.height = 1 + std::max(nodes[node.child1].height, nodes[node.child2].height);
+					node.bounds = merge(nodes[node.child1].bounds, nodes[node.child2].bounds);
+					index = node.parent;
+				}
+			}
+
+			//When one child of a is two levels taller than the other, rotates
+			//the taller one up. Returns the node now in a's place.
+			uint32_t balance(uint32_t a) {
+				if (nodes[a].isLeaf() || nodes[a].height < 2) return a;
+				uint32_t b = nodes[a].child1, c = nodes[a].child2;
+				int32_t difference = nodes[c].height - nodes[b].height;
+				if (difference > 1) return rotateUp(a, c, b);
+				if (difference < -1) return rotateUp(a, b, c);
+				return a;
+			}
+
+			//`up` (a child of a) takes a's place, a becomes its child next to
+			//the taller of up's children and adopts the shorter one
+			uint32_t rotateUp(uint32_t a, uint32_t up, uint32_t other) {
+				uint32_t f = nodes[up].child1, g = nodes[up].child2;
+				nodes[up].child1 = a;
+				nodes[up].parent = nodes[a].parent;
+				nodes[a].parent = up;
+				if (nodes[up].parent == null_node) root = up;
+				else if (nodes[nodes[up].parent].child1 == a) nodes[nodes[up].parent].child1 = up;
+				else nodes[nodes[up].parent].child2 = up;
+
+				uint32_t taller = nodes[f].height > nodes[g].height ? f : g;
+				uint32_t shorter = taller == f ? g : f;
+				nodes[up].child2 = taller;
+				if (nodes[a].child1 == up) nodes[a].child1 = shorter;
+				else nodes[a].child2 = shorter;
+				nodes[shorter].parent = a;
+
+				nodes[a].bounds = merge(nodes[other].bounds, nodes[shorter].bounds);
+				nodes[a].height = 1 + std::max(nodes[other].height, nodes[shorter].height);
+				nodes[up].bounds = merge(nodes[a].bounds, nodes[taller].bounds);
+				nodes[up].height = 1 + std::max(nodes[a].height, nodes[taller].height);
+				return up;
+			}
+
+			const float margin;
+			std::vector<tree_node> nodes;
+			uint32_t root = null_node;
+			uint32_t freeList = null_node;
+			size_t leafCount = 0;
+			mutable std::vector<std::pair<uint32_t, float>> scratch; //Traversal stack, queries run on one thread
+		};
+
+		using instance_id = uint32_t;
+
+		//What a scene raycast hit, the instance is valid when collision.hit is
+		struct scene_hit {
+			RayCollision collision = { 0 };
+			instance_id instance = 0;
+		};
+
+		//Placed instances of the asset manager's models with an aabb_tree
+		//over their world bounds. Queries cull with the tree first and only
+		//run the per-mesh test on the candidates it returns.
+		class scene_query {
+		public:
+			explicit scene_query(const assets::asset_manager& assets, float margin = 0.5f) : assets(assets), tree(margin) {}
+
+			instance_id add(assets::model_id model, Matrix transform) {
+				instance_id id;
+				if (freeInstances.empty()) {
+					id = instance_id(instances.size());
+					instances.emplace_back();
+				}
+				else {
+					id = freeInstances.back();
+					freeInstances.pop_back();
+				}
+				scene_instance& instance = instances[id];
+				instance.model = model;
+				instance.transform = transform;
+				instance.resident = assets.getState(model) == assets::asset_state::resident;
+				instance.bounds = worldBounds(instance);
+				instance.leaf = tree.insert(instance.bounds, id);
+				instance.alive = true;
+				return id;
+			}
+
+			void remove(instance_id id) {
+				scene_instance& instance = instances[id];
+				if (!instance.alive) return;
+				tree.remove(instance.leaf);
+				instance.alive = false;
+				freeInstances.push_back(id);
+			}
+
+			void setTransform(instance_id id, Matrix transform) {
+				scene_instance& instance = instances[id];
+				instance.transform = transform;
+				instance.bounds = worldBounds(instance);
+				tree.move(instance.leaf, instance.bounds);
+			}
+
+			//Picks up models that finished loading since the last call, their
+			//bounds change from the placeholder cube to the real ones
+			void update() {
+				for (scene_instance& instance : instances) {
+					if (!instance.alive || instance.resident) continue;
+					if (assets.getState(instance.model) != assets::asset_state::resident) continue;
+					instance.resident = true;
+					instance.bounds = worldBounds(instance);
+					tree.move(instance.leaf, instance.bounds);
+				}
+			}
+
+			//Closest instance the ray hits, tested against the meshes
+			scene_hit raycast(Ray ray, float maxDistance = FLT_MAX) const {
+				scene_hit closest;
+				closest.collision.distance = maxDistance;
+				tree.queryRay(ray, maxDistance, [&](uint32_t id, float entry) {
+					const scene_instance& instance = instances[id];
+					RayCollision box = GetRayCollisionBox(ray, instance.bounds);
+					if (box.hit && box.distance < closest.collision.distance) {
+						RayCollision hit = assets.raycast(instance.model, ray, instance.transform);
+						if (hit.hit && hit.distance < closest.collision.distance) {
+							closest.collision = hit;
+							closest.instance = id;
+						}
+					}
+					return closest.collision.distance;
+				});
+				if (!closest.collision.hit) closest.collision.distance = 0.0f;
+				return closest;
+			}
+
+			//Instances whose world bounds the sphere touches
+			void overlapSphere(Vector3 center, float radius, std::vector<instance_id>& out) const {
+				tree.querySphere(center, radius, [&](uint32_t id) {
+					if (aabb_tree::distanceSquared(instances[id].bounds, center) <= radius * radius) out.push_back(id);
+				});
+			}
+
+			//Instances whose world bounds overlap the box
+			void overlapBox(BoundingBox box, std::vector<instance_id>& out) const {
+				tree.queryBox(box, [&](uint32_t id) {
+					if (aabb_tree::overlaps(instances[id].bounds, box)) out.push_back(id);
+				});
+			}
+
+			assets::model_id getModel(instance_id id) const {
+				return instances[id].model;
+			}
+
+			const Matrix& getTransform(instance_id id) const {
+				return instances[id].transform;
+			}
+
+			BoundingBox getBounds(instance_id id) const {
+				return instances[id].bounds;
+			}
+
+			size_t size() const {
+				return tree.size();
+			}
+
+			int getHeight() const {
+				return tree.getHeight();
+			}
+
+		private:
+			struct scene_instance {
+				assets::model_id model = 0;
+				Matrix transform = { 0 };
+				BoundingBox bounds = { 0 }; //World space, tight
+				uint32_t leaf = aabb_tree::null_node;
+				bool resident = false;
+				bool alive = false;
+			};
+
+			//Transforms the model space box the way Arvo does, each column of
+			//the matrix widens the box by its smaller and larger end
+			BoundingBox worldBounds(const scene_instance& instance) const {
+				BoundingBox local = assets.getBounds(instance.model);
+				const Matrix& m = instance.transform;
+				const float rows[3][3] = { { m.m0, m.m4, m.m8 }, { m.m1, m.m5, m.m9 }, { m.m2, m.m6, m.m10 } };
+				const float lo[3] = { local.min.x, local.min.y, local.min.z };
+				const float hi[3] = { local.max.x, local.max.y, local.max.z };
+				float outMin[3] = { m.m12, m.m13, m.m14 };
+				float outMax[3] = { m.m12, m.m13, m.m14 };
+				for (int r = 0; r < 3; r++) {
+					for (int c = 0; c < 3; c++) {
+						float a = rows[r][c] * lo[c], b = rows[r][c] * hi[c];
+						outMin[r] += std::min(a, b);
+						outMax[r] += std::max(a, b);
+					}
+				}
+				return { Vector3{ outMin[0], outMin[1], outMin[2] }, Vector3{ outMax[0], outMax[1], outMax[2] } };
+			}
+
+			const assets::asset_manager& assets;
+			aabb_tree tree;
+			std::vector<scene_instance> instances;
+			std::vector<instance_id> freeInstances;
+		};
+	}
+}
+
+#endif
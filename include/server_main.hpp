@@ -4,6 +4,7 @@
 #define MAIN_S_H 1
 #include <string>
 
-int server_main(std::string bind_to);
+int server_main(std::string bind_to, int ioThreads = 1, double tickRate = 30.0, bool unreliable = false,
+	std::string metricsFile = "", double metricsInterval = 10.0, bool compression = true, int compressMin = 512);
 
 #endif
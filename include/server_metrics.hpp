@@ -0,0 +1,117 @@
+#pragma once
+
+#ifndef SERVER_METRICS_H
+#define SERVER_METRICS_H 1
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace hsc {
+	namespace metrics {
+		//Durations bucketed by fixed upper bounds in milliseconds. Observing
+		//is a couple of relaxed atomic adds so any thread can do it.
+		class histogram {
+		public:
+			static constexpr size_t bucket_count = 12;
+
+			void observe(double ms) {
+				size_t bucket = 0;
+				while (bucket < bucket_count && ms > bounds()[bucket]) bucket++;
+				counts[bucket].fetch_add(1, std::memory_order_relaxed);
+				sumMicros.fetch_add(uint64_t(std::max(ms, 0.0) * 1000.0), std::memory_order_relaxed);
+			}
+
+			uint64_t getCount() const {
+				uint64_t total = 0;
+				for (const auto& count : counts) total += count.load(std::memory_order_relaxed);
+				return total;
+			}
+
+			double getSumMs() const {
+				return double(sumMicros.load(std::memory_order_relaxed)) / 1000.0;
+			}
+
+			//As a Prometheus histogram, buckets are cumulative
+			void writePrometheus(std::ostream& out, const std::string& name, const std::string& help) const {
+				out << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+				uint64_t cumulative = 0;
+				for (size_t i = 0; i < bucket_count; i++) {
+					cumulative += counts[i].load(std::memory_order_relaxed);
+					out << name << "_bucket{le=\"" << bounds()[i] << "\"} " << cumulative << "\n";
+				}
+				cumulative += counts[bucket_count].load(std::memory_order_relaxed);
+				out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+				out << name << "_sum " << getSumMs() << "\n";
+				out << name << "_count " << cumulative << "\n";
+			}
+
+		private:
+			static const std::array<double, bucket_count>& bounds() {
+				static const std::array<double, bucket_count> values = { 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50, 100, 250 };
+				return values;
+			}
+
+			std::array<std::atomic<uint64_t>, bucket_count + 1> counts{}; //Last one is everything over the top bound
+			std::atomic<uint64_t> sumMicros{ 0 };
+		};
+
+		//Events per second over the last few seconds, kept as one slot per
+		//second so reading it needs no timer
+		class rate_window {
+		public:
+			static constexpr size_t window_seconds = 10;
+
+			void mark() {
+				int64_t now = secondsNow();
+				slot& s = slots[size_t(now) % slots.size()];
+				int64_t stamp = s.second.load(std::memory_order_relaxed);
+				if (stamp != now && s.second.compare_exchange_strong(stamp, now, std::memory_order_relaxed)) {
+					s.count.store(0, std::memory_order_relaxed);
+				}
+				s.count.fetch_add(1, std::memory_order_relaxed);
+				total.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			//Average over the last window_seconds full seconds
+			double perSecond() const {
+				int64_t now = secondsNow();
+				uint64_t events = 0;
+				for (const slot& s : slots) {
+					int64_t age = now - s.second.load(std::memory_order_relaxed);
+					if (age >= 1 && age <= int64_t(window_seconds)) events += s.count.load(std::memory_order_relaxed);
+				}
+				return double(events) / double(window_seconds);
+			}
+
+			uint64_t getTotal() const {
+				return total.load(std::memory_order_relaxed);
+			}
+
+		private:
+			static int64_t secondsNow() {
+				return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+			}
+
+			struct slot {
+				std::atomic<int64_t> second{ -1 };
+				std::atomic<uint64_t> count{ 0 };
+			};
+			std::array<slot, window_seconds + 1> slots; //One spare for the second still being counted
+			std::atomic<uint64_t> total{ 0 };
+		};
+
+		//What a server_interface measures about itself
+		struct server_metrics {
+			rate_window accepts;
+			histogram updateMs; //Handling one batch of inbound messages
+			histogram tickMs; //Observed by the game loop, see observeTick
+		};
+	}
+}
+
+#endif
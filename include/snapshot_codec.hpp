@@ -0,0 +1,256 @@
+#pragma once
+
+#ifndef SNAPSHOT_CODEC_H
+#define SNAPSHOT_CODEC_H 1
+
+#include <net_common.hpp>
+#include <vector>
+#include <cmath>
+
+namespace hsc {
+	namespace snapshots {
+		//Player state with its position snapped to the codec's fixed-point
+		//grid, this is what snapshots are diffed on.
+		struct quantized_player {
+			uint32_t ID = 0;
+			uint32_t selectedEntity = 0;
+			int32_t pos[3] = { 0, 0, 0 };
+		};
+
+		//Every player at one tick, sorted by ID so two states can be diffed
+		//with a single merge walk.
+		struct world_state {
+			uint32_t tick = 0;
+			int64_t serverTime = 0; //Server's clock_sync::now() when the tick ran
+			std::vector<quantized_player> players;
+		};
+
+		struct codec_options {
+			float precision = 1.0f / 64.0f; //Smallest position step that is sent, both ends must agree
+			uint32_t maxBaselineAge = 32; //In ticks, older acks fall back to a full state
+		};
+
+		//Which fields of a player a delta carries
+		enum field_mask : uint8_t {
+			field_selected = 1 << 0,
+			field_pos_x = 1 << 1,
+			field_pos_y = 1 << 2,
+			field_pos_z = 1 << 3,
+			field_all = field_selected | field_pos_x | field_pos_y | field_pos_z
+		};
+
+		//Little-endian base 128, small numbers take one byte
+		inline void writeVarint(std::vector<uint8_t>& out, uint32_t value) {
+			while (value >= 0x80) {
+				out.push_back(uint8_t(value | 0x80));
+				value >>= 7;
+			}
+			out.push_back(uint8_t(value));
+		}
+
+		inline bool readVarint(const uint8_t*& in, const uint8_t* end, uint32_t& value) {
+			value = 0;
+			for (int shift = 0; shift < 35 && in < end; shift += 7) {
+				uint8_t byte = *in++;
+				value |= uint32_t(byte & 0x7F) << shift;
+				if (!(byte & 0x80)) return true;
+			}
+			return false;
+		}
+
+		inline void writeVarint64(std::vector<uint8_t>& out, uint64_t value) {
+			while (value >= 0x80) {
+				out.push_back(uint8_t(value | 0x80));
+				value >>= 7;
+			}
+			out.push_back(uint8_t(value));
+		}
+
+		inline bool readVarint64(const uint8_t*& in, const uint8_t* end, uint64_t& value) {
+			value = 0;
+			for (int shift = 0; shift < 70 && in < end; shift += 7) {
+				uint8_t byte = *in++;
+				value |= uint64_t(byte & 0x7F) << shift;
+				if (!(byte & 0x80)) return true;
+			}
+			return false;
+		}
+
+		//Map signed deltas onto small unsigned numbers, 0,-1,1,-2 -> 0,1,2,3
+		inline uint32_t zigzag(int32_t value) {
+			return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+		}
+
+		inline int32_t unzigzag(uint32_t value) {
+			return int32_t(value >> 1) ^ -int32_t(value & 1);
+		}
+
+		inline quantized_player quantize(const player& p, float precision) {
+			quantized_player q;
+			q.ID = p.ID;
+			q.selectedEntity = p.selectedEntity;
+			q.pos[0] = int32_t(std::lround(p.pos.x / precision));
+			q.pos[1] = int32_t(std::lround(p.pos.y / precision));
+			q.pos[2] = int32_t(std::lround(p.pos.z / precision));
+			return q;
+		}
+
+		inline player dequantize(const quantized_player& q, float precision) {
+			player p;
+			p.ID = q.ID;
+			p.selectedEntity = q.selectedEntity;
+			p.pos = { q.pos[0] * precision, q.pos[1] * precision, q.pos[2] * precision };
+			return p;
+		}
+
+		//The last few world states, so a delta can be made against, or
+		//applied on top of, any one still in range.
+		class snapshot_history {
+		public:
+			explicit snapshot_history(uint32_t maxAge = 32) : states(maxAge + 1) {}
+
+			void push(const world_state& state) {
+				slot& s = states[state.tick % states.size()];
+				s.state = state;
+				s.valid = true;
+			}
+
+			const world_state* find(uint32_t tick) const {
+				const slot& s = states[tick % states.size()];
+				return (s.valid && s.state.tick == tick) ? &s.state : nullptr;
+			}
+
+		private:
+			struct slot {
+				world_state state;
+				bool valid = false;
+			};
+			std::vector<slot> states;
+		};
+
+		//Append `current` encoded against `baseline` to `out`, a null baseline
+		//gives a full state. Unchanged players are left out entirely and
+		//players missing from `current` are listed as removed.
+		//
+		//Layout, all varints: tick, server time, ticks back to the baseline (0
+		//for a full state), changed count, then per changed player the ID delta from the
+		//previous one, a field_mask byte and zigzagged deltas for each set
+		//field, then removed count and their ID deltas.
+		inline void encode(const world_state& current, const world_state* baseline, std::vector<uint8_t>& out) {
+			static const std::vector<quantized_player> nobody;
+			const std::vector<quantized_player>& base = baseline ? baseline->players : nobody;
+
+			writeVarint(out, current.tick);
+			writeVarint64(out, uint64_t(current.serverTime));
+			writeVarint(out, baseline ? current.tick - baseline->tick : 0);
+
+			//The changed count goes first but is only known after the walk,
+			//so the entries are built up in a scratch buffer
+			static thread_local std::vector<uint8_t> entries;
+			static const quantized_player zero;
+			entries.clear();
+			uint32_t changed = 0, lastID = 0;
+			size_t b = 0;
+			for (const quantized_player& p : current.players) {
+				while (b < base.size() && base[b].ID < p.ID) b++;
+				bool isNew = !(b < base.size() && base[b].ID == p.ID);
+				const quantized_player& old = isNew ? zero : base[b];
+
+				uint8_t mask = isNew ? uint8_t(field_all) : uint8_t(0);
+				if (p.selectedEntity != old.selectedEntity) mask |= field_selected;
+				for (int axis = 0; axis < 3; axis++) {
+					if (p.pos[axis] != old.pos[axis]) mask |= uint8_t(field_pos_x << axis);
+				}
+				if (mask == 0) continue;
+
+				writeVarint(entries, p.ID - lastID);
+				entries.push_back(mask);
+				if (mask & field_selected) writeVarint(entries, p.selectedEntity);
+				for (int axis = 0; axis < 3; axis++) {
+					if (mask & (field_pos_x << axis)) writeVarint(entries, zigzag(int32_t(uint32_t(p.pos[axis]) - uint32_t(old.pos[axis]))));
+				}
+				lastID = p.ID;
+				changed++;
+			}
+			writeVarint(out, changed);
+			out.insert(out.end(), entries.begin(), entries.end());
+
+			std::vector<uint32_t> removed;
+			size_t c = 0;
+			for (const quantized_player& old : base) {
+				while (c < current.players.size() && current.players[c].ID < old.ID) c++;
+				if (c == current.players.size() || current.players[c].ID != old.ID) removed.push_back(old.ID);
+			}
+			writeVarint(out, uint32_t(removed.size()));
+			lastID = 0;
+			for (uint32_t id : removed) {
+				writeVarint(out, id - lastID);
+				lastID = id;
+			}
+		}
+
+		//Rebuild a world state from an encoded snapshot. Fails if the data is
+		//cut short or its baseline is no longer in `history`.
+		inline bool decode(const uint8_t* data, size_t size, const snapshot_history& history, world_state& out) {
+			const uint8_t* in = data;
+			const uint8_t* end = data + size;
+			uint32_t tick = 0, back = 0, changed = 0;
+			uint64_t serverTime = 0;
+			if (!readVarint(in, end, tick) || !readVarint64(in, end, serverTime) ||
+				!readVarint(in, end, back) || !readVarint(in, end, changed)) return false;
+
+			const world_state* baseline = nullptr;
+			if (back != 0) {
+				baseline = history.find(tick - back);
+				if (!baseline) return false;
+			}
+
+			//Start from the baseline, then overwrite or insert changed players
+			std::vector<quantized_player> players = baseline ? baseline->players : std::vector<quantized_player>();
+			uint32_t id = 0;
+			for (uint32_t i = 0; i < changed; i++) {
+				uint32_t idDelta = 0, value = 0;
+				if (!readVarint(in, end, idDelta) || in >= end) return false;
+				id += idDelta;
+				uint8_t mask = *in++;
+
+				auto it = std::lower_bound(players.begin(), players.end(), id,
+					[](const quantized_player& p, uint32_t key) { return p.ID < key; });
+				if (it == players.end() || it->ID != id) {
+					quantized_player fresh;
+					fresh.ID = id;
+					it = players.insert(it, fresh);
+				}
+				if (mask & field_selected) {
+					if (!readVarint(in, end, value)) return false;
+					it->selectedEntity = value;
+				}
+				for (int axis = 0; axis < 3; axis++) {
+					if (mask & (field_pos_x << axis)) {
+						if (!readVarint(in, end, value)) return false;
+						it->pos[axis] = int32_t(uint32_t(it->pos[axis]) + uint32_t(unzigzag(value)));
+					}
+				}
+			}
+
+			uint32_t removedCount = 0;
+			if (!readVarint(in, end, removedCount)) return false;
+			id = 0;
+			for (uint32_t i = 0; i < removedCount; i++) {
+				uint32_t idDelta = 0;
+				if (!readVarint(in, end, idDelta)) return false;
+				id += idDelta;
+				auto it = std::lower_bound(players.begin(), players.end(), id,
+					[](const quantized_player& p, uint32_t key) { return p.ID < key; });
+				if (it != players.end() && it->ID == id) players.erase(it);
+			}
+
+			out.tick = tick;
+			out.serverTime = int64_t(serverTime);
+			out.players = std::move(players);
+			return true;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,113 @@
+#pragma once
+
+#ifndef SPATIAL_HASH_H
+#define SPATIAL_HASH_H 1
+
+#include "raylib.h"
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <unordered_map>
+
+namespace hsc {
+	namespace spatial {
+		//Uniform grid over the ground plane (x and z) stored sparsely in a
+		//hash map, each cell lists the IDs inside it. Height is ignored when
+		//bucketing but queries still test the full 3D distance.
+		class spatial_hash {
+		public:
+			explicit spatial_hash(float cellSize = 32.0f) : cellSize(cellSize), inverseCellSize(1.0f / cellSize) {}
+
+			float getCellSize() const {
+				return cellSize;
+			}
+
+			//Add or move an ID, only touches the cell lists if it changed cell
+			void move(uint32_t id, Vector3 pos) {
+				cell_key key = keyFor(pos);
+				auto found = entries.find(id);
+				if (found == entries.end()) {
+					std::vector<uint32_t>& cell = cells[key];
+					entries.emplace(id, entry{ key, pos, cell.size() });
+					cell.push_back(id);
+					return;
+				}
+				entry& e = found->second;
+				e.pos = pos;
+				if (e.cell != key) {
+					unlink(e);
+					std::vector<uint32_t>& cell = cells[key];
+					e.cell = key;
+					e.slot = cell.size();
+					cell.push_back(id);
+				}
+			}
+
+			void remove(uint32_t id) {
+				auto found = entries.find(id);
+				if (found == entries.end()) return;
+				unlink(found->second);
+				entries.erase(found);
+			}
+
+			//Append every ID within `radius` of `center` to `out`
+			void query(Vector3 center, float radius, std::vector<uint32_t>& out) const {
+				int32_t minX = cellCoord(center.x - radius), maxX = cellCoord(center.x + radius);
+				int32_t minZ = cellCoord(center.z - radius), maxZ = cellCoord(center.z + radius);
+				float radiusSq = radius * radius;
+				for (int32_t x = minX; x <= maxX; x++) {
+					for (int32_t z = minZ; z <= maxZ; z++) {
+						auto cell = cells.find(pack(x, z));
+						if (cell == cells.end()) continue;
+						for (uint32_t id : cell->second) {
+							const Vector3& p = entries.find(id)->second.pos;
+							float dx = p.x - center.x, dy = p.y - center.y, dz = p.z - center.z;
+							if (dx * dx + dy * dy + dz * dz <= radiusSq) out.push_back(id);
+						}
+					}
+				}
+			}
+
+			size_t size() const {
+				return entries.size();
+			}
+
+		private:
+			using cell_key = uint64_t;
+
+			struct entry {
+				cell_key cell;
+				Vector3 pos;
+				size_t slot; //Index in the cell's list, for swap and pop removal
+			};
+
+			int32_t cellCoord(float v) const {
+				return int32_t(std::floor(v * inverseCellSize));
+			}
+
+			static cell_key pack(int32_t x, int32_t z) {
+				return (uint64_t(uint32_t(x)) << 32) | uint64_t(uint32_t(z));
+			}
+
+			cell_key keyFor(Vector3 pos) const {
+				return pack(cellCoord(pos.x), cellCoord(pos.z));
+			}
+
+			void unlink(const entry& e) {
+				auto cell = cells.find(e.cell);
+				std::vector<uint32_t>& ids = cell->second;
+				ids[e.slot] = ids.back();
+				entries[ids[e.slot]].slot = e.slot;
+				ids.pop_back();
+				if (ids.empty()) cells.erase(cell);
+			}
+
+			float cellSize;
+			float inverseCellSize;
+			std::unordered_map<cell_key, std::vector<uint32_t>> cells;
+			std::unordered_map<uint32_t, entry> entries;
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,129 @@
+#pragma once
+
+#ifndef TEXTURE_FORMAT_H
+#define TEXTURE_FORMAT_H 1
+
+#include <mesh_format.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+namespace hsc {
+	namespace assets {
+		//Cooked textures are written by the asset-cooker tool with their whole
+		//mip chain already built and encoded for the GPU, and read in place
+		//through a memory mapping like cooked meshes. The file is a header,
+		//one texture_level per mip level (level 0 the full size), then the
+		//levels' data smallest first so reading the file front to back
+		//streams in the coarse levels before the fine ones. Little endian,
+		//every level starts 16 byte aligned.
+		constexpr uint32_t texture_magic = 0x58544348; //"HCTX" in the file
+		constexpr uint32_t texture_version = 1;
+		constexpr uint32_t max_texture_levels = 16;
+
+		enum class texture_encoding : uint32_t {
+			rgba8 = 0, //Uncompressed, 4 bytes a pixel
+			bc1 = 1,   //DXT1, 8 bytes per 4x4 block, opaque
+			bc3 = 2    //DXT5, 16 bytes per 4x4 block with interpolated alpha
+		};
+
+		struct texture_file_header {
+			uint32_t magic;
+			uint32_t version;
+			texture_encoding encoding;
+			uint32_t width;
+			uint32_t height;
+			uint32_t levelCount;
+			uint64_t fileSize;
+			uint32_t reserved[2];
+		};
+
+		struct texture_level {
+			uint64_t offset;
+			uint32_t size;
+			uint32_t width;
+			uint32_t height;
+			uint32_t reserved;
+		};
+
+		static_assert(sizeof(texture_file_header) == 40, "texture_file_header is written to disk as is");
+		static_assert(sizeof(texture_level) == 24, "texture_level is written to disk as is");
+
+		//Bytes one level takes. Block compressed levels are whole 4x4 blocks.
+		inline uint64_t textureLevelSize(texture_encoding encoding, uint32_t width, uint32_t height) {
+			uint64_t blocks = uint64_t((width + 3) / 4) * uint64_t((height + 3) / 4);
+			switch (encoding) {
+			case texture_encoding::bc1: return blocks * 8;
+			case texture_encoding::bc3: return blocks * 16;
+			default: return uint64_t(width) * height * 4;
+			}
+		}
+
+		//A mapped cooked texture file. open checks every level once so the
+		//accessors can hand out pointers into the mapping without checks.
+		class cooked_texture_file {
+		public:
+			bool open(const std::string& path, std::string* error = nullptr) {
+				if (!file.open(path)) return fail(error, "can't map " + path);
+				if (file.size() < sizeof(texture_file_header)) return fail(error, path + " is too small");
+
+				const texture_file_header& h = header();
+				if (h.magic != texture_magic) return fail(error, path + " is not a cooked texture");
+				if (h.version != texture_version) return fail(error, path + " was cooked for version " + std::to_string(h.version));
+				if (h.encoding != texture_encoding::rgba8 && h.encoding != texture_encoding::bc1 && h.encoding != texture_encoding::bc3) {
+					return fail(error, path + " has an unknown encoding");
+				}
+				if (h.fileSize != file.size()) return fail(error, path + " is truncated");
+				if (h.width == 0 || h.height == 0) return fail(error, path + " has no pixels");
+				if (h.levelCount == 0 || h.levelCount > max_texture_levels) return fail(error, path + " has a bad level count");
+
+				uint64_t levelsEnd = sizeof(texture_file_header) + uint64_t(h.levelCount) * sizeof(texture_level);
+				if (levelsEnd > file.size()) return fail(error, path + " has a bad level table");
+				for (uint32_t i = 0; i < h.levelCount; i++) {
+					const texture_level& l = getLevel(i);
+					uint32_t width = std::max(1u, h.width >> i), height = std::max(1u, h.height >> i);
+					if (l.width != width || l.height != height || l.size != textureLevelSize(h.encoding, width, height) ||
+						l.offset % mesh_alignment != 0 || l.offset < levelsEnd || l.offset + l.size > file.size()) {
+						return fail(error, path + " has a bad level record");
+					}
+				}
+				return true;
+			}
+
+			void close() {
+				file.close();
+			}
+
+			bool isOpen() const {
+				return file.data() != nullptr;
+			}
+
+			const texture_file_header& header() const {
+				return *reinterpret_cast<const texture_file_header*>(file.data());
+			}
+
+			uint32_t levelCount() const {
+				return header().levelCount;
+			}
+
+			const texture_level& getLevel(uint32_t level) const {
+				return reinterpret_cast<const texture_level*>(file.data() + sizeof(texture_file_header))[level];
+			}
+
+			const uint8_t* getData(uint32_t level) const {
+				return file.data() + getLevel(level).offset;
+			}
+
+		private:
+			bool fail(std::string* error, const std::string& message) {
+				file.close();
+				if (error != nullptr) *error = message;
+				return false;
+			}
+
+			mapped_file file;
+		};
+	}
+}
+
+#endif
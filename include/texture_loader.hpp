@@ -0,0 +1,110 @@
+#pragma once
+
+#ifndef TEXTURE_LOADER_H
+#define TEXTURE_LOADER_H 1
+
+#include "raylib.h"
+#include <model_loader.hpp>
+#include <texture_format.hpp>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace hsc {
+	namespace assets {
+		//Levels at most this wide go up with the first upload, finer ones are
+		//streamed in after
+		constexpr uint32_t texture_stream_start = 64;
+
+		//A texture in CPU memory, the mapped cooked file or the decoded PNG
+		struct texture_data {
+			cooked_texture_file file;
+			Image image = { 0 };
+			bool cooked = false;
+		};
+
+		inline int pixelFormatOf(texture_encoding encoding) {
+			switch (encoding) {
+			case texture_encoding::bc1: return PIXELFORMAT_COMPRESSED_DXT1_RGB;
+			case texture_encoding::bc3: return PIXELFORMAT_COMPRESSED_DXT5_RGBA;
+			default: return PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+			}
+		}
+
+		//Reads a texture without touching the GPU so it can run on any thread.
+		//Prefers the cooked file in `cookedDir` and decodes the PNG when there
+		//isn't a valid one, an empty `cookedDir` always decodes.
+		inline bool readTexture(const std::string& path, texture_data& out, const std::string& cookedDir = default_cooked_dir, std::string* error = nullptr) {
+			std::string cookedError;
+			const bool allowCooked = !cookedDir.empty();
+			if (allowCooked && out.file.open(cookedPath(cookedDir, path, ".hct"), &cookedError)) {
+				out.cooked = true;
+				//Fault the pages in here rather than on the render thread
+				volatile uint8_t sink = 0;
+				for (uint32_t level = 0; level < out.file.levelCount(); level++) {
+					const uint8_t* data = out.file.getData(level);
+					for (uint32_t i = 0; i < out.file.getLevel(level).size; i += 4096) sink = sink + data[i];
+				}
+				return true;
+			}
+			if (allowCooked) TraceLog(LOG_WARNING, "TEXTURE: [%s] No cooked texture (%s), decoding the image", path.c_str(), cookedError.c_str());
+
+			out.image = LoadImage(path.c_str());
+			if (out.image.data == nullptr) {
+				if (error != nullptr) *error = "can't decode " + path;
+				return false;
+			}
+			return true;
+		}
+
+		//The level a texture's first upload starts from
+		inline uint32_t firstStreamedLevel(const cooked_texture_file& file) {
+			uint32_t level = 0;
+			while (level + 1 < file.levelCount() && std::max(file.getLevel(level).width, file.getLevel(level).height) > texture_stream_start) level++;
+			return level;
+		}
+
+		//How many levels from finest raylib can upload. It sizes a compressed
+		//level from its pixel count, which only matches GL's whole blocks
+		//when the level is whole 4x4 blocks or fits in one, so a non-square
+		//chain goes up without the levels past the first that doesn't.
+		inline uint32_t uploadableLevels(const cooked_texture_file& file, uint32_t finest) {
+			if (file.header().encoding == texture_encoding::rgba8) return file.levelCount() - finest;
+			uint32_t count = 0;
+			for (uint32_t level = finest; level < file.levelCount(); level++, count++) {
+				const texture_level& l = file.getLevel(level);
+				bool wholeBlocks = l.width % 4 == 0 && l.height % 4 == 0;
+				bool singleBlock = l.width < 4 && l.height < 4;
+				if (!wholeBlocks && !singleBlock) break;
+			}
+			return std::max(count, 1u);
+		}
+
+		//Uploads levels finest down to the smallest raylib can take as one
+		//texture, on the thread owning the GL context. The levels sit
+		//smallest first in the file so they are copied into scratch the
+		//other way round, the order raylib reads a mip chain in.
+		inline Texture2D uploadLevels(const cooked_texture_file& file, uint32_t finest, std::vector<uint8_t>& scratch) {
+			const uint32_t count = uploadableLevels(file, finest);
+			scratch.clear();
+			for (uint32_t level = finest; level < finest + count; level++) {
+				scratch.insert(scratch.end(), file.getData(level), file.getData(level) + file.getLevel(level).size);
+			}
+			Image image = { 0 };
+			image.data = scratch.data();
+			image.width = int(file.getLevel(finest).width);
+			image.height = int(file.getLevel(finest).height);
+			image.mipmaps = int(count);
+			image.format = pixelFormatOf(file.header().encoding);
+			Texture2D texture = LoadTextureFromImage(image);
+
+			//GL only samples a chain that goes down to 1x1
+			const texture_level& smallest = file.getLevel(finest + count - 1);
+			if (smallest.width == 1 && smallest.height == 1) SetTextureFilter(texture, TEXTURE_FILTER_TRILINEAR);
+			else SetTextureFilter(texture, TEXTURE_FILTER_BILINEAR);
+			return texture;
+		}
+	}
+}
+
+#endif
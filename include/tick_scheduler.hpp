@@ -0,0 +1,98 @@
+#pragma once
+
+#ifndef TICK_SCHEDULER_H
+#define TICK_SCHEDULER_H 1
+
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+namespace hsc {
+	//Keeps a fixed rate simulation tick and measures how much of each
+	//tick's time budget the work used.
+	class tick_scheduler {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		//Timing of one tick, all times are in milliseconds
+		struct tick_stats {
+			uint64_t tick = 0;
+			double durationMs = 0.0; //Time spent doing the tick's work
+			double budgetLeftMs = 0.0; //Negative if the tick overran
+		};
+
+		explicit tick_scheduler(double rateHz = 30.0) {
+			setRate(rateHz);
+			next = clock::now() + period;
+		}
+
+		void setRate(double rateHz) {
+			rate = std::max(rateHz, 1.0);
+			period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / rate));
+		}
+
+		double getRate() const {
+			return rate;
+		}
+
+		//When the next tick is due, the server handles messages until then
+		clock::time_point nextTick() const {
+			return next;
+		}
+
+		bool isDue() const {
+			return clock::now() >= next;
+		}
+
+		//Call right before doing a tick's work
+		void beginTick() {
+			started = clock::now();
+		}
+
+		//Call right after a tick's work, schedules the next one. If we fell
+		//behind we skip ahead rather than running ticks back to back.
+		const tick_stats& endTick() {
+			clock::time_point finished = clock::now();
+			last.tick = tickCount++;
+			last.durationMs = std::chrono::duration<double, std::milli>(finished - started).count();
+			last.budgetLeftMs = std::chrono::duration<double, std::milli>(period).count() - last.durationMs;
+			if (last.budgetLeftMs < 0.0) overruns++;
+			worstMs = std::max(worstMs, last.durationMs);
+
+			next += period;
+			if (next < finished) next = finished + period;
+			return last;
+		}
+
+		const tick_stats& getLastTick() const {
+			return last;
+		}
+
+		uint64_t getTickCount() const {
+			return tickCount;
+		}
+
+		uint64_t getOverruns() const {
+			return overruns;
+		}
+
+		//Longest tick since the last call, used for periodic reports
+		double takeWorstMs() {
+			double worst = worstMs;
+			worstMs = 0.0;
+			return worst;
+		}
+
+	private:
+		double rate = 30.0;
+		clock::duration period{};
+		clock::time_point next;
+		clock::time_point started;
+		tick_stats last;
+		uint64_t tickCount = 0;
+		uint64_t overruns = 0;
+		double worstMs = 0.0;
+	};
+}
+
+#endif
@@ -0,0 +1,55 @@
+#pragma once
+
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H 1
+
+#include <atomic>
+#include <cstdint>
+
+namespace hsc {
+	//Hands the latest value from one writer thread to one reader thread
+	//without locks. Each side owns a buffer and the third one sits in the
+	//middle, publishing and reading just swap with it. Neither side ever
+	//waits, the reader simply skips values it was too slow to see.
+	template <typename T>
+	class triple_buffer {
+	public:
+		//Writer side. The back buffer holds whatever was published two
+		//swaps ago, so fill it in fully rather than patching it.
+		T& back() {
+			return buffers[backIndex].value;
+		}
+
+		void publish() {
+			backIndex = middle.exchange(uint8_t(backIndex | fresh_bit), std::memory_order_acq_rel) & index_mask;
+		}
+
+		//Reader side. Picks up the newest published value if there is one,
+		//returns false if front() is already the newest.
+		bool update() {
+			if (!(middle.load(std::memory_order_relaxed) & fresh_bit)) return false;
+			frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & index_mask;
+			return true;
+		}
+
+		const T& front() const {
+			return buffers[frontIndex].value;
+		}
+
+	private:
+		static constexpr uint8_t index_mask = 0x3;
+		static constexpr uint8_t fresh_bit = 0x4; //Set on the middle index when it holds a value the reader has not taken
+
+		//Keep each buffer on its own cache lines, both threads touch them
+		struct alignas(64) slot {
+			T value{};
+		};
+
+		slot buffers[3];
+		uint8_t backIndex = 0; //Writer only
+		uint8_t frontIndex = 1; //Reader only
+		alignas(64) std::atomic<uint8_t> middle{ 2 };
+	};
+}
+
+#endif
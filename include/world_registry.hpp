@@ -0,0 +1,133 @@
+#pragma once
+
+#ifndef WORLD_REGISTRY_H
+#define WORLD_REGISTRY_H 1
+
+#include <net_common.hpp>
+#include <entt/entt.hpp>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace hsc {
+	namespace world {
+		//Components, each lives in its own packed pool so a system only walks
+		//the data it needs
+		struct transform {
+			Vector3 pos{ 0.0f, 0.0f, 0.0f };
+		};
+
+		//ID the server gave the entity, the same on every machine
+		struct network_id {
+			uint32_t id = 0;
+		};
+
+		struct selection {
+			uint32_t entity = 0;
+		};
+
+		//Changed since systems last looked, cleared once they have
+		struct replication_dirty {
+			uint32_t changes = 0; //How many updates were folded in, kept so the pool is not an empty type
+		};
+
+		//World state held in an entt::registry, plus a map from network IDs to
+		//entities so messages naming an ID find their entity in O(1).
+		class world_registry {
+		public:
+			entt::registry& getRegistry() {
+				return registry;
+			}
+
+			const entt::registry& getRegistry() const {
+				return registry;
+			}
+
+			//entt::null if no entity has this network ID
+			entt::entity find(uint32_t netID) const {
+				auto found = byNetID.find(netID);
+				return found == byNetID.end() ? entt::entity(entt::null) : found->second;
+			}
+
+			bool contains(uint32_t netID) const {
+				return byNetID.count(netID) != 0;
+			}
+
+			//Create the entity for a network ID, or return the existing one
+			entt::entity spawn(uint32_t netID) {
+				auto found = byNetID.find(netID);
+				if (found != byNetID.end()) return found->second;
+				entt::entity e = registry.create();
+				registry.emplace<network_id>(e, network_id{ netID });
+				registry.emplace<transform>(e);
+				registry.emplace<selection>(e);
+				byNetID.emplace(netID, e);
+				return e;
+			}
+
+			bool despawn(uint32_t netID) {
+				auto found = byNetID.find(netID);
+				if (found == byNetID.end()) return false;
+				registry.destroy(found->second);
+				byNetID.erase(found);
+				return true;
+			}
+
+			//Spawn or update the entity for a player and flag it dirty
+			entt::entity setPlayer(const player& p) {
+				entt::entity e = spawn(p.ID);
+				registry.get<transform>(e).pos = p.pos;
+				registry.get<selection>(e).entity = p.selectedEntity;
+				markDirty(e);
+				return e;
+			}
+
+			void markDirty(entt::entity e) {
+				replication_dirty* dirty = registry.try_get<replication_dirty>(e);
+				if (dirty) {
+					dirty->changes++;
+				}
+				else {
+					registry.emplace<replication_dirty>(e, replication_dirty{ 1 });
+				}
+			}
+
+			void clearDirty() {
+				registry.clear<replication_dirty>();
+			}
+
+			//The entity as the wire format's player struct
+			player toPlayer(entt::entity e) const {
+				player p;
+				p.ID = registry.get<network_id>(e).id;
+				p.selectedEntity = registry.get<selection>(e).entity;
+				p.pos = registry.get<transform>(e).pos;
+				return p;
+			}
+
+			//Call `fn(const player&)` for every networked entity, walking the
+			//component pools rather than the ID map
+			template <typename Fn>
+			void eachPlayer(Fn fn) const {
+				auto view = registry.view<const network_id, const transform, const selection>();
+				for (entt::entity e : view) {
+					player p;
+					p.ID = view.template get<const network_id>(e).id;
+					p.selectedEntity = view.template get<const selection>(e).entity;
+					p.pos = view.template get<const transform>(e).pos;
+					fn(p);
+				}
+			}
+
+			size_t size() const {
+				return byNetID.size();
+			}
+
+		private:
+			entt::registry registry;
+			std::unordered_map<uint32_t, entt::entity> byNetID;
+		};
+	}
+}
+
+#endif
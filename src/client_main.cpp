@@ -5,7 +5,27 @@
 #include <stdio.h>
 #include <unordered_map>
 #include <net_common.hpp>
-
+#include <snapshot_codec.hpp>
+#include <triple_buffer.hpp>
+#include <world_registry.hpp>
+#include <asset_manager.hpp>
+#include <scene_query.hpp>
+#include <render_batch.hpp>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+
+// What the render loop sees of the world, built by the network thread
+struct client_world {
+	uint32_t playerID = 0;
+	bool waitingToConnect = true;
+	bool connected = true;
+	std::vector<player> players;
+	hsc::net::latency_estimate latency; // To the server
+	int64_t snapshotTime = 0;           // When the newest snapshot's tick ran, on our clock
+};
 
 class CustomClient : public hsc::net::client_interface<CustomMsgTypes>
 {
@@ -13,9 +33,215 @@ private:
 public:
 	player myPlayer;
 	uint32_t playerID = 0;
-	std::unordered_map<uint32_t, player> players;
+	hsc::world::world_registry entities; // Players as the server last described them
 	bool waitngToConnect = true;
 
+	hsc::snapshots::codec_options snapshotOptions;
+	hsc::snapshots::snapshot_history snapshotHistory{ snapshotOptions.maxBaselineAge };
+	uint32_t lastSnapshotTick = 0; // Snapshots may arrive out of order over UDP
+	bool hasSnapshot = false;
+	int64_t lastSnapshotTime = 0;     // Server tick time of the newest snapshot, moved onto our clock
+
+	hsc::net::send_scheduler<CustomMsgTypes> outbound;
+	player lastSentPlayer;            // What the server was last told about us
+	bool hasSentPlayer = false;
+	float moveThreshold = 0.05f;      // Smaller moves are not worth a send
+
+	hsc::triple_buffer<client_world> world; // Network thread to render loop
+	hsc::triple_buffer<player> input;       // Render loop to network thread, our player as the user moved it
+
+	CustomClient(double netRate) : outbound(netRate) {}
+
+	// Hand our player to the scheduler if it changed enough since the last send
+	void markPlayerIfMoved(hsc::net::packets::message<CustomMsgTypes>& updateMsg) {
+		if (hasSentPlayer && myPlayer.selectedEntity == lastSentPlayer.selectedEntity &&
+			Vector3Distance(myPlayer.pos, lastSentPlayer.pos) < moveThreshold) {
+			return;
+		}
+		updateMsg.body.clear();
+		hsc::net::packets::message_writer(updateMsg).write(myPlayer);
+		outbound.setState(updateMsg);
+		lastSentPlayer = myPlayer;
+		hasSentPlayer = true;
+	}
+
+	// Apply one message from the server to our copy of the world, `receivedAt`
+	// is when it came off the socket
+	void handleMessage(hsc::net::packets::message<CustomMsgTypes>& msg, int64_t receivedAt) {
+		switch (msg.header.id)
+		{
+		case CustomMsgTypes::Server_GetPing:
+		{
+			// Either the server answering our ping or asking for its own
+			hsc::net::ping_payload ping;
+			if (!hsc::net::packets::message_reader(msg).read(ping)) break;
+			if (ping.isReply) {
+				getClockSync().onReply(ping, receivedAt);
+			}
+			else {
+				hsc::net::packets::message<CustomMsgTypes> pong;
+				pong.header.id = CustomMsgTypes::Server_GetPing;
+				hsc::net::packets::message_writer(pong).write(hsc::net::clock_sync::makeReply(ping, receivedAt));
+				sendUnreliable(pong);
+			}
+			break;
+		}
+
+		case CustomMsgTypes::Client_Accepted:
+		{
+			// Server has accepted us			
+			std::cout << "Server Accepted Connection" << std::endl;
+			hsc::net::packets::message<CustomMsgTypes> reg;
+			reg.header.id = CustomMsgTypes::Client_Register;
+			hsc::net::packets::message_writer(reg).write(myPlayer);
+			outbound.queue(reg);
+			break;
+		}
+		
+		case CustomMsgTypes::Client_SetID:
+		{
+			// Server has gave us our player
+			uint32_t id;
+			if (!hsc::net::packets::message_reader(msg).read(id)) break;
+			setPlayerID(id);
+			std::cout << "Assigned ID "<< playerID << std::endl;
+			// Only servers started with --udp offer the unreliable channel
+			if (isUnreliableOffered()) openUnreliable(id);
+			break;
+		}
+
+		case CustomMsgTypes::Game_AddPlayer:
+		{
+			// Server has gave us new players, a burst of them comes as one message
+			hsc::net::packets::message_reader reader(msg);
+			player client;
+			while (reader.read(client)) {
+				setPlayersID(client.ID, client);
+				if (client.ID == playerID) {
+					waitngToConnect = false;
+				}
+				std::cout << "Player " << client.ID << " created" << std::endl;
+			}
+			break;
+		}
+
+		case CustomMsgTypes::Game_RemovePlayer:
+		{
+			// Server has gave us an ID to remove
+			uint32_t clientID;
+			if (!hsc::net::packets::message_reader(msg).read(clientID)) break;
+			entities.despawn(clientID);
+			if (clientID == playerID) {
+				waitngToConnect = true;
+			}
+			break;
+		}
+
+		case CustomMsgTypes::Game_Snapshot:
+		{
+			// Server has gave us the changes since a snapshot we acknowledged
+			hsc::snapshots::world_state state;
+			if (!hsc::snapshots::decode(msg.body.data(), msg.body.size(), snapshotHistory, state)) break;
+			if (hasSnapshot && int32_t(state.tick - lastSnapshotTick) <= 0) break;
+			snapshotHistory.push(state);
+			lastSnapshotTick = state.tick;
+			lastSnapshotTime = getClockSync().toLocal(state.serverTime);
+			hasSnapshot = true;
+
+			// The snapshot holds everyone we can see, anyone else is gone
+			for (const auto& q : state.players) {
+				entities.setPlayer(hsc::snapshots::dequantize(q, snapshotOptions.precision));
+			}
+			std::vector<uint32_t> gone;
+			auto ids = entities.getRegistry().view<hsc::world::network_id>();
+			for (entt::entity e : ids) {
+				uint32_t id = ids.get<hsc::world::network_id>(e).id;
+				auto seen = std::lower_bound(state.players.begin(), state.players.end(), id,
+					[](const hsc::snapshots::quantized_player& p, uint32_t key) { return p.ID < key; });
+				if (seen == state.players.end() || seen->ID != id) {
+					gone.push_back(id);
+				}
+			}
+			for (uint32_t id : gone) {
+				entities.despawn(id);
+			}
+
+			hsc::net::packets::message<CustomMsgTypes> ack;
+			ack.header.id = CustomMsgTypes::Game_SnapshotAck;
+			hsc::net::packets::message_writer(ack).write(state.tick);
+			outbound.queue(ack);
+			break;
+		}
+
+		case CustomMsgTypes::Game_UpdatePlayer:
+		{
+			// Server has gave us an updated player	
+			player client;
+			if (!hsc::net::packets::message_reader(msg).read(client)) break;
+			setPlayersID(client.ID, client);
+			break;
+		}
+
+		}
+	}
+
+	// Copy our world into the buffer the render loop reads and hand it over
+	void publishWorld(bool connected = true) {
+		client_world& next = world.back();
+		next.playerID = playerID;
+		next.waitingToConnect = waitngToConnect;
+		next.connected = connected;
+		next.snapshotTime = lastSnapshotTime;
+		if (connected) {
+			next.latency = getClockSync().getEstimate();
+		}
+		next.players.clear();
+		entities.eachPlayer([&next](const player& p) { next.players.push_back(p); });
+		entities.clearDirty();
+		world.publish();
+	}
+
+	// The network thread, runs until `running` is cleared or the connection
+	// drops. Every wake up it applies all messages that arrived, takes the
+	// latest input from the render loop and lets the scheduler send.
+	void simulate(std::atomic<bool>& running) {
+		hsc::net::packets::message<CustomMsgTypes> updateMsg; // Reused every send so its body keeps its capacity
+		updateMsg.header.id = CustomMsgTypes::Game_UpdatePlayer;
+		std::vector<hsc::net::packets::owned_message<CustomMsgTypes>> batch;
+
+		while (running.load(std::memory_order_relaxed) && isConnected()) {
+			messagesToUs().wait_until(outbound.nextSend());
+
+			batch.clear();
+			bool worldChanged = messagesToUs().drain(batch) != 0;
+			for (auto& in : batch) {
+				handleMessage(in.msg, in.receivedAt);
+			}
+
+			// Our own pings give us the server's clock to interpolate against
+			if (!waitngToConnect && getClockSync().isDue()) {
+				hsc::net::packets::message<CustomMsgTypes> ping;
+				ping.header.id = CustomMsgTypes::Server_GetPing;
+				hsc::net::packets::message_writer(ping).write(getClockSync().makeRequest());
+				sendUnreliable(ping);
+			}
+
+			if (input.update()) {
+				myPlayer.pos = input.front().pos;
+				myPlayer.selectedEntity = input.front().selectedEntity;
+			}
+			if (!waitngToConnect) {
+				markPlayerIfMoved(updateMsg);
+			}
+			outbound.update(*this);
+
+			if (worldChanged) {
+				publishWorld();
+			}
+		}
+		publishWorld(false);
+	}
+
 	void setPlayer(player player) {
 		myPlayer = player;
 	}
@@ -26,13 +252,14 @@ public:
 	}
 
 	void setPlayersID(uint32_t id, player player) {
-		players.insert_or_assign(id, player);
+		player.setID(id);
+		entities.setPlayer(player);
 	}
 };
 
-int client_main(std::string addr, int port)
+int client_main(std::string addr, int port, double netRate, std::string cookedDir)
 {
-	CustomClient c;
+	CustomClient c(netRate);
 	std::cout << "Connecting to " << addr << ":" << port << std::endl;
 	c.connect(addr, port);
 
@@ -57,12 +284,41 @@ int client_main(std::string addr, int port)
 		camera.projection = CAMERA_PERSPECTIVE;    // Camera mode type
 		c.myPlayer.pos = camera.position;
 
-		Model tower = LoadModel("resources/models/obj/turret.obj");                 // Load OBJ model
-		Texture2D texture = LoadTexture("resources/models/obj/turret_diffuse.png"); // Load model texture
-		tower.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = texture;            // Set model diffuse texture
+		// Models and textures load on worker threads, placeholders are drawn until they are uploaded
+		hsc::assets::asset_manager assets(cookedDir);
+		hsc::spatial::scene_query scene(assets);                       // Bounding volume tree over placed models, for picking
+
+		// The village, each placed model keeps the instance it has in the scene
+		struct placed_model {
+			const char* name;
+			Vector3 position;
+			float scale;
+			hsc::assets::model_id model;
+			hsc::assets::texture_id texture;
+			hsc::spatial::instance_id instance;
+			int lod;                               // Level of detail drawn last frame
+		};
+		std::vector<placed_model> village = {
+			{ "turret", { 0.0f, 0.0f, 0.0f }, 1.0f },
+			{ "house", { 25.0f, 0.0f, -25.0f }, 0.6f },
+			{ "market", { -25.0f, 0.0f, -25.0f }, 0.5f },
+			{ "well", { 15.0f, 0.0f, 15.0f }, 1.0f },
+			{ "bridge", { -20.0f, 0.0f, 30.0f }, 0.6f },
+			{ "castle", { 10.0f, 0.0f, -42.0f }, 0.4f },
+		};
+		for (placed_model& placed : village) {
+			std::string path = std::string("resources/models/obj/") + placed.name;
+			placed.model = assets.acquireModel(path + ".obj");                // Load model
+			placed.texture = assets.acquireTexture(path + "_diffuse.png");    // Load model texture
+			Matrix transform = MatrixMultiply(MatrixScale(placed.scale, placed.scale, placed.scale), MatrixTranslate(placed.position.x, placed.position.y, placed.position.z));
+			placed.instance = scene.add(placed.model, transform);
+		}
 
-		Vector3 towerPos = { 0.0f, 0.0f, 0.0f };                        // Set model position
-		BoundingBox towerBBox = GetMeshBoundingBox(tower.meshes[0]);    // Get mesh bounding box
+		// Visible instances are grouped by model and texture and drawn with one instanced call each
+		hsc::render::instanced_renderer renderer;
+		hsc::render::instance_groups batches;
+		const uint64_t playerBatch = UINT64_MAX;                           // Every other player shares one batch
+		Model playerModel = LoadModelFromMesh(GenMeshCube(1.0f, 2.0f, 1.0f));
 
 		// Ground quad
 		Vector3 g0 = { -50.0f, 0.0f, -50.0f };
@@ -89,83 +345,32 @@ int client_main(std::string addr, int port)
 
 
 		SetTargetFPS(60);                   // Set our game to run at 60 frames-per-second
+
+		// Everything network side runs on its own thread, this one only
+		// reads the newest world it published and draws it
+		player localPlayer = c.myPlayer;
+		std::atomic<bool> running{ true };
+		std::thread network([&c, &running]() { c.simulate(running); });
 		//--------------------------------------------------------------------------------------
 
 		// Main game loops
 		while (!WindowShouldClose())        // Detect window close button or ESC key
 		{
-			if (!c.messagesToUs().empty())
-			{
-				auto msg = c.messagesToUs().pop_front().msg;
-
-				switch (msg.header.id)
-				{
-				case CustomMsgTypes::Client_Accepted:
-				{
-					// Server has accepted us			
-					std::cout << "Server Accepted Connection" << std::endl;
-					hsc::net::packets::message<CustomMsgTypes> msg;
-					msg.header.id = CustomMsgTypes::Client_Register;
-					msg << c.myPlayer;
-					c.send(msg);
-					break;
-				}
-				
-				case CustomMsgTypes::Client_SetID:
-				{
-					// Server has gave us our player
-					uint32_t id;
-					msg >> id;
-					c.setPlayerID(id);
-					std::cout << "Assigned ID "<< c.playerID << std::endl;
-					break;
-				}
-
-				case CustomMsgTypes::Game_AddPlayer:
-				{
-					// Server has gave us a new player	
-					player client;
-					msg >> client;
-					c.setPlayersID(client.ID, client);
-					if (client.ID == c.playerID) {
-						c.waitngToConnect = false;
-					}
-					std::cout << "Player " << client.ID << " created" << std::endl;
-					break;
-				}
-
-				case CustomMsgTypes::Game_RemovePlayer:
-				{
-					// Server has gave us an ID to remove
-					uint32_t clientID;
-					msg >> clientID;
-					c.players.erase(clientID);
-					if (clientID == c.playerID) {
-						c.waitngToConnect = true;
-					}
-					break;
-				}
-
-				case CustomMsgTypes::Game_UpdatePlayer:
-				{
-					// Server has gave us an updated player	
-					player client;
-					msg >> client;
-					c.setPlayersID(client.ID, client);
-					break;
-				}
-
-				}
-			}
-			if (!c.isConnected()) {
+			c.world.update();
+			const client_world& world = c.world.front();
+			if (!world.connected) {
 				break;
 			}
+			assets.update();                                     // Upload what finished loading, within a frame budget
+			scene.update();                                      // Refit models that just loaded
 			// Update
 			//----------------------------------------------------------------------------------
 			Vector2 mouse = GetMousePosition();
 			UpdateCamera(&camera);          // Update camera
-			if (!c.waitngToConnect) {
-				c.myPlayer.pos = camera.position;
+			if (!world.waitingToConnect) {
+				localPlayer.pos = camera.position;
+				c.input.back() = localPlayer;
+				c.input.publish();
 
 				// Display information about closest hit
 				RayCollision collision = { 0 };
@@ -209,28 +414,37 @@ int client_main(std::string addr, int port)
 					hitObjectName = "Sphere";
 				}
 
-				// Check ray collision against bounding box first, before trying the full ray-mesh test
-				RayCollision boxHitInfo = GetRayCollisionBox(ray, towerBBox);
+				// Check ray collision against the placed models, the scene tree only
+				// runs the ray-mesh test on models whose bounds the ray enters first
+				hsc::spatial::scene_hit modelHitInfo = scene.raycast(ray, collision.distance);
 
-				if ((boxHitInfo.hit) && (boxHitInfo.distance < collision.distance))
+				if (modelHitInfo.collision.hit)
 				{
-					collision = boxHitInfo;
+					collision = modelHitInfo.collision;
 					cursorColor = ORANGE;
-					hitObjectName = "Box";
-
-					// Check ray collision against model
-					// NOTE: It considers model.transform matrix!
-					RayCollision meshHitInfo = GetRayCollisionModel(ray, tower);
-
-					if (meshHitInfo.hit)
-					{
-						collision = meshHitInfo;
-						cursorColor = ORANGE;
-						hitObjectName = "Mesh";
+					for (const placed_model& placed : village) {
+						if (placed.instance == modelHitInfo.instance) hitObjectName = (char*)placed.name;
 					}
 				}
 				//----------------------------------------------------------------------------------
 
+				// Cull against the camera and batch what is left
+				// Far away models use a simplified level of detail, batched apart from the full one
+				batches.begin(hsc::render::frustum::fromCamera(camera, (float)GetScreenWidth() / (float)GetScreenHeight()));
+				hsc::render::screen_projection projection = hsc::render::screen_projection::fromCamera(camera, (float)GetScreenHeight());
+				for (placed_model& placed : village) {
+					BoundingBox bounds = scene.getBounds(placed.instance);
+					float distance = sqrtf(hsc::spatial::aabb_tree::distanceSquared(bounds, camera.position));
+					placed.lod = hsc::render::selectLod(assets.getLodErrors(placed.model), placed.lod, placed.scale, distance, projection);
+					batches.submit(((uint64_t)placed.model << 40) | ((uint64_t)placed.lod << 32) | placed.texture, bounds, scene.getTransform(placed.instance));
+				}
+				for (const player& other : world.players) {
+					if (other.ID == world.playerID) continue;
+					BoundingBox box = { Vector3Subtract(other.pos, { 0.5f, 1.0f, 0.5f }), Vector3Add(other.pos, { 0.5f, 1.0f, 0.5f }) };
+					batches.submit(playerBatch, box, MatrixTranslate(other.pos.x, other.pos.y, other.pos.z));
+				}
+				//----------------------------------------------------------------------------------
+
 				// Draw
 				//----------------------------------------------------------------------------------
 				// Draw everything in the render texture, note this will not be rendered on screen, yet
@@ -240,10 +454,16 @@ int client_main(std::string addr, int port)
 				BeginMode3D(camera);
 
 
-				// Draw the tower
-				// WARNING: If scale is different than 1.0f,
-				// not considered by GetRayCollisionModel()
-				DrawModel(tower, towerPos, 1.0f, WHITE);
+				// Draw the village and the other players
+				batches.flush([&](uint64_t key, const Matrix* transforms, int count) {
+					if (key == playerBatch) {
+						return renderer.draw(playerModel, playerModel.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture, SKYBLUE, transforms, count);
+					}
+					hsc::assets::model_id model = (hsc::assets::model_id)(key >> 40);
+					int lod = (int)((key >> 32) & 0xFF);
+					hsc::assets::texture_id texture = (hsc::assets::texture_id)(key & 0xFFFFFFFF);
+					return renderer.draw(assets.getModel(model, lod), assets.getTexture(texture), WHITE, transforms, count);
+				});
 
 				// Draw the test triangle
 				DrawLine3D(ta, tb, PURPLE);
@@ -253,8 +473,8 @@ int client_main(std::string addr, int port)
 				// Draw the test sphere
 				DrawSphereWires(sp, sr, 8, 8, PURPLE);
 
-				// Draw the mesh bbox if we hit it
-				if (boxHitInfo.hit) DrawBoundingBox(towerBBox, LIME);
+				// Draw the bbox of the model we hit
+				if (modelHitInfo.collision.hit) DrawBoundingBox(scene.getBounds(modelHitInfo.instance), LIME);
 
 				// If we hit something, draw the cursor at the hit point
 				if (collision.hit)
@@ -276,19 +496,26 @@ int client_main(std::string addr, int port)
 
 				DrawText("If executed inside a window,\nyou can resize the window,\nand see the screen scaling!", 10, 25, 20, WHITE);
 				DrawText(TextFormat("Default Mouse: [%i , %i]", (int)mouse.x, (int)mouse.y), 350, 25, 20, GREEN);
+				DrawText(TextFormat("Ping: %.1f ms (jitter %.1f ms)", world.latency.rttMs, world.latency.jitterMs), 10, 100, 20, GREEN);
+				hsc::assets::asset_stats assetStats = assets.getStats();
+				const hsc::render::batch_stats& batchStats = batches.getStats();
+				DrawText(TextFormat("Draw calls: %i, culled %i of %i, %i triangles", (int)batchStats.drawCalls, (int)batchStats.culled, (int)batchStats.submitted, (int)batchStats.triangles), 10, 150, 20, GREEN);
+				if (assetStats.loading > 0) DrawText(TextFormat("Loading %i assets", int(assetStats.loading)), 10, 125, 20, GREEN);
+				else if (assetStats.streaming > 0) DrawText(TextFormat("Streaming %i textures", int(assetStats.streaming)), 10, 125, 20, GREEN);
 
 				EndDrawing();
 			}
 
-			hsc::net::packets::message<CustomMsgTypes> msg;
-			msg.header.id = CustomMsgTypes::Game_UpdatePlayer;
-			msg << c.players[c.playerID];
-			c.send(msg);
 			//--------------------------------------------------------------------------------------
 		}
 
 		// De-Initialization
 		//--------------------------------------------------------------------------------------
+		running = false;
+		network.join();
+		UnloadModel(playerModel);
+		renderer.unload();
+		assets.shutdown();
 
 		CloseWindow();                      // Close window and OpenGL context
 		//--------------------------------------------------------------------------------------
@@ -5,6 +5,7 @@
 #include <client_main.hpp>
 #include <server_main.hpp>
 #include <net_common.hpp>
+#include <model_loader.hpp>
 #include <argparse/argparse.hpp>
 
 
@@ -39,6 +40,17 @@ int main(int argc, char* argv[])
         program.add_argument("port")
             .help("Port to connect to")
             .default_value(int(36676));
+        program.add_argument("--net-rate")
+            .help("Updates sent to the server per second")
+            .default_value(double(20.0))
+            .scan<'g', double>();
+        program.add_argument("--obj-models")
+            .help("Parse the OBJ models and decode the PNG textures instead of mapping the cooked ones")
+            .default_value(false)
+            .implicit_value(true);
+        program.add_argument("--cooked-dir")
+            .help("Where the cooked models and textures are, the build's own output by default")
+            .default_value(std::string(hsc::assets::default_cooked_dir));
 
         try {
             program.parse_args(argc, argv);
@@ -49,11 +61,39 @@ int main(int argc, char* argv[])
             std::exit(1);
         }
         std::cout << "Running as client" << std::endl;
-        return client_main(program.get<std::string>("address"), program.get<int>("port"));
+        std::string cookedDir = program.get<bool>("--obj-models") ? "" : program.get<std::string>("--cooked-dir");
+        return client_main(program.get<std::string>("address"), program.get<int>("port"), program.get<double>("--net-rate"), cookedDir);
     }
     if (game_type == GAME_TYPE_SERVER){
         program.add_argument("bind")
             .help("Address to bind the server to");
+        program.add_argument("--io-threads")
+            .help("Threads running the network io")
+            .default_value(int(std::max(1u, std::thread::hardware_concurrency() / 2)))
+            .scan<'i', int>();
+        program.add_argument("--tick-rate")
+            .help("Simulation ticks per second")
+            .default_value(double(30.0))
+            .scan<'g', double>();
+        program.add_argument("--udp")
+            .help("Send snapshots and player updates over UDP when clients can")
+            .default_value(false)
+            .implicit_value(true);
+        program.add_argument("--metrics-file")
+            .help("Write metrics in the Prometheus text format to this file")
+            .default_value(std::string(""));
+        program.add_argument("--metrics-interval")
+            .help("Seconds between metrics file writes")
+            .default_value(double(10.0))
+            .scan<'g', double>();
+        program.add_argument("--no-compression")
+            .help("Never compress messages, even for clients that offer it")
+            .default_value(false)
+            .implicit_value(true);
+        program.add_argument("--compress-min")
+            .help("Smallest message body in bytes worth compressing")
+            .default_value(int(512))
+            .scan<'i', int>();
         try {
             program.parse_args(argc, argv);
         }
@@ -64,7 +104,9 @@ int main(int argc, char* argv[])
         }
 
         std::cout << "Running as server" << std::endl;
-        return server_main(program.get<std::string>("bind"));
+        return server_main(program.get<std::string>("bind"), program.get<int>("--io-threads"), program.get<double>("--tick-rate"), program.get<bool>("--udp"),
+            program.get<std::string>("--metrics-file"), program.get<double>("--metrics-interval"),
+            !program.get<bool>("--no-compression"), program.get<int>("--compress-min"));
     }
     return -1;
 }
@@ -1,13 +1,64 @@
 #include <server_main.hpp>
 #include <net_common.hpp>
+#include <tick_scheduler.hpp>
+#include <snapshot_codec.hpp>
+#include <spatial_hash.hpp>
+#include <world_registry.hpp>
 #include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
 
 class CustomServer : public hsc::net::server_interface<CustomMsgTypes>
 {
 private:
-	std::unordered_map<uint32_t, player> players;
+	hsc::world::world_registry world; //Every registered player, keyed by client ID
+
+	//What one client has been told about the world
+	struct replication_state {
+		hsc::snapshots::snapshot_history history; //Snapshots sent to this client
+		uint32_t ackedTick = 0;
+		bool hasAck = false;
+		std::vector<uint32_t> visible; //Sorted IDs in its area of interest as of the last tick
+
+		explicit replication_state(uint32_t maxAge) : history(maxAge) {}
+	};
+
+	hsc::snapshots::codec_options snapshotOptions;
+	std::unordered_map<uint32_t, replication_state> replication; //Keyed by client ID, only registered clients
+	hsc::spatial::spatial_hash grid;
+	float interestRadius;
+	std::vector<uint32_t> disconnected; //Client IDs to clean up on the next tick
+
+	//Every player as of this tick, sorted by ID so a client's sorted
+	//visible IDs are found without touching the registry again
+	struct tick_player {
+		player state;
+		hsc::snapshots::quantized_player quantized;
+	};
+
+	//Scratch space reused by every tick
+	std::vector<tick_player> tickPlayers;
+	std::vector<uint32_t> visibleNow;
+	std::vector<uint32_t> changes;
+	std::vector<uint8_t> encodeBuffer;
+
+	//Calls `fn(const tick_player&)` for each of the sorted `ids` that is
+	//in tickPlayers, each search starts where the last one ended
+	template <typename Fn>
+	void forEachTickPlayer(const std::vector<uint32_t>& ids, Fn fn) const {
+		auto at = tickPlayers.begin();
+		for (uint32_t id : ids) {
+			at = std::lower_bound(at, tickPlayers.end(), id, [](const tick_player& p, uint32_t id) { return p.state.ID < id; });
+			if (at == tickPlayers.end()) return;
+			if (at->state.ID == id) fn(*at);
+		}
+	}
 public:
-	CustomServer(uint16_t port, const char* address) : hsc::net::server_interface<CustomMsgTypes>(port, address)
+	CustomServer(uint16_t port, const char* address, float interestRadius = 100.0f, float cellSize = 50.0f) :
+		hsc::net::server_interface<CustomMsgTypes>(port, address), grid(cellSize), interestRadius(interestRadius)
 	{
 
 	}
@@ -28,6 +79,7 @@ protected:
 	void onClientDisconnect(std::shared_ptr<hsc::net::connection<CustomMsgTypes>> client) override
 	{
 		std::cout << "Removing client " << client->getID() << std::endl;
+		disconnected.push_back(client->getID());
 	}
 
 	// Called when a message arrives
@@ -39,59 +91,242 @@ protected:
 		{
 			//The client has gave us their player
 			player clientPlayer;
-			msg >> clientPlayer;
+			if (!hsc::net::packets::message_reader(msg).read(clientPlayer)) break;
 			clientPlayer.setID(client->getID());
-			players.insert_or_assign(clientPlayer.ID, clientPlayer);
+			world.setPlayer(clientPlayer);
+			grid.move(clientPlayer.ID, clientPlayer.pos);
 			std::cout << "Player " << clientPlayer.ID << " is registering" << std::endl;
 
 			//Send the client their ID back
 			hsc::net::packets::message<CustomMsgTypes> msg2;
 			msg2.header.id = CustomMsgTypes::Client_SetID;
-			msg2 << clientPlayer.ID;
+			hsc::net::packets::message_writer(msg2).write(clientPlayer.ID);
 			client->send(msg2);
 			std::cout << "Send ID to Player " << clientPlayer.ID << std::endl;
 
 
-			//Send this player to all the other players
+			//Send the client their own player, nearby players reach them and
+			//they reach nearby players on the next tick
 			hsc::net::packets::message<CustomMsgTypes> msg3;
 			msg3.header.id = CustomMsgTypes::Game_AddPlayer;
-			msg3 << clientPlayer;
-			sendMessageAll(msg3);
-			std::cout << "Player " << clientPlayer.ID << " has been sent to all others" << std::endl;
+			hsc::net::packets::message_writer(msg3).write(clientPlayer);
+			client->send(msg3);
 
+			auto& state = replication.insert_or_assign(clientPlayer.ID, replication_state(snapshotOptions.maxBaselineAge)).first->second;
+			state.visible.push_back(clientPlayer.ID);
 
-			//Send this player all the other players
-			for (const auto& player : players) {
-				hsc::net::packets::message<CustomMsgTypes> msg4;
-				msg4.header.id = CustomMsgTypes::Game_AddPlayer;
-				msg4 << player.second;
-				sendMessage(client, msg4);
+			break;
+		}
+		case CustomMsgTypes::Client_Unregister:
+		{
+			break;
+		}
+
+		case CustomMsgTypes::Server_GetPing:
+		{
+			//Either the client answering our ping or asking for its own
+			hsc::net::ping_payload ping;
+			if (!hsc::net::packets::message_reader(msg).read(ping)) break;
+			if (ping.isReply) {
+				client->getClockSync().onReply(ping, getReceivedAt());
 			}
+			else {
+				hsc::net::packets::message<CustomMsgTypes> pong;
+				pong.header.id = CustomMsgTypes::Server_GetPing;
+				hsc::net::packets::message_writer(pong).write(hsc::net::clock_sync::makeReply(ping, getReceivedAt()));
+				client->sendUnreliable(pong);
+			}
+			break;
+		}
 
+		case CustomMsgTypes::Server_GetStatus:
+		{
+			//Answer with the same text the metrics file gets
+			std::ostringstream text;
+			writeMetrics(text);
+			const std::string& body = text.str();
+			hsc::net::packets::message<CustomMsgTypes> status;
+			status.header.id = CustomMsgTypes::Server_GetStatus;
+			hsc::net::packets::message_writer(status).writeBytes(body.data(), body.size());
+			client->send(status);
 			break;
 		}
-		case CustomMsgTypes::Client_Unregister:
+
+		case CustomMsgTypes::Game_SnapshotAck:
 		{
+			uint32_t tick = 0;
+			if (!hsc::net::packets::message_reader(msg).read(tick)) break;
+			auto state = replication.find(client->getID());
+			if (state != replication.end() && (!state->second.hasAck || tick > state->second.ackedTick)) {
+				state->second.ackedTick = tick;
+				state->second.hasAck = true;
+			}
 			break;
 		}
 
 		case CustomMsgTypes::Game_UpdatePlayer:
 		{
-			//Send the updated player to all others, apart from where it came
-			sendMessageAll(msg, client);
+			//Fold the update into our state, the grid and the next snapshot
+			//pick it up on the next tick
+			player update;
+			if (!hsc::net::packets::message_reader(msg).read(update)) break;
+			update.setID(client->getID());
+			if (world.contains(update.ID)) {
+				world.setPlayer(update);
+			}
 			break;
 		}
 		}
 	}
+
+public:
+	//Replicate to every client what is inside its area of interest. Players
+	//entering or leaving it are announced with Game_AddPlayer and
+	//Game_RemovePlayer, then one snapshot is sent, delta encoded against the
+	//newest one the client acknowledged.
+	void tick(uint32_t tickNumber)
+	{
+		removeDeadClients();
+		for (uint32_t id : disconnected) {
+			world.despawn(id);
+			grid.remove(id);
+			replication.erase(id);
+		}
+		disconnected.clear();
+
+		//Only players that changed since the last tick need moving in the grid
+		entt::registry& registry = world.getRegistry();
+		auto moved = registry.view<hsc::world::network_id, hsc::world::transform, hsc::world::replication_dirty>();
+		for (entt::entity e : moved) {
+			grid.move(moved.get<hsc::world::network_id>(e).id, moved.get<hsc::world::transform>(e).pos);
+		}
+		world.clearDirty();
+
+		tickPlayers.clear();
+		world.eachPlayer([&](const player& p) {
+			tickPlayers.push_back({ p, hsc::snapshots::quantize(p, snapshotOptions.precision) });
+		});
+		std::sort(tickPlayers.begin(), tickPlayers.end(), [](const tick_player& a, const tick_player& b) { return a.state.ID < b.state.ID; });
+
+		const int64_t tickTime = hsc::net::clock_sync::now();
+
+		forEachClient([&](std::shared_ptr<hsc::net::connection<CustomMsgTypes>>& client) {
+			auto state = replication.find(client->getID());
+			entt::entity self = world.find(client->getID());
+			if (state == replication.end() || self == entt::null) return;
+			replication_state& rep = state->second;
+
+			//Keep each client's round trip and clock offset fresh
+			hsc::net::clock_sync& sync = client->getClockSync();
+			if (sync.isDue(tickTime)) {
+				hsc::net::packets::message<CustomMsgTypes> ping;
+				ping.header.id = CustomMsgTypes::Server_GetPing;
+				hsc::net::packets::message_writer(ping).write(sync.makeRequest());
+				client->sendUnreliable(ping);
+			}
+
+			visibleNow.clear();
+			grid.query(registry.get<hsc::world::transform>(self).pos, interestRadius, visibleNow);
+			std::sort(visibleNow.begin(), visibleNow.end());
+
+			//Everyone entering goes in one message, a new client's first
+			//burst is big and repetitive enough to compress well
+			changes.clear();
+			std::set_difference(visibleNow.begin(), visibleNow.end(), rep.visible.begin(), rep.visible.end(), std::back_inserter(changes));
+			if (!changes.empty()) {
+				hsc::net::packets::message<CustomMsgTypes> entered;
+				entered.header.id = CustomMsgTypes::Game_AddPlayer;
+				hsc::net::packets::message_writer<CustomMsgTypes> writer(entered);
+				writer.reserve(changes.size() * sizeof(player));
+				forEachTickPlayer(changes, [&](const tick_player& p) { writer.write(p.state); });
+				client->send(entered);
+			}
+			changes.clear();
+			std::set_difference(rep.visible.begin(), rep.visible.end(), visibleNow.begin(), visibleNow.end(), std::back_inserter(changes));
+			for (uint32_t id : changes) {
+				hsc::net::packets::message<CustomMsgTypes> left;
+				left.header.id = CustomMsgTypes::Game_RemovePlayer;
+				hsc::net::packets::message_writer(left).write(id);
+				client->send(left);
+			}
+			rep.visible.swap(visibleNow);
+
+			hsc::snapshots::world_state snapshotState;
+			snapshotState.tick = tickNumber;
+			snapshotState.serverTime = tickTime;
+			snapshotState.players.reserve(rep.visible.size());
+			forEachTickPlayer(rep.visible, [&](const tick_player& p) { snapshotState.players.push_back(p.quantized); });
+
+			//No baseline means a full state, also used once an ack is too old
+			const hsc::snapshots::world_state* baseline = nullptr;
+			if (rep.hasAck && tickNumber - rep.ackedTick <= snapshotOptions.maxBaselineAge) {
+				baseline = rep.history.find(rep.ackedTick);
+			}
+			encodeBuffer.clear();
+			hsc::snapshots::encode(snapshotState, baseline, encodeBuffer);
+			rep.history.push(snapshotState);
+
+			hsc::net::packets::message<CustomMsgTypes> snapshot;
+			snapshot.header.id = CustomMsgTypes::Game_Snapshot;
+			hsc::net::packets::message_writer(snapshot).writeBytes(encodeBuffer.data(), encodeBuffer.size());
+			client->sendUnreliable(snapshot);
+		});
+	}
 };
 
-int server_main(std::string bind_to) {
+//Write the metrics next to `path` then move them over it, so a scraper
+//never reads a half written file
+static void dumpMetrics(CustomServer& server, const std::string& path) {
+	std::string temporary = path + ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::trunc);
+		if (!out) {
+			std::cerr << "Could not write metrics to " << temporary << std::endl;
+			return;
+		}
+		server.writeMetrics(out);
+	}
+	if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+		std::remove(path.c_str());
+		std::rename(temporary.c_str(), path.c_str());
+	}
+}
+
+int server_main(std::string bind_to, int ioThreads, double tickRate, bool unreliable, std::string metricsFile, double metricsInterval, bool compression, int compressMin) {
 	CustomServer server(36676, bind_to.c_str());
+	server.setIoThreads(ioThreads);
+	if (unreliable) server.enableUnreliable();
+	hsc::net::compression_options compressionOptions;
+	compressionOptions.enabled = compression;
+	compressionOptions.minSize = uint32_t(std::max(compressMin, 1));
+	server.setCompression(compressionOptions);
 	server.start();
 
+	hsc::tick_scheduler ticks(tickRate);
+	auto nextReport = hsc::tick_scheduler::clock::now() + std::chrono::seconds(1);
+	const auto metricsPeriod = std::chrono::duration_cast<hsc::tick_scheduler::clock::duration>(std::chrono::duration<double>(std::max(metricsInterval, 0.1)));
+	auto nextMetrics = hsc::tick_scheduler::clock::now() + metricsPeriod;
 	while (1)
 	{
-		server.update(-1, true);
+		//Handle messages as they come in, then tick when it is due
+		server.updateUntil(ticks.nextTick());
+
+		ticks.beginTick();
+		server.tick(uint32_t(ticks.getTickCount()));
+		const auto& stats = ticks.endTick();
+		server.observeTick(stats.durationMs);
+
+		if (!metricsFile.empty() && hsc::tick_scheduler::clock::now() >= nextMetrics) {
+			dumpMetrics(server, metricsFile);
+			nextMetrics += metricsPeriod;
+		}
+
+		if (hsc::tick_scheduler::clock::now() >= nextReport) {
+			std::cout << "Tick " << stats.tick << ": " << stats.durationMs << "ms used, "
+				<< stats.budgetLeftMs << "ms left, worst " << ticks.takeWorstMs() << "ms, "
+				<< ticks.getOverruns() << " overruns" << std::endl;
+			nextReport += std::chrono::seconds(1);
+		}
 	}
 	return 0;
 }
\ No newline at end of file
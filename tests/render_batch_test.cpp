@@ -0,0 +1,161 @@
+// Frustum culling and instance grouping without a window: frustum planes
+// against a brute force test of each box's corners in clip space, and the
+// counters instance_groups keeps over two frames.
+#include "test_check.hpp"
+#include <render_batch.hpp>
+#include <cmath>
+#include <random>
+#include <set>
+#include <vector>
+
+using namespace hsc::render;
+
+// A world point in clip space, x, y and z inside [-w, w] when visible
+static Vector4 toClip(const Matrix& m, Vector3 v) {
+	return {
+		m.m0 * v.x + m.m4 * v.y + m.m8 * v.z + m.m12,
+		m.m1 * v.x + m.m5 * v.y + m.m9 * v.z + m.m13,
+		m.m2 * v.x + m.m6 * v.y + m.m10 * v.z + m.m14,
+		m.m3 * v.x + m.m7 * v.y + m.m11 * v.z + m.m15
+	};
+}
+
+// How far a clip space point is inside each of the six planes, w + x, w - x
+// and so on in the order frustum keeps them
+static void planeDistances(Vector4 clip, float out[6]) {
+	const float axes[3] = { clip.x, clip.y, clip.z };
+	for (int axis = 0; axis < 3; axis++) {
+		out[axis * 2] = clip.w + axes[axis];
+		out[axis * 2 + 1] = clip.w - axes[axis];
+	}
+}
+
+enum class expected { visible, culled, unsure };
+
+// A box is culled exactly when all eight corners are outside the same
+// plane. Corners this close to a plane are left to rounding.
+static expected bruteForce(const Matrix& viewProjection, const BoundingBox& box) {
+	float distances[8][6];
+	float scale = 0.0f;
+	for (int corner = 0; corner < 8; corner++) {
+		Vector3 point = {
+			corner & 1 ? box.max.x : box.min.x,
+			corner & 2 ? box.max.y : box.min.y,
+			corner & 4 ? box.max.z : box.min.z
+		};
+		Vector4 clip = toClip(viewProjection, point);
+		planeDistances(clip, distances[corner]);
+		scale = std::max(scale, std::fabs(clip.w));
+	}
+	const float margin = 1e-4f * std::max(scale, 1.0f);
+	bool unsure = false;
+	for (int plane = 0; plane < 6; plane++) {
+		bool allOutside = true;
+		for (int corner = 0; corner < 8; corner++) {
+			if (std::fabs(distances[corner][plane]) < margin) unsure = true;
+			if (distances[corner][plane] >= 0.0f) allOutside = false;
+		}
+		if (allOutside) return unsure ? expected::unsure : expected::culled;
+	}
+	return unsure ? expected::unsure : expected::visible;
+}
+
+static BoundingBox randomBox(std::mt19937& random) {
+	std::uniform_real_distribution<float> position(-80.0f, 80.0f);
+	std::uniform_real_distribution<float> extent(0.05f, 6.0f);
+	Vector3 center = { position(random), position(random) * 0.3f, position(random) };
+	Vector3 half = { extent(random), extent(random), extent(random) };
+	return { Vector3Subtract(center, half), Vector3Add(center, half) };
+}
+
+static void testCamera(const Camera& camera, float aspect) {
+	const frustum view = frustum::fromCamera(camera, aspect);
+	Matrix projection;
+	if (camera.projection == CAMERA_ORTHOGRAPHIC) {
+		double top = camera.fovy / 2.0;
+		projection = MatrixOrtho(-top * aspect, top * aspect, -top, top, 0.01, 1000.0);
+	}
+	else projection = MatrixPerspective(camera.fovy * DEG2RAD, aspect, 0.01, 1000.0);
+	const Matrix viewProjection = MatrixMultiply(MatrixLookAt(camera.position, camera.target, camera.up), projection);
+
+	std::mt19937 random(7);
+	size_t visible = 0, culled = 0, wrong = 0;
+	for (int i = 0; i < 20000; i++) {
+		BoundingBox box = randomBox(random);
+		expected want = bruteForce(viewProjection, box);
+		bool got = view.intersects(box);
+		if (want == expected::unsure) continue;
+		if (got != (want == expected::visible)) wrong++;
+		if (want == expected::visible) visible++;
+		else culled++;
+	}
+	CHECK(wrong == 0);
+	// The camera has to see some of the boxes and miss others for the test to mean anything
+	CHECK(visible > 1000);
+	CHECK(culled > 1000);
+
+	// A sphere test on the box's center agrees with the point itself
+	for (int i = 0; i < 2000; i++) {
+		BoundingBox box = randomBox(random);
+		Vector3 center = Vector3Scale(Vector3Add(box.min, box.max), 0.5f);
+		if (bruteForce(viewProjection, { center, center }) == expected::unsure) continue;
+		CHECK(view.intersects(center, 0.0f) == view.intersects(BoundingBox{ center, center }));
+	}
+}
+
+// Counters over two frames, the second with fewer groups to check begin()
+// clears what the first left behind
+static void testGroups() {
+	const Camera camera = { { 10.0f, 12.0f, 30.0f }, { 0.0f, 2.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, 45.0f, CAMERA_PERSPECTIVE };
+	const frustum view = frustum::fromCamera(camera, 16.0f / 9.0f);
+	instance_groups groups;
+	std::mt19937 random(11);
+
+	for (uint64_t keys : { 13u, 3u }) {
+		groups.begin(view);
+		size_t submitted = 0, culled = 0;
+		std::set<uint64_t> visibleKeys;
+		std::vector<size_t> perKey(keys, 0);
+		for (int i = 0; i < 5000; i++) {
+			BoundingBox box = randomBox(random);
+			uint64_t key = uint64_t(i) % keys;
+			bool shown = groups.submit(key, box, MatrixIdentity());
+			CHECK(shown == view.intersects(box));
+			submitted++;
+			if (!shown) culled++;
+			else {
+				visibleKeys.insert(key);
+				perKey[key]++;
+			}
+		}
+
+		size_t calls = 0, drawn = 0;
+		groups.flush([&](uint64_t key, const Matrix* transforms, int count) {
+			calls++;
+			drawn += size_t(count);
+			CHECK(transforms != nullptr);
+			CHECK(key < keys && size_t(count) == perKey[key]);
+			draw_counts counts;
+			counts.drawCalls = 1;
+			counts.triangles = size_t(count) * 12;
+			return counts;
+		});
+
+		const batch_stats& stats = groups.getStats();
+		CHECK(stats.submitted == submitted);
+		CHECK(stats.culled == culled);
+		CHECK(stats.groups == visibleKeys.size());
+		CHECK(calls == visibleKeys.size());
+		CHECK(drawn == submitted - culled);
+		CHECK(stats.drawCalls == calls);
+		CHECK(stats.triangles == drawn * 12);
+	}
+}
+
+int main() {
+	testCamera({ { 10.0f, 12.0f, 30.0f }, { 0.0f, 2.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, 45.0f, CAMERA_PERSPECTIVE }, 16.0f / 9.0f);
+	testCamera({ { -40.0f, 5.0f, -3.0f }, { 0.0f, 0.0f, 10.0f }, { 0.0f, 1.0f, 0.0f }, 70.0f, CAMERA_PERSPECTIVE }, 4.0f / 3.0f);
+	testCamera({ { 10.0f, 12.0f, 30.0f }, { 0.0f, 2.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, 40.0f, CAMERA_ORTHOGRAPHIC }, 16.0f / 9.0f);
+	testGroups();
+	return finish("render_batch_test");
+}
@@ -0,0 +1,184 @@
+// The scene's dynamic bounding volume tree against brute force over every
+// leaf's stored box: box, sphere and ray queries after inserts, moves and
+// removals. Many rays run along an axis from a point on a box face, the
+// case a zero direction component gets wrong, a ray along a face touches
+// the box.
+#include "test_check.hpp"
+#include <scene_query.hpp>
+#include <cmath>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+using hsc::spatial::aabb_tree;
+
+struct leaf {
+	uint32_t node;
+	BoundingBox bounds;
+};
+
+static BoundingBox randomBox(std::mt19937& random) {
+	std::uniform_real_distribution<float> position(-200.0f, 200.0f);
+	std::uniform_real_distribution<float> extent(0.1f, 8.0f);
+	Vector3 center = { position(random), position(random) * 0.2f, position(random) };
+	Vector3 half = { extent(random), extent(random), extent(random) };
+	return { Vector3Subtract(center, half), Vector3Add(center, half) };
+}
+
+// Slab test that handles a zero direction component by checking the origin
+// lies between that axis' planes, the reference the tree has to agree with
+static bool bruteForceRay(const BoundingBox& box, const Ray& ray, float maxDistance, float& entry) {
+	const float origin[3] = { ray.position.x, ray.position.y, ray.position.z };
+	const float direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+	const float min[3] = { box.min.x, box.min.y, box.min.z };
+	const float max[3] = { box.max.x, box.max.y, box.max.z };
+	float near = -FLT_MAX, far = FLT_MAX;
+	for (int axis = 0; axis < 3; axis++) {
+		if (direction[axis] == 0.0f) {
+			if (origin[axis] < min[axis] || origin[axis] > max[axis]) return false;
+			continue;
+		}
+		float t1 = (min[axis] - origin[axis]) / direction[axis];
+		float t2 = (max[axis] - origin[axis]) / direction[axis];
+		near = std::max(near, std::min(t1, t2));
+		far = std::min(far, std::max(t1, t2));
+	}
+	entry = std::max(near, 0.0f);
+	return far >= entry && entry <= maxDistance;
+}
+
+static Ray randomRay(std::mt19937& random, const std::map<uint32_t, leaf>& leaves, const aabb_tree& tree) {
+	std::uniform_real_distribution<float> position(-220.0f, 220.0f);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	std::uniform_int_distribution<int> kind(0, 2);
+	Ray ray;
+	ray.position = { position(random), position(random) * 0.2f, position(random) };
+	ray.direction = Vector3Normalize({ unit(random), unit(random), unit(random) });
+	if (kind(random) == 0 || leaves.empty()) return ray;
+
+	// Along an axis, starting level with a face of one of the stored boxes
+	auto pick = leaves.begin();
+	std::advance(pick, std::uniform_int_distribution<size_t>(0, leaves.size() - 1)(random));
+	const BoundingBox fat = tree.getFatBounds(pick->second.node);
+	int axis = std::uniform_int_distribution<int>(0, 2)(random);
+	int flat = (axis + 1 + std::uniform_int_distribution<int>(0, 1)(random)) % 3;
+	float* origin[3] = { &ray.position.x, &ray.position.y, &ray.position.z };
+	const float faces[3][2] = { { fat.min.x, fat.max.x }, { fat.min.y, fat.max.y }, { fat.min.z, fat.max.z } };
+	*origin[flat] = faces[flat][random() % 2];
+	ray.direction = { 0.0f, 0.0f, 0.0f };
+	float* direction[3] = { &ray.direction.x, &ray.direction.y, &ray.direction.z };
+	*direction[axis] = random() % 2 ? 1.0f : -1.0f;
+	return ray;
+}
+
+static void checkQueries(const aabb_tree& tree, const std::map<uint32_t, leaf>& leaves, std::mt19937& random) {
+	for (int i = 0; i < 200; i++) {
+		BoundingBox box = randomBox(random);
+		std::multiset<uint32_t> got, want;
+		tree.queryBox(box, [&](uint32_t user) { got.insert(user); });
+		for (const auto& entry : leaves) {
+			if (aabb_tree::overlaps(tree.getFatBounds(entry.second.node), box)) want.insert(entry.first);
+		}
+		CHECK(got == want);
+
+		Vector3 center = Vector3Scale(Vector3Add(box.min, box.max), 0.5f);
+		float radius = box.max.x - box.min.x;
+		got.clear();
+		want.clear();
+		tree.querySphere(center, radius, [&](uint32_t user) { got.insert(user); });
+		for (const auto& entry : leaves) {
+			if (aabb_tree::distanceSquared(tree.getFatBounds(entry.second.node), center) <= radius * radius) want.insert(entry.first);
+		}
+		CHECK(got == want);
+	}
+
+	size_t axisRays = 0;
+	for (int i = 0; i < 600; i++) {
+		Ray ray = randomRay(random, leaves, tree);
+		const float maxDistance = 300.0f;
+		if (ray.direction.x == 0.0f || ray.direction.y == 0.0f || ray.direction.z == 0.0f) axisRays++;
+
+		// Every leaf the ray enters, with where it enters
+		std::map<uint32_t, float> got, want;
+		tree.queryRay(ray, maxDistance, [&](uint32_t user, float entry) {
+			CHECK(got.count(user) == 0);
+			got[user] = entry;
+			return maxDistance;
+		});
+		for (const auto& entry : leaves) {
+			float at;
+			if (bruteForceRay(tree.getFatBounds(entry.second.node), ray, maxDistance, at)) want[entry.first] = at;
+		}
+		CHECK(got.size() == want.size());
+		for (const auto& hit : want) {
+			auto found = got.find(hit.first);
+			CHECK(found != got.end());
+			if (found != got.end()) CHECK(std::fabs(found->second - hit.second) <= 1e-3f * std::max(1.0f, hit.second));
+		}
+
+		// Stopping at the first entry still finds the nearest one
+		if (!want.empty()) {
+			float nearest = FLT_MAX;
+			for (const auto& hit : want) nearest = std::min(nearest, hit.second);
+			float first = FLT_MAX;
+			tree.queryRay(ray, maxDistance, [&](uint32_t, float entry) {
+				first = std::min(first, entry);
+				return entry;
+			});
+			CHECK(std::fabs(first - nearest) <= 1e-3f * std::max(1.0f, nearest));
+		}
+	}
+	CHECK(axisRays > 100);
+}
+
+int main() {
+	std::mt19937 random(5);
+	aabb_tree tree;
+	std::map<uint32_t, leaf> leaves; // Keyed by user data
+	uint32_t nextUser = 0;
+	for (int i = 0; i < 2000; i++) {
+		BoundingBox box = randomBox(random);
+		leaves[nextUser] = { tree.insert(box, nextUser), box };
+		nextUser++;
+	}
+	CHECK(tree.size() == leaves.size());
+	// Balanced, far below the 2000 a list would be
+	CHECK(tree.getHeight() < 40);
+	checkQueries(tree, leaves, random);
+
+	// Small moves stay inside the margin, large ones reinsert
+	std::uniform_real_distribution<float> nudge(-0.3f, 0.3f), jump(-60.0f, 60.0f);
+	size_t reinserted = 0;
+	for (auto& entry : leaves) {
+		bool far = random() % 4 == 0;
+		Vector3 offset = far ? Vector3{ jump(random), 0.0f, jump(random) } : Vector3{ nudge(random), nudge(random), nudge(random) };
+		entry.second.bounds = { Vector3Add(entry.second.bounds.min, offset), Vector3Add(entry.second.bounds.max, offset) };
+		if (tree.move(entry.second.node, entry.second.bounds)) reinserted++;
+	}
+	CHECK(reinserted > 0 && reinserted < leaves.size());
+	for (const auto& entry : leaves) {
+		CHECK(tree.getUserData(entry.second.node) == entry.first);
+		CHECK(aabb_tree::overlaps(tree.getFatBounds(entry.second.node), entry.second.bounds));
+	}
+	checkQueries(tree, leaves, random);
+
+	// Remove half, then fill back up so freed nodes get reused
+	for (auto it = leaves.begin(); it != leaves.end();) {
+		if (random() % 2 == 0) {
+			tree.remove(it->second.node);
+			it = leaves.erase(it);
+		}
+		else ++it;
+	}
+	CHECK(tree.size() == leaves.size());
+	checkQueries(tree, leaves, random);
+	for (int i = 0; i < 500; i++) {
+		BoundingBox box = randomBox(random);
+		leaves[nextUser] = { tree.insert(box, nextUser), box };
+		nextUser++;
+	}
+	CHECK(tree.size() == leaves.size());
+	checkQueries(tree, leaves, random);
+	return finish("scene_query_test");
+}
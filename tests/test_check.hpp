@@ -0,0 +1,24 @@
+#pragma once
+
+// Shared by the headless test programs: counts failed checks and prints
+// where they were, main returns finish() so ctest sees the result.
+#include <iostream>
+
+inline int test_failures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			test_failures++; \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+		} \
+	} while (0)
+
+inline int finish(const char* name) {
+	if (test_failures > 0) {
+		std::cerr << name << ": " << test_failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << name << ": passed" << std::endl;
+	return 0;
+}
@@ -0,0 +1,91 @@
+// Texture cooking on the CPU alone: synthetic opaque and translucent images
+// are cooked, written and mapped back through cooked_texture_file, then
+// every level is decoded and compared with the mip it was encoded from.
+// Levels under 1024 pixels fit in a few blocks that each hold most of the
+// image's colours, BC1/BC3 can't do well there so they only have to decode
+// to something close.
+#include "test_check.hpp"
+#include "texture_cook.hpp"
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+
+using namespace hsc::assets;
+
+// Smooth gradients with a few hard edges and a little noise, roughly what
+// the diffuse textures look like. translucent also ramps the alpha.
+static rgba_image makeImage(uint32_t width, uint32_t height, bool translucent) {
+	std::mt19937 random(width * 31 + height);
+	std::uniform_int_distribution<int> noise(-6, 6);
+	rgba_image image;
+	image.width = width;
+	image.height = height;
+	image.pixels.resize(size_t(width) * height * 4);
+	for (uint32_t y = 0; y < height; y++) {
+		for (uint32_t x = 0; x < width; x++) {
+			uint8_t* pixel = &image.pixels[(size_t(y) * width + x) * 4];
+			bool stripe = (x / 16 + y / 16) % 2 == 0;
+			int base[3] = { int(200 * x / width) + 20, int(180 * y / height) + 30, stripe ? 160 : 60 };
+			for (int c = 0; c < 3; c++) pixel[c] = uint8_t(std::min(255, std::max(0, base[c] + noise(random))));
+			pixel[3] = translucent ? uint8_t(255 * (x + y) / (width + height)) : 255;
+		}
+	}
+	return image;
+}
+
+constexpr double small_level_psnr = 15.0;
+
+static void testCook(const std::string& name, uint32_t width, uint32_t height, texture_encoding encoding, double minPsnr) {
+	const bool translucent = encoding == texture_encoding::bc3;
+	const rgba_image image = makeImage(width, height, translucent);
+	const cooked_texture cooked = cookImage(image, encoding);
+
+	const std::string path = name + ".hct";
+	{
+		const std::vector<uint8_t> bytes = serializeTexture(cooked);
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+		CHECK(out.good());
+	}
+
+	cooked_texture_file file;
+	std::string error;
+	CHECK(file.open(path, &error));
+	if (!file.isOpen()) {
+		std::cerr << name << ": " << error << std::endl;
+		return;
+	}
+	CHECK(file.header().encoding == encoding);
+	CHECK(file.header().width == width && file.header().height == height);
+
+	// Every level down to 1x1, however far apart the sides are
+	uint32_t expectedLevels = 1;
+	while ((std::max(width, height) >> (expectedLevels - 1)) > 1) expectedLevels++;
+	CHECK(file.levelCount() == expectedLevels);
+	const texture_level& smallest = file.getLevel(file.levelCount() - 1);
+	CHECK(smallest.width == 1 && smallest.height == 1);
+
+	for (uint32_t level = 0; level < file.levelCount(); level++) {
+		const texture_level& l = file.getLevel(level);
+		const rgba_image& source = cooked.chain[level];
+		CHECK(l.width == source.width && l.height == source.height);
+		rgba_image decoded = decodeLevel(file.getData(level), l.width, l.height, encoding);
+		double quality = psnr(source, decoded, translucent);
+		double required = size_t(l.width) * l.height >= 1024 ? minPsnr : std::min(minPsnr, small_level_psnr);
+		if (quality < required) {
+			std::cerr << name << " level " << level << " (" << l.width << "x" << l.height << ") PSNR " << quality << " dB" << std::endl;
+		}
+		CHECK(quality >= required);
+	}
+	file.close();
+	std::remove(path.c_str());
+}
+
+int main() {
+	testCook("texture_cook_bc1_square", 128, 128, texture_encoding::bc1, 33.0);
+	testCook("texture_cook_bc1_wide", 128, 32, texture_encoding::bc1, 33.0);
+	testCook("texture_cook_bc3_tall", 32, 256, texture_encoding::bc3, 33.0);
+	testCook("texture_cook_rgba_odd", 30, 18, texture_encoding::rgba8, 99.0);
+	return finish("texture_cook_test");
+}
@@ -0,0 +1,342 @@
+// Headless load generator: runs many scripted players against a server from
+// one process, without raylib opening a window.
+#include <net_common.hpp>
+#include <snapshot_codec.hpp>
+#include <argparse/argparse.hpp>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using bot_clock = std::chrono::steady_clock;
+
+static double millisBetween(bot_clock::time_point from, bot_clock::time_point to) {
+	return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+// Value below which `fraction` of the samples fall, sorts `samples`
+static double percentile(std::vector<double>& samples, double fraction) {
+	if (samples.empty()) return 0.0;
+	std::sort(samples.begin(), samples.end());
+	return samples[size_t(fraction * double(samples.size() - 1) + 0.5)];
+}
+
+enum class movement { circle, line, wander };
+
+// One simulated player, does the same Client_Accepted -> Client_Register ->
+// Client_SetID handshake as the game client and then moves on a script
+class Bot : public hsc::net::client_interface<CustomMsgTypes>
+{
+public:
+	Bot(asio::io_context& context, Vector3 home, movement pattern, uint32_t seed) :
+		hsc::net::client_interface<CustomMsgTypes>(context), home(home), pattern(pattern), random(seed)
+	{
+		me.pos = home;
+		phase = std::uniform_real_distribution<float>(0.0f, 6.2831853f)(random);
+	}
+
+	bot_clock::time_point connectStarted;
+	double connectMs = -1.0;       // Connect until Client_Accepted, negative until then
+	bool registered = false;       // Our own Game_AddPlayer came back
+	uint32_t playerID = 0;
+	uint64_t bytesIn = 0;
+	uint64_t messagesIn = 0;
+
+	// Handle everything that arrived, update round trips land in `rtt`
+	void poll(bot_clock::time_point now, std::vector<double>& rtt) {
+		hsc::net::packets::owned_message<CustomMsgTypes> in;
+		while (messagesToUs().try_pop(in)) {
+			auto& msg = in.msg;
+			bytesIn += sizeof(msg.header) + msg.body.size();
+			messagesIn++;
+
+			switch (msg.header.id)
+			{
+			case CustomMsgTypes::Client_Accepted:
+			{
+				connectMs = millisBetween(connectStarted, now);
+				hsc::net::packets::message<CustomMsgTypes> reg;
+				reg.header.id = CustomMsgTypes::Client_Register;
+				hsc::net::packets::message_writer(reg).write(me);
+				send(reg);
+				break;
+			}
+
+			case CustomMsgTypes::Server_GetPing:
+			{
+				// Answer the server's pings so it measures us like a real client
+				hsc::net::ping_payload ping;
+				if (!hsc::net::packets::message_reader(msg).read(ping) || ping.isReply) break;
+				hsc::net::packets::message<CustomMsgTypes> pong;
+				pong.header.id = CustomMsgTypes::Server_GetPing;
+				hsc::net::packets::message_writer(pong).write(hsc::net::clock_sync::makeReply(ping, in.receivedAt));
+				sendUnreliable(pong);
+				break;
+			}
+
+			case CustomMsgTypes::Client_SetID:
+			{
+				if (!hsc::net::packets::message_reader(msg).read(playerID)) break;
+				me.setID(playerID);
+				break;
+			}
+
+			case CustomMsgTypes::Game_AddPlayer:
+			{
+				// Everyone entering our view comes in one message
+				hsc::net::packets::message_reader reader(msg);
+				player added;
+				while (reader.read(added)) {
+					if (added.ID == playerID) registered = true;
+				}
+				break;
+			}
+
+			case CustomMsgTypes::Game_Snapshot:
+			{
+				hsc::snapshots::world_state state;
+				if (!hsc::snapshots::decode(msg.body.data(), msg.body.size(), history, state)) break;
+				if (hasSnapshot && int32_t(state.tick - lastSnapshotTick) <= 0) break;
+				history.push(state);
+				lastSnapshotTick = state.tick;
+				hasSnapshot = true;
+
+				hsc::net::packets::message<CustomMsgTypes> ack;
+				ack.header.id = CustomMsgTypes::Game_SnapshotAck;
+				hsc::net::packets::message_writer(ack).write(state.tick);
+				send(ack);
+
+				// An update has made the round trip once a snapshot shows us where it put us
+				auto self = std::lower_bound(state.players.begin(), state.players.end(), playerID,
+					[](const hsc::snapshots::quantized_player& p, uint32_t key) { return p.ID < key; });
+				if (self == state.players.end() || self->ID != playerID) break;
+				for (size_t i = 0; i < pending.size(); i++) {
+					const auto& sent = pending[i].pos;
+					if (sent.pos[0] == self->pos[0] && sent.pos[1] == self->pos[1] && sent.pos[2] == self->pos[2]) {
+						rtt.push_back(millisBetween(pending[i].sentAt, now));
+						pending.erase(pending.begin(), pending.begin() + i + 1);
+						break;
+					}
+				}
+				break;
+			}
+
+			default:
+				break;
+			}
+		}
+	}
+
+	// Move along the script and send where we are
+	void step(bot_clock::time_point now, float dt, float speed) {
+		if (!registered) return;
+		phase += dt * speed * 0.1f;
+		switch (pattern)
+		{
+		case movement::circle:
+			me.pos = { home.x + std::cos(phase) * 10.0f, home.y, home.z + std::sin(phase) * 10.0f };
+			break;
+		case movement::line:
+			me.pos = { home.x + std::sin(phase) * 20.0f, home.y, home.z };
+			break;
+		case movement::wander:
+		{
+			std::uniform_real_distribution<float> turn(-0.5f, 0.5f);
+			heading += turn(random);
+			me.pos.x += std::cos(heading) * speed * dt;
+			me.pos.z += std::sin(heading) * speed * dt;
+			break;
+		}
+		}
+
+		hsc::net::packets::message<CustomMsgTypes> update;
+		update.header.id = CustomMsgTypes::Game_UpdatePlayer;
+		hsc::net::packets::message_writer(update).write(me);
+		sendUnreliable(update);
+
+		if (pending.size() >= max_pending) pending.pop_front();
+		pending.push_back({ hsc::snapshots::quantize(me, snapshotOptions.precision), now });
+	}
+
+private:
+	struct pending_update {
+		hsc::snapshots::quantized_player pos; // As the server will echo it
+		bot_clock::time_point sentAt;
+	};
+	static constexpr size_t max_pending = 64;
+
+	player me;
+	Vector3 home;
+	movement pattern;
+	std::mt19937 random;
+	float phase = 0.0f;
+	float heading = 0.0f;
+	std::deque<pending_update> pending;
+
+	hsc::snapshots::codec_options snapshotOptions;
+	hsc::snapshots::snapshot_history history{ snapshotOptions.maxBaselineAge };
+	uint32_t lastSnapshotTick = 0;
+	bool hasSnapshot = false;
+};
+
+int main(int argc, char* argv[])
+{
+	argparse::ArgumentParser program("History Survival bot swarm");
+	program.add_argument("address")
+		.help("Address of the server");
+	program.add_argument("port")
+		.help("Port of the server")
+		.default_value(int(36676))
+		.scan<'i', int>();
+	program.add_argument("--bots")
+		.help("Simulated players to run")
+		.default_value(int(100))
+		.scan<'i', int>();
+	program.add_argument("--threads")
+		.help("Threads running the shared network io")
+		.default_value(int(std::max(1u, std::thread::hardware_concurrency())))
+		.scan<'i', int>();
+	program.add_argument("--ramp")
+		.help("New connections per second")
+		.default_value(int(200))
+		.scan<'i', int>();
+	program.add_argument("--rate")
+		.help("Updates each bot sends per second")
+		.default_value(double(10.0))
+		.scan<'g', double>();
+	program.add_argument("--duration")
+		.help("Seconds to run for once every bot is connecting")
+		.default_value(int(30))
+		.scan<'i', int>();
+	program.add_argument("--pattern")
+		.help("Movement script: circle, line or wander")
+		.default_value(std::string("circle"));
+	program.add_argument("--area")
+		.help("Bots start spread over a square this wide")
+		.default_value(double(500.0))
+		.scan<'g', double>();
+	try {
+		program.parse_args(argc, argv);
+	}
+	catch (const std::runtime_error& err) {
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	const std::string address = program.get<std::string>("address");
+	const uint16_t port = uint16_t(program.get<int>("port"));
+	const int botCount = std::max(1, program.get<int>("--bots"));
+	const int ramp = std::max(1, program.get<int>("--ramp"));
+	const double rate = std::max(0.1, program.get<double>("--rate"));
+	const float area = float(program.get<double>("--area"));
+	const std::string patternName = program.get<std::string>("--pattern");
+	movement pattern = movement::circle;
+	if (patternName == "line") pattern = movement::line;
+	else if (patternName == "wander") pattern = movement::wander;
+
+	// Every bot shares this context
+	asio::io_context context;
+	auto idleWork = asio::make_work_guard(context);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < std::max(1, program.get<int>("--threads")); i++) {
+		threads.emplace_back([&context]() { context.run(); });
+	}
+
+	std::vector<std::unique_ptr<Bot>> bots;
+	bots.reserve(botCount);
+	std::mt19937 random(1234);
+	std::uniform_real_distribution<float> spread(-area * 0.5f, area * 0.5f);
+
+	std::vector<double> rttWindow, rttAll;
+	uint64_t bytesWindow = 0, bytesTotal = 0;
+	const auto started = bot_clock::now();
+	const auto updatePeriod = std::chrono::duration_cast<bot_clock::duration>(std::chrono::duration<double>(1.0 / rate));
+	auto nextUpdate = started;
+	auto nextReport = started + std::chrono::seconds(1);
+	auto lastStep = started;
+	bot_clock::time_point stopAt = bot_clock::time_point::max();
+
+	std::cout << "Starting " << botCount << " bots against " << address << ":" << port << std::endl;
+	while (bot_clock::now() < stopAt) {
+		const auto now = bot_clock::now();
+
+		// Connect in a ramp rather than all at once
+		size_t wanted = std::min<size_t>(botCount, size_t(millisBetween(started, now) * ramp / 1000.0) + 1);
+		while (bots.size() < wanted) {
+			Vector3 home = { spread(random), 0.0f, spread(random) };
+			bots.push_back(std::make_unique<Bot>(context, home, pattern, uint32_t(bots.size())));
+			bots.back()->connectStarted = bot_clock::now();
+			bots.back()->connect(address, port);
+			if (bots.size() == size_t(botCount)) {
+				stopAt = now + std::chrono::seconds(program.get<int>("--duration"));
+			}
+		}
+
+		for (auto& bot : bots) {
+			uint64_t before = bot->bytesIn;
+			bot->poll(bot_clock::now(), rttWindow);
+			bytesWindow += bot->bytesIn - before;
+		}
+
+		if (now >= nextUpdate) {
+			float dt = float(millisBetween(lastStep, now) / 1000.0);
+			for (auto& bot : bots) {
+				bot->step(now, dt, 5.0f);
+			}
+			lastStep = now;
+			nextUpdate += updatePeriod;
+			if (nextUpdate < now) nextUpdate = now + updatePeriod;
+		}
+
+		if (now >= nextReport) {
+			size_t connected = 0, registered = 0;
+			for (auto& bot : bots) {
+				if (bot->isConnected()) connected++;
+				if (bot->registered) registered++;
+			}
+			double seconds = 1.0 + millisBetween(nextReport, now) / 1000.0;
+			rttAll.insert(rttAll.end(), rttWindow.begin(), rttWindow.end());
+			std::cout << connected << "/" << bots.size() << " connected, " << registered << " registered, "
+				<< uint64_t(bytesWindow / seconds) << " B/s in, update rtt p50 " << percentile(rttWindow, 0.5)
+				<< "ms p95 " << percentile(rttWindow, 0.95) << "ms p99 " << percentile(rttWindow, 0.99)
+				<< "ms (" << rttWindow.size() << " samples)" << std::endl;
+			bytesTotal += bytesWindow;
+			bytesWindow = 0;
+			rttWindow.clear();
+			nextReport += std::chrono::seconds(1);
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	// Summary of the whole run
+	rttAll.insert(rttAll.end(), rttWindow.begin(), rttWindow.end());
+	bytesTotal += bytesWindow;
+	std::vector<double> connectTimes;
+	for (auto& bot : bots) {
+		if (bot->connectMs >= 0.0) connectTimes.push_back(bot->connectMs);
+	}
+	double runSeconds = millisBetween(started, bot_clock::now()) / 1000.0;
+	std::cout << "Connected " << connectTimes.size() << "/" << bots.size() << " bots, connect p50 "
+		<< percentile(connectTimes, 0.5) << "ms p95 " << percentile(connectTimes, 0.95) << "ms max "
+		<< percentile(connectTimes, 1.0) << "ms" << std::endl;
+	std::cout << "Update rtt p50 " << percentile(rttAll, 0.5) << "ms p95 " << percentile(rttAll, 0.95)
+		<< "ms p99 " << percentile(rttAll, 0.99) << "ms over " << rttAll.size() << " samples" << std::endl;
+	std::cout << "Received " << bytesTotal << " bytes, " << uint64_t(bytesTotal / runSeconds) << " B/s" << std::endl;
+
+	// The context has to stop before the bots go, its handlers still point at them
+	for (auto& bot : bots) {
+		if (bot->isConnected()) bot->disconnect();
+	}
+	idleWork.reset();
+	context.stop();
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	bots.clear();
+	return 0;
+}
@@ -0,0 +1,463 @@
+// Offline asset cooker: turns a text OBJ into the binary mesh format from
+// mesh_format.hpp so the client can map it at startup instead of parsing,
+// with simplified levels of detail for drawing it far away. PNG textures are
+// cooked into the format from texture_format.hpp, mip chain included.
+#include "mesh_simplify.hpp"
+#include "texture_cook.hpp"
+#include <mesh_format.hpp>
+#include <obj_loader.hpp>
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+#include <argparse/argparse.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace hsc::assets;
+using cook_clock = std::chrono::steady_clock;
+
+static double millisSince(cook_clock::time_point from) {
+	return std::chrono::duration<double, std::milli>(cook_clock::now() - from).count();
+}
+
+// Average cache misses per triangle for a FIFO post-transform cache, the
+// usual way to compare index orders (3 is no reuse at all, ~0.5 is the best a
+// regular grid can do)
+static double acmr(const std::vector<uint32_t>& indices, size_t vertexCount, size_t cacheSize = 16) {
+	if (indices.empty()) return 0.0;
+	std::vector<size_t> insertedAt(vertexCount, 0);
+	size_t misses = 0;
+	for (uint32_t index : indices) {
+		if (insertedAt[index] == 0 || misses + 1 - insertedAt[index] > cacheSize) {
+			misses++;
+			insertedAt[index] = misses;
+		}
+	}
+	return double(misses) / double(indices.size() / 3);
+}
+
+// Tom Forsyth's linear speed vertex cache optimisation: greedily emit the
+// triangle whose vertices score best, where the score favours vertices
+// recently used (still in a modelled LRU cache) and vertices with few
+// triangles left so they can be retired early
+static std::vector<uint32_t> optimizeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount) {
+	constexpr int cache_size = 32;
+	constexpr float cache_decay = 1.5f;
+	constexpr float last_tri_score = 0.75f;
+	constexpr float valence_scale = 2.0f;
+	constexpr float valence_power = 0.5f;
+
+	const size_t triangleCount = indices.size() / 3;
+	std::vector<uint32_t> remaining(vertexCount, 0);
+	for (uint32_t index : indices) remaining[index]++;
+
+	// Triangles using each vertex, as offsets into one array
+	std::vector<uint32_t> firstTriangle(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; v++) firstTriangle[v + 1] = firstTriangle[v] + remaining[v];
+	std::vector<uint32_t> vertexTriangles(indices.size());
+	std::vector<uint32_t> filled(firstTriangle.begin(), firstTriangle.end() - 1);
+	for (size_t t = 0; t < triangleCount; t++) {
+		for (int k = 0; k < 3; k++) vertexTriangles[filled[indices[t * 3 + k]]++] = uint32_t(t);
+	}
+
+	std::vector<int> cachePosition(vertexCount, -1);
+	auto vertexScore = [&](uint32_t v) -> float {
+		if (remaining[v] == 0) return -1.0f;
+		float score = 0.0f;
+		int position = cachePosition[v];
+		if (position >= 0) {
+			if (position < 3) score = last_tri_score;
+			else score = std::pow(1.0f - float(position - 3) / float(cache_size - 3), cache_decay);
+		}
+		return score + valence_scale * std::pow(float(remaining[v]), -valence_power);
+	};
+
+	std::vector<float> vertexScores(vertexCount);
+	for (uint32_t v = 0; v < vertexCount; v++) vertexScores[v] = vertexScore(v);
+	std::vector<float> triangleScores(triangleCount);
+	std::vector<bool> emitted(triangleCount, false);
+	for (size_t t = 0; t < triangleCount; t++) {
+		triangleScores[t] = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] + vertexScores[indices[t * 3 + 2]];
+	}
+
+	std::vector<uint32_t> out;
+	out.reserve(indices.size());
+	std::vector<uint32_t> cache, nextCache;
+	size_t scanFrom = 0; // Everything before has been emitted
+	long best = -1;
+	for (size_t emittedCount = 0; emittedCount < triangleCount; emittedCount++) {
+		if (best < 0) {
+			// Nothing in the cache is usable, take the best of the rest
+			float bestScore = -1.0f;
+			while (scanFrom < triangleCount && emitted[scanFrom]) scanFrom++;
+			for (size_t t = scanFrom; t < triangleCount; t++) {
+				if (!emitted[t] && triangleScores[t] > bestScore) {
+					bestScore = triangleScores[t];
+					best = long(t);
+				}
+			}
+		}
+
+		const uint32_t* tri = &indices[size_t(best) * 3];
+		out.insert(out.end(), tri, tri + 3);
+		emitted[size_t(best)] = true;
+
+		// Move the triangle's vertices to the front of the cache
+		nextCache.assign(tri, tri + 3);
+		for (uint32_t v : cache) {
+			if (v != tri[0] && v != tri[1] && v != tri[2]) nextCache.push_back(v);
+		}
+		for (int k = 0; k < 3; k++) {
+			uint32_t v = tri[k];
+			remaining[v]--;
+			// Take the triangle out of the vertex's list by swapping it past the live ones
+			uint32_t* list = &vertexTriangles[firstTriangle[v]];
+			for (uint32_t i = 0; i <= remaining[v]; i++) {
+				if (list[i] == uint32_t(best)) {
+					std::swap(list[i], list[remaining[v]]);
+					break;
+				}
+			}
+		}
+		for (size_t i = 0; i < nextCache.size(); i++) cachePosition[nextCache[i]] = i < size_t(cache_size) ? int(i) : -1;
+		if (nextCache.size() > size_t(cache_size)) nextCache.resize(cache_size);
+		cache.swap(nextCache);
+
+		// Only vertices that were or are in the cache changed score
+		for (uint32_t v : nextCache) vertexScores[v] = vertexScore(v);
+		for (uint32_t v : cache) vertexScores[v] = vertexScore(v);
+		best = -1;
+		float bestScore = -1.0f;
+		for (const auto* list : { &cache, &nextCache }) {
+			for (uint32_t v : *list) {
+				for (uint32_t i = 0; i < remaining[v]; i++) {
+					uint32_t t = vertexTriangles[firstTriangle[v] + i];
+					triangleScores[t] = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] + vertexScores[indices[t * 3 + 2]];
+					if (triangleScores[t] > bestScore) {
+						bestScore = triangleScores[t];
+						best = long(t);
+					}
+				}
+			}
+		}
+	}
+	return out;
+}
+
+// Renumbers vertices in the order the indices first use them, so vertex
+// fetches walk the buffer forwards
+static void optimizeVertexFetch(obj_mesh& mesh) {
+	std::vector<uint32_t> remap(mesh.vertices.size(), UINT32_MAX);
+	std::vector<mesh_vertex> ordered;
+	ordered.reserve(mesh.vertices.size());
+	for (uint32_t& index : mesh.indices) {
+		if (remap[index] == UINT32_MAX) {
+			remap[index] = uint32_t(ordered.size());
+			ordered.push_back(mesh.vertices[index]);
+		}
+		index = remap[index];
+	}
+	mesh.vertices.swap(ordered); // Drops vertices no triangle used
+}
+
+static void optimize(obj_mesh& mesh) {
+	mesh.indices = optimizeVertexCache(mesh.indices, mesh.vertices.size());
+	optimizeVertexFetch(mesh);
+}
+
+// Every mesh of a model at one level of detail
+struct cooked_level {
+	std::vector<obj_mesh> meshes;
+	std::vector<float> errors; // Per mesh, in model units
+};
+
+static size_t triangleCount(const cooked_level& level) {
+	size_t triangles = 0;
+	for (const obj_mesh& mesh : level.meshes) triangles += mesh.indices.size() / 3;
+	return triangles;
+}
+
+// Halves the triangles from one level to the next, as far as the error
+// allowed for the level lets it. Levels that barely shrink the model are
+// dropped, simple shapes run out of cheap collapses long before dense ones.
+static std::vector<cooked_level> buildLevels(const std::vector<obj_mesh>& meshes, int levelCount) {
+	constexpr float triangle_ratio = 0.5f;
+	constexpr float min_reduction = 0.85f;
+	constexpr float first_error = 0.02f; // Of the model's diagonal, doubling every level
+
+	mesh_bounds bounds = boundsOf(meshes[0].vertices);
+	for (const obj_mesh& mesh : meshes) {
+		mesh_bounds own = boundsOf(mesh.vertices);
+		for (int i = 0; i < 3; i++) {
+			bounds.min[i] = std::min(bounds.min[i], own.min[i]);
+			bounds.max[i] = std::max(bounds.max[i], own.max[i]);
+		}
+	}
+	float diagonal = std::sqrt(std::pow(bounds.max[0] - bounds.min[0], 2.0f) + std::pow(bounds.max[1] - bounds.min[1], 2.0f) + std::pow(bounds.max[2] - bounds.min[2], 2.0f));
+
+	std::vector<cooked_level> levels(1);
+	levels[0].meshes = meshes;
+	levels[0].errors.assign(meshes.size(), 0.0f);
+	levels.resize(size_t(std::max(levelCount, 1)));
+	for (const obj_mesh& mesh : meshes) {
+		mesh_simplifier simplifier(mesh);
+		size_t target = mesh.indices.size() / 3;
+		for (size_t l = 1; l < levels.size(); l++) {
+			target = size_t(float(target) * triangle_ratio);
+			simplifier.simplify(target, diagonal * first_error * float(1 << (l - 1)));
+			obj_mesh simplified = simplifier.snapshot();
+			optimize(simplified);
+			levels[l].meshes.push_back(std::move(simplified));
+			levels[l].errors.push_back(simplifier.getError());
+		}
+	}
+	for (size_t l = 1; l < levels.size(); l++) {
+		bool empty = std::any_of(levels[l].meshes.begin(), levels[l].meshes.end(), [](const obj_mesh& mesh) { return mesh.indices.empty(); });
+		if (empty || float(triangleCount(levels[l])) > min_reduction * float(triangleCount(levels[l - 1]))) {
+			levels.resize(l);
+			break;
+		}
+	}
+	return levels;
+}
+
+// Written beside the target and renamed over it, a running client never maps half a file
+static bool writeFile(const std::string& path, const std::vector<uint8_t>& bytes, std::string& error) {
+	std::string temporary = path + ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+		if (!out) {
+			error = "can't write " + temporary;
+			return false;
+		}
+	}
+	std::remove(path.c_str());
+	if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+		error = "can't rename " + temporary + " to " + path;
+		return false;
+	}
+	return true;
+}
+
+static bool writeCooked(const std::string& path, const std::vector<cooked_level>& levels, std::string& error) {
+	const size_t meshCount = levels[0].meshes.size();
+	mesh_file_header header = {};
+	header.magic = mesh_magic;
+	header.version = mesh_version;
+	header.meshCount = uint32_t(meshCount);
+	header.vertexStride = sizeof(mesh_vertex);
+	header.lodCount = uint32_t(levels.size());
+
+	std::vector<mesh_record> records(meshCount * levels.size());
+	uint64_t offset = sizeof(mesh_file_header) + records.size() * sizeof(mesh_record);
+	for (size_t l = 0; l < levels.size(); l++) {
+		for (size_t m = 0; m < meshCount; m++) {
+			const obj_mesh& mesh = levels[l].meshes[m];
+			mesh_record& record = records[l * meshCount + m];
+			record.vertexCount = uint32_t(mesh.vertices.size());
+			record.indexCount = uint32_t(mesh.indices.size());
+			record.bounds = boundsOf(mesh.vertices);
+			record.lod = uint32_t(l);
+			record.error = levels[l].errors[m];
+			record.vertexOffset = alignUp(offset);
+			record.indexOffset = alignUp(record.vertexOffset + record.vertexCount * sizeof(mesh_vertex));
+			offset = record.indexOffset + record.indexCount * sizeof(uint16_t);
+
+			if (l > 0) continue;
+			for (int i = 0; i < 3; i++) {
+				header.bounds.min[i] = m == 0 ? record.bounds.min[i] : std::min(header.bounds.min[i], record.bounds.min[i]);
+				header.bounds.max[i] = m == 0 ? record.bounds.max[i] : std::max(header.bounds.max[i], record.bounds.max[i]);
+			}
+		}
+	}
+	header.fileSize = offset;
+
+	std::vector<uint8_t> bytes(size_t(header.fileSize), 0);
+	std::memcpy(bytes.data(), &header, sizeof(header));
+	std::memcpy(bytes.data() + sizeof(header), records.data(), records.size() * sizeof(mesh_record));
+	for (size_t r = 0; r < records.size(); r++) {
+		const obj_mesh& mesh = levels[r / meshCount].meshes[r % meshCount];
+		std::memcpy(bytes.data() + records[r].vertexOffset, mesh.vertices.data(), mesh.vertices.size() * sizeof(mesh_vertex));
+		uint16_t* indices = reinterpret_cast<uint16_t*>(bytes.data() + records[r].indexOffset);
+		for (size_t i = 0; i < mesh.indices.size(); i++) indices[i] = uint16_t(mesh.indices[i]);
+	}
+	return writeFile(path, bytes, error);
+}
+
+static const char* encodingName(texture_encoding encoding) {
+	switch (encoding) {
+	case texture_encoding::bc1: return "BC1";
+	case texture_encoding::bc3: return "BC3";
+	default: return "RGBA8";
+	}
+}
+
+static int cookTexture(const std::string& input, const std::string& output, const std::string& format) {
+	auto started = cook_clock::now();
+	int width = 0, height = 0, channels = 0;
+	stbi_uc* loaded = stbi_load(input.c_str(), &width, &height, &channels, 4);
+	if (loaded == nullptr) {
+		std::cerr << "can't load " << input << ": " << stbi_failure_reason() << std::endl;
+		return 1;
+	}
+	rgba_image image;
+	image.width = uint32_t(width);
+	image.height = uint32_t(height);
+	image.pixels.assign(loaded, loaded + size_t(width) * size_t(height) * 4);
+	stbi_image_free(loaded);
+	double decodeMs = millisSince(started);
+
+	bool translucent = false;
+	for (size_t i = 3; i < image.pixels.size(); i += 4) translucent = translucent || image.pixels[i] != 255;
+	texture_encoding encoding = translucent ? texture_encoding::bc3 : texture_encoding::bc1;
+	if (format == "bc1") encoding = texture_encoding::bc1;
+	else if (format == "bc3") encoding = texture_encoding::bc3;
+	else if (format == "rgba") encoding = texture_encoding::rgba8;
+	else if (format != "auto") {
+		std::cerr << "unknown texture format " << format << std::endl;
+		return 1;
+	}
+	if (encoding != texture_encoding::rgba8 && (image.width % 4 != 0 || image.height % 4 != 0)) {
+		std::fprintf(stderr, "%s is %dx%d, not whole 4x4 blocks, writing it uncompressed\n", input.c_str(), width, height);
+		encoding = texture_encoding::rgba8;
+	}
+
+	started = cook_clock::now();
+	cooked_texture cooked = cookImage(image, encoding);
+	double encodeMs = millisSince(started);
+
+	std::string error;
+	if (!writeFile(output, serializeTexture(cooked), error)) {
+		std::cerr << error << std::endl;
+		return 1;
+	}
+
+	size_t cookedBytes = 0;
+	for (const std::vector<uint8_t>& level : cooked.levels) cookedBytes += level.size();
+	rgba_image decoded = decodeLevel(cooked.levels[0].data(), image.width, image.height, encoding);
+	std::printf("%s -> %s: %dx%d %s, %zu levels, %zu KB of GPU memory against %zu KB uncompressed with mips, "
+		"PSNR %.2f dB, decoded in %.1f ms, encoded in %.1f ms\n",
+		input.c_str(), output.c_str(), width, height, encodingName(encoding), cooked.levels.size(), cookedBytes / 1024,
+		size_t(width) * size_t(height) * 4 * 4 / 3 / 1024, psnr(image, decoded, encoding == texture_encoding::bc3), decodeMs, encodeMs);
+	return 0;
+}
+
+static bool endsWith(const std::string& text, const std::string& suffix) {
+	return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Time to get from each file to vertex data in memory, the part of startup
+// this format is meant to remove
+static void benchmark(const std::string& objPath, const std::string& cookedPath, int runs) {
+	double parseMs = 0.0, mapMs = 0.0;
+	volatile uint32_t sink = 0;
+	for (int run = 0; run < runs; run++) {
+		auto started = cook_clock::now();
+		obj_scene scene;
+		std::string error;
+		parseObj(objPath, scene, error);
+		parseMs += millisSince(started);
+
+		started = cook_clock::now();
+		cooked_mesh_file cooked;
+		if (!cooked.open(cookedPath, &error)) {
+			std::cerr << error << std::endl;
+			return;
+		}
+		// Touch every page, mapping alone reads nothing
+		uint32_t sum = 0;
+		for (uint32_t m = 0; m < cooked.meshCount(); m++) {
+			const mesh_record& record = cooked.getRecord(m);
+			const uint16_t* indices = cooked.getIndices(m);
+			for (uint32_t i = 0; i < record.indexCount; i += 1024) sum += indices[i];
+			const mesh_vertex* vertices = cooked.getVertices(m);
+			for (uint32_t v = 0; v < record.vertexCount; v += 128) sum += uint32_t(vertices[v].position[0]);
+		}
+		sink = sink + sum;
+		mapMs += millisSince(started);
+	}
+	std::printf("  load: obj parse %.3f ms, cooked map %.3f ms (%.1fx), mean of %d runs\n",
+		parseMs / runs, mapMs / runs, mapMs > 0.0 ? parseMs / mapMs : 0.0, runs);
+}
+
+int main(int argc, char* argv[])
+{
+	argparse::ArgumentParser program("asset-cooker");
+	program.add_argument("input")
+		.help("OBJ model or PNG texture to cook");
+	program.add_argument("output")
+		.help("Cooked mesh or texture file to write");
+	program.add_argument("--bench")
+		.help("After cooking, time loading the OBJ against mapping the cooked file over this many runs")
+		.default_value(int(0))
+		.scan<'i', int>();
+	program.add_argument("--lods")
+		.help("Levels of detail to write, counting the full model, 1 writes only the full model")
+		.default_value(int(4))
+		.scan<'i', int>();
+	program.add_argument("--format")
+		.help("Texture encoding: auto (BC3 with alpha, BC1 without), bc1, bc3 or rgba")
+		.default_value(std::string("auto"));
+
+	try {
+		program.parse_args(argc, argv);
+	}
+	catch (const std::runtime_error& err) {
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	const std::string input = program.get<std::string>("input");
+	const std::string output = program.get<std::string>("output");
+	if (endsWith(input, ".png")) return cookTexture(input, output, program.get<std::string>("--format"));
+
+	auto started = cook_clock::now();
+	obj_scene scene;
+	std::string error;
+	if (!parseObj(input, scene, error)) {
+		std::cerr << error << std::endl;
+		return 1;
+	}
+	double parseMs = millisSince(started);
+
+	size_t vertices = 0, triangles = 0;
+	double missesBefore = 0.0, missesAfter = 0.0;
+	for (obj_mesh& mesh : scene.meshes) {
+		size_t meshTriangles = mesh.indices.size() / 3;
+		missesBefore += acmr(mesh.indices, mesh.vertices.size()) * meshTriangles;
+		optimize(mesh);
+		missesAfter += acmr(mesh.indices, mesh.vertices.size()) * meshTriangles;
+		vertices += mesh.vertices.size();
+		triangles += meshTriangles;
+	}
+
+	started = cook_clock::now();
+	int lodCount = std::min(program.get<int>("--lods"), int(max_lod_count));
+	std::vector<cooked_level> levels = buildLevels(scene.meshes, lodCount);
+	double simplifyMs = millisSince(started);
+
+	if (!writeCooked(output, levels, error)) {
+		std::cerr << error << std::endl;
+		return 1;
+	}
+
+	std::printf("%s -> %s: %zu meshes, %zu faces, %zu vertices, %zu triangles, ACMR %.3f -> %.3f, parsed in %.1f ms\n",
+		input.c_str(), output.c_str(), scene.meshes.size(), scene.faces, vertices, triangles,
+		missesBefore / double(triangles), missesAfter / double(triangles), parseMs);
+	for (size_t l = 1; l < levels.size(); l++) {
+		std::printf("  LOD%zu: %zu triangles, error %.4f\n", l, triangleCount(levels[l]),
+			*std::max_element(levels[l].errors.begin(), levels[l].errors.end()));
+	}
+	std::printf("  %zu levels of detail simplified in %.1f ms\n", levels.size(), simplifyMs);
+
+	int runs = program.get<int>("--bench");
+	if (runs > 0) benchmark(input, output, runs);
+	return 0;
+}
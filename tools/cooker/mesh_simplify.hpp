@@ -0,0 +1,420 @@
+// Quadric error metric simplification (Garland and Heckbert) for the
+// cooker's LOD levels. Edges collapse onto one of their ends, so every
+// vertex of a simplified mesh is one of the original's.
+#pragma once
+
+#include <mesh_format.hpp>
+#include <obj_loader.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+namespace hsc {
+	namespace assets {
+		// Sum of squared distances to a set of planes, as the upper triangle of
+		// the symmetric 4x4 matrix
+		struct quadric {
+			double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
+
+			void addPlane(double a, double b, double c, double d, double weight) {
+				a2 += weight * a * a; ab += weight * a * b; ac += weight * a * c; ad += weight * a * d;
+				b2 += weight * b * b; bc += weight * b * c; bd += weight * b * d;
+				c2 += weight * c * c; cd += weight * c * d;
+				d2 += weight * d * d;
+			}
+
+			void add(const quadric& q) {
+				a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad; b2 += q.b2;
+				bc += q.bc; bd += q.bd; c2 += q.c2; cd += q.cd; d2 += q.d2;
+			}
+
+			double error(const float* p) const {
+				double x = p[0], y = p[1], z = p[2];
+				double e = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+					+ b2 * y * y + 2 * bc * y * z + 2 * bd * y
+					+ c2 * z * z + 2 * cd * z + d2;
+				return std::max(e, 0.0);
+			}
+		};
+
+		// Simplifies one mesh step by step, snapshot() after each simplify()
+		// gives that level. The positions are welded first so faces split for
+		// flat normals or UV seams still collapse as one surface. Each
+		// distinct texcoord and normal at a position is a wedge, and a
+		// collapse moves every corner onto a wedge of the kept end rather
+		// than dragging its own texcoord along, so vertices stay shared.
+		// Collapsing across a UV seam shifts the texture, that costs as much
+		// as moving the surface by the same distance.
+		class mesh_simplifier {
+		public:
+			explicit mesh_simplifier(const obj_mesh& mesh) : source(mesh) {
+				std::unordered_map<std::string, uint32_t> welded;
+				std::unordered_map<std::string, uint32_t> wedges;
+				positionOf.resize(mesh.vertices.size());
+				wedgeOf.resize(mesh.vertices.size());
+				for (size_t v = 0; v < mesh.vertices.size(); v++) {
+					std::string key(reinterpret_cast<const char*>(mesh.vertices[v].position), sizeof(float) * 3);
+					auto found = welded.emplace(key, uint32_t(positions.size()));
+					if (found.second) positions.push_back(v);
+					positionOf[v] = found.first->second;
+					std::string wedgeKey(reinterpret_cast<const char*>(&mesh.vertices[v]), sizeof(mesh_vertex));
+					wedgeOf[v] = wedges.emplace(wedgeKey, uint32_t(v)).first->second;
+				}
+				remap.resize(positions.size());
+				for (uint32_t p = 0; p < remap.size(); p++) remap[p] = p;
+				corners.reserve(mesh.indices.size());
+				for (uint32_t index : mesh.indices) corners.push_back(wedgeOf[index]);
+				computeQuadrics();
+				computeTexcoordScale();
+			}
+
+			size_t triangleCount() const {
+				return corners.size() / 3;
+			}
+
+			// Largest quadric error of any collapse so far, as a distance in
+			// model units
+			float getError() const {
+				return float(std::sqrt(maxError));
+			}
+
+			// Collapses the cheapest edges until at most targetTriangles are
+			// left, or nothing can collapse without flipping a face or moving
+			// the surface further than maxError. False when no triangle went.
+			bool simplify(size_t targetTriangles, float maxError) {
+				errorLimit = double(maxError) * double(maxError);
+				size_t before = triangleCount();
+				while (triangleCount() > targetTriangles) {
+					if (!collapsePass(targetTriangles)) break;
+				}
+				return triangleCount() < before;
+			}
+
+			// The current level as a mesh with its own, compacted vertices.
+			// Corners always point at a wedge of a live position, so they are
+			// source vertices as they are.
+			obj_mesh snapshot() const {
+				obj_mesh out;
+				std::unordered_map<uint32_t, uint32_t> used;
+				for (uint32_t corner : corners) {
+					auto found = used.emplace(corner, uint32_t(out.vertices.size()));
+					if (found.second) out.vertices.push_back(source.vertices[corner]);
+					out.indices.push_back(found.first->second);
+				}
+				return out;
+			}
+
+		private:
+			enum class vertex_kind : uint8_t { manifold, border, locked };
+
+			struct collapse {
+				uint32_t from;
+				uint32_t to;
+				double cost;
+			};
+
+			// A wedge of the collapsing end and the kept end's wedge it becomes
+			struct wedge_move {
+				uint32_t from;
+				uint32_t to;
+			};
+
+			static constexpr double border_weight = 10.0;
+
+			const float* positionAt(uint32_t position) const {
+				return source.vertices[positions[position]].position;
+			}
+
+			uint32_t find(uint32_t position) const {
+				while (remap[position] != position) position = remap[position];
+				return position;
+			}
+
+			uint32_t cornerPosition(size_t corner) const {
+				return find(positionOf[corners[corner]]);
+			}
+
+			static void normalOf(const float* a, const float* b, const float* c, double n[3]) {
+				double e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+				double e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+				n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+				n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+				n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+			}
+
+			static uint64_t edgeKey(uint32_t a, uint32_t b) {
+				return a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a;
+			}
+
+			// One plane per face, and along open edges a plane standing on the
+			// edge so borders keep their outline
+			void computeQuadrics() {
+				quadrics.assign(positions.size(), quadric());
+				std::unordered_map<uint64_t, int> edgeUses;
+				for (size_t t = 0; t < triangleCount(); t++) {
+					for (int k = 0; k < 3; k++) edgeUses[edgeKey(cornerPosition(t * 3 + k), cornerPosition(t * 3 + (k + 1) % 3))]++;
+				}
+				for (size_t t = 0; t < triangleCount(); t++) {
+					uint32_t p[3] = { cornerPosition(t * 3), cornerPosition(t * 3 + 1), cornerPosition(t * 3 + 2) };
+					double n[3];
+					normalOf(positionAt(p[0]), positionAt(p[1]), positionAt(p[2]), n);
+					double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+					if (length == 0.0) continue;
+					for (double& c : n) c /= length;
+					const float* a = positionAt(p[0]);
+					double d = -(n[0] * a[0] + n[1] * a[1] + n[2] * a[2]);
+					for (uint32_t q : p) quadrics[q].addPlane(n[0], n[1], n[2], d, 1.0);
+
+					for (int k = 0; k < 3; k++) {
+						if (edgeUses[edgeKey(p[k], p[(k + 1) % 3])] != 1) continue;
+						const float* e0 = positionAt(p[k]);
+						const float* e1 = positionAt(p[(k + 1) % 3]);
+						double edge[3] = { double(e1[0]) - e0[0], double(e1[1]) - e0[1], double(e1[2]) - e0[2] };
+						double side[3] = { edge[1] * n[2] - edge[2] * n[1], edge[2] * n[0] - edge[0] * n[2], edge[0] * n[1] - edge[1] * n[0] };
+						double sideLength = std::sqrt(side[0] * side[0] + side[1] * side[1] + side[2] * side[2]);
+						if (sideLength == 0.0) continue;
+						for (double& c : side) c /= sideLength;
+						double sd = -(side[0] * e0[0] + side[1] * e0[1] + side[2] * e0[2]);
+						quadrics[p[k]].addPlane(side[0], side[1], side[2], sd, border_weight);
+						quadrics[p[(k + 1) % 3]].addPlane(side[0], side[1], side[2], sd, border_weight);
+					}
+				}
+			}
+
+			// Ranks every allowed collapse, then applies the cheapest ones that
+			// don't touch a vertex already moved this pass
+			bool collapsePass(size_t targetTriangles) {
+				const size_t triangles = triangleCount();
+				std::unordered_map<uint64_t, int> edgeUses;
+				for (size_t t = 0; t < triangles; t++) {
+					for (int k = 0; k < 3; k++) edgeUses[edgeKey(cornerPosition(t * 3 + k), cornerPosition(t * 3 + (k + 1) % 3))]++;
+				}
+
+				// Open edges make a border vertex, which may only slide along
+				// its border. More than two of them, or an edge shared by more
+				// than two faces, pins the vertex.
+				std::vector<vertex_kind> kinds(positions.size(), vertex_kind::manifold);
+				std::vector<uint32_t> borderEdges(positions.size(), 0);
+				for (const auto& edge : edgeUses) {
+					uint32_t a = uint32_t(edge.first >> 32), b = uint32_t(edge.first & 0xFFFFFFFF);
+					if (edge.second > 2) kinds[a] = kinds[b] = vertex_kind::locked;
+					else if (edge.second == 1) {
+						borderEdges[a]++;
+						borderEdges[b]++;
+					}
+				}
+				for (size_t p = 0; p < positions.size(); p++) {
+					if (kinds[p] == vertex_kind::manifold && borderEdges[p] > 0) kinds[p] = borderEdges[p] == 2 ? vertex_kind::border : vertex_kind::locked;
+				}
+
+				// Triangles around each position
+				std::vector<uint32_t> firstTriangle(positions.size() + 1, 0);
+				for (size_t c = 0; c < corners.size(); c++) firstTriangle[cornerPosition(c) + 1]++;
+				for (size_t p = 0; p < positions.size(); p++) firstTriangle[p + 1] += firstTriangle[p];
+				std::vector<uint32_t> around(corners.size());
+				std::vector<uint32_t> filled(firstTriangle.begin(), firstTriangle.end() - 1);
+				for (size_t c = 0; c < corners.size(); c++) around[filled[cornerPosition(c)]++] = uint32_t(c / 3);
+
+				std::vector<collapse> candidates;
+				for (const auto& edge : edgeUses) {
+					uint32_t a = uint32_t(edge.first >> 32), b = uint32_t(edge.first & 0xFFFFFFFF);
+					bool border = edge.second == 1;
+					collapse best = { 0, 0, -1.0 };
+					for (int direction = 0; direction < 2; direction++) {
+						uint32_t from = direction == 0 ? a : b, to = direction == 0 ? b : a;
+						if (kinds[from] == vertex_kind::locked) continue;
+						if (kinds[from] == vertex_kind::border && !border) continue;
+						quadric merged = quadrics[from];
+						merged.add(quadrics[to]);
+						double cost = merged.error(positionAt(to));
+						if (best.cost >= 0.0 && cost >= best.cost) continue;
+						double seamCost = matchWedges(from, to, firstTriangle, around, wedgeMoves);
+						if (seamCost < 0.0 || (best.cost >= 0.0 && cost + seamCost >= best.cost)) continue;
+						best = { from, to, cost + seamCost };
+					}
+					if (best.cost >= 0.0 && best.cost <= errorLimit) candidates.push_back(best);
+				}
+				if (candidates.empty()) return false;
+				std::sort(candidates.begin(), candidates.end(), [](const collapse& x, const collapse& y) { return x.cost < y.cost; });
+
+				// Only the cheaper part of the list per pass, later passes see
+				// the quadrics these collapses merged
+				const double costLimit = candidates[std::min(candidates.size() - 1, candidates.size() / 3)].cost;
+				size_t toRemove = triangles - targetTriangles;
+				size_t removed = 0, applied = 0;
+				std::vector<bool> moved(positions.size(), false);
+				for (const collapse& candidate : candidates) {
+					if (removed >= toRemove || candidate.cost > costLimit) break;
+					if (moved[candidate.from] || moved[candidate.to]) continue;
+					size_t gone = 0;
+					if (!collapseKeepsFaces(candidate, firstTriangle, around, gone)) continue;
+					matchWedges(candidate.from, candidate.to, firstTriangle, around, wedgeMoves);
+					for (uint32_t i = firstTriangle[candidate.from]; i < firstTriangle[candidate.from + 1]; i++) {
+						for (int k = 0; k < 3; k++) {
+							uint32_t& corner = corners[size_t(around[i]) * 3 + k];
+							if (find(positionOf[corner]) != candidate.from) continue;
+							for (const wedge_move& move : wedgeMoves) {
+								if (move.from == corner) corner = move.to;
+							}
+						}
+					}
+
+					remap[candidate.from] = candidate.to;
+					quadrics[candidate.to].add(quadrics[candidate.from]);
+					maxError = std::max(maxError, candidate.cost);
+					moved[candidate.from] = moved[candidate.to] = true;
+					// The neighbours' triangles were checked against where they are now
+					for (uint32_t i = firstTriangle[candidate.from]; i < firstTriangle[candidate.from + 1]; i++) {
+						for (int k = 0; k < 3; k++) moved[cornerPosition(size_t(around[i]) * 3 + k)] = true;
+					}
+					removed += gone;
+					applied++;
+				}
+				if (applied == 0) return false;
+
+				std::vector<uint32_t> kept;
+				kept.reserve(corners.size());
+				for (size_t t = 0; t < triangles; t++) {
+					uint32_t a = cornerPosition(t * 3), b = cornerPosition(t * 3 + 1), c = cornerPosition(t * 3 + 2);
+					if (a == b || b == c || c == a) continue;
+					kept.insert(kept.end(), corners.begin() + t * 3, corners.begin() + t * 3 + 3);
+				}
+				corners.swap(kept);
+				return true;
+			}
+
+			// Model units per texcoord unit, from every edge of the source
+			// mesh, to price how far a seam collapse shifts the texture
+			void computeTexcoordScale() {
+				double length = 0.0, texcoordLength = 0.0;
+				for (size_t t = 0; t < triangleCount(); t++) {
+					for (int k = 0; k < 3; k++) {
+						const mesh_vertex& a = source.vertices[corners[t * 3 + k]];
+						const mesh_vertex& b = source.vertices[corners[t * 3 + (k + 1) % 3]];
+						double du = double(b.texcoord[0]) - a.texcoord[0], dv = double(b.texcoord[1]) - a.texcoord[1];
+						double dx = double(b.position[0]) - a.position[0], dy = double(b.position[1]) - a.position[1], dz = double(b.position[2]) - a.position[2];
+						double uv = std::sqrt(du * du + dv * dv);
+						if (uv == 0.0) continue;
+						texcoordLength += uv;
+						length += std::sqrt(dx * dx + dy * dy + dz * dz);
+					}
+				}
+				texcoordScale = texcoordLength > 0.0 ? length / texcoordLength : 0.0;
+			}
+
+			static bool sameTexcoord(const mesh_vertex& a, const mesh_vertex& b) {
+				return a.texcoord[0] == b.texcoord[0] && a.texcoord[1] == b.texcoord[1];
+			}
+
+			// Pairs each wedge used around `from` with a wedge of `to`. The
+			// faces on the collapsing edge pair the wedges they hold. A wedge
+			// whose faces don't touch the edge, split off only by its normal,
+			// goes to the wedge of `to` with the texcoord its neighbours moved
+			// to and the nearest normal. Anything left is across a UV seam and
+			// takes the nearest texcoord `to` has, at a cost of the squared
+			// distance the texture shifts. Negative when a wedge spans a seam
+			// at `to`, the edge's faces would pull it two ways.
+			double matchWedges(uint32_t from, uint32_t to, const std::vector<uint32_t>& firstTriangle, const std::vector<uint32_t>& around, std::vector<wedge_move>& moves) const {
+				moves.clear();
+				for (uint32_t i = firstTriangle[from]; i < firstTriangle[from + 1]; i++) {
+					size_t t = around[i];
+					uint32_t fromCorner = 0, toCorner = 0;
+					bool hasFrom = false, hasTo = false;
+					for (int k = 0; k < 3; k++) {
+						uint32_t position = cornerPosition(t * 3 + k);
+						if (position == from) {
+							fromCorner = corners[t * 3 + k];
+							hasFrom = true;
+						}
+						else if (position == to) {
+							toCorner = corners[t * 3 + k];
+							hasTo = true;
+						}
+					}
+					if (!hasFrom) continue; // Already gone
+					auto existing = std::find_if(moves.begin(), moves.end(), [&](const wedge_move& move) { return move.from == fromCorner; });
+					if (existing == moves.end()) moves.push_back({ fromCorner, hasTo ? toCorner : no_wedge });
+					else if (hasTo) {
+						if (existing->to == no_wedge) existing->to = toCorner;
+						else if (existing->to != toCorner) return -1.0;
+					}
+				}
+
+				double cost = 0.0;
+				for (wedge_move& move : moves) {
+					if (move.to != no_wedge) continue;
+					const mesh_vertex& unmatched = source.vertices[move.from];
+					auto neighbour = std::find_if(moves.begin(), moves.end(), [&](const wedge_move& other) {
+						return other.to != no_wedge && sameTexcoord(source.vertices[other.from], unmatched);
+					});
+					// Without a neighbour on the same side of the seams aim for our own texcoord
+					const mesh_vertex& target = neighbour != moves.end() ? source.vertices[neighbour->to] : unmatched;
+					double bestShift = 0.0;
+					float bestDot = -2.0f;
+					for (uint32_t i = firstTriangle[to]; i < firstTriangle[to + 1]; i++) {
+						for (int k = 0; k < 3; k++) {
+							if (cornerPosition(size_t(around[i]) * 3 + k) != to) continue;
+							uint32_t corner = corners[size_t(around[i]) * 3 + k];
+							const mesh_vertex& wedge = source.vertices[corner];
+							double du = double(wedge.texcoord[0]) - target.texcoord[0], dv = double(wedge.texcoord[1]) - target.texcoord[1];
+							double shift = du * du + dv * dv;
+							float dot = wedge.normal[0] * unmatched.normal[0] + wedge.normal[1] * unmatched.normal[1] + wedge.normal[2] * unmatched.normal[2];
+							if (move.to == no_wedge || shift < bestShift || (shift == bestShift && dot > bestDot)) {
+								move.to = corner;
+								bestShift = shift;
+								bestDot = dot;
+							}
+						}
+					}
+					if (move.to == no_wedge) return -1.0;
+					if (neighbour == moves.end() || !sameTexcoord(source.vertices[move.to], target)) {
+						const mesh_vertex& moved = source.vertices[move.to];
+						double du = double(moved.texcoord[0]) - unmatched.texcoord[0], dv = double(moved.texcoord[1]) - unmatched.texcoord[1];
+						cost += (du * du + dv * dv) * texcoordScale * texcoordScale;
+					}
+				}
+				return cost;
+			}
+
+			// Rejects a collapse that would turn any surviving face around
+			bool collapseKeepsFaces(const collapse& candidate, const std::vector<uint32_t>& firstTriangle, const std::vector<uint32_t>& around, size_t& gone) const {
+				for (uint32_t i = firstTriangle[candidate.from]; i < firstTriangle[candidate.from + 1]; i++) {
+					size_t t = around[i];
+					uint32_t p[3] = { cornerPosition(t * 3), cornerPosition(t * 3 + 1), cornerPosition(t * 3 + 2) };
+					if (p[0] == p[1] || p[1] == p[2] || p[2] == p[0]) continue; // Already gone
+					if (p[0] == candidate.to || p[1] == candidate.to || p[2] == candidate.to) {
+						gone++;
+						continue;
+					}
+					double before[3], after[3];
+					normalOf(positionAt(p[0]), positionAt(p[1]), positionAt(p[2]), before);
+					for (uint32_t& q : p) {
+						if (q == candidate.from) q = candidate.to;
+					}
+					normalOf(positionAt(p[0]), positionAt(p[1]), positionAt(p[2]), after);
+					double dot = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+					double lengths = std::sqrt(before[0] * before[0] + before[1] * before[1] + before[2] * before[2]) *
+						std::sqrt(after[0] * after[0] + after[1] * after[1] + after[2] * after[2]);
+					if (dot <= 0.25 * lengths) return false;
+				}
+				return true;
+			}
+
+			static constexpr uint32_t no_wedge = 0xFFFFFFFF;
+
+			const obj_mesh& source;
+			std::vector<uint32_t> positions;  // First source vertex at each welded position
+			std::vector<uint32_t> positionOf; // Welded position of each source vertex
+			std::vector<uint32_t> wedgeOf;    // First source vertex with the same position, texcoord and normal
+			std::vector<uint32_t> remap;      // Where each position collapsed to, itself while alive
+			std::vector<quadric> quadrics;
+			std::vector<uint32_t> corners;    // Wedge of each triangle corner, a source vertex
+			std::vector<wedge_move> wedgeMoves; // Scratch for matchWedges
+			double texcoordScale = 0.0;
+			double maxError = 0.0;
+			double errorLimit = 0.0;
+		};
+	}
+}
@@ -0,0 +1,419 @@
+// Texture half of the asset cooker: mip chains built on the CPU and block
+// compression to BC1/BC3, written in the format from texture_format.hpp.
+// Nothing here touches a GPU so textures cook on any build machine.
+#pragma once
+
+#include <texture_format.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace hsc {
+	namespace assets {
+		struct rgba_image {
+			uint32_t width = 0;
+			uint32_t height = 0;
+			std::vector<uint8_t> pixels; // 4 bytes a pixel, rows top to bottom
+		};
+
+		// The textures are sRGB, so mips average in linear light or every level
+		// comes out darker than the one above it
+		class srgb_table {
+		public:
+			srgb_table() {
+				for (int i = 0; i < 256; i++) {
+					float c = float(i) / 255.0f;
+					toLinearTable[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+				}
+			}
+
+			float toLinear(uint8_t value) const {
+				return toLinearTable[value];
+			}
+
+			static uint8_t fromLinear(float value) {
+				value = std::min(std::max(value, 0.0f), 1.0f);
+				float c = value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+				return uint8_t(c * 255.0f + 0.5f);
+			}
+
+		private:
+			float toLinearTable[256];
+		};
+
+		// Halves the image with a 2x2 box filter, an odd last row or column
+		// is folded into its neighbour
+		inline rgba_image downsample(const rgba_image& source, const srgb_table& srgb) {
+			rgba_image out;
+			out.width = std::max(1u, source.width / 2);
+			out.height = std::max(1u, source.height / 2);
+			out.pixels.resize(size_t(out.width) * out.height * 4);
+			for (uint32_t y = 0; y < out.height; y++) {
+				for (uint32_t x = 0; x < out.width; x++) {
+					uint32_t x0 = std::min(x * 2, source.width - 1), x1 = std::min(x * 2 + 1, source.width - 1);
+					uint32_t y0 = std::min(y * 2, source.height - 1), y1 = std::min(y * 2 + 1, source.height - 1);
+					const uint8_t* taps[4] = {
+						&source.pixels[(size_t(y0) * source.width + x0) * 4], &source.pixels[(size_t(y0) * source.width + x1) * 4],
+						&source.pixels[(size_t(y1) * source.width + x0) * 4], &source.pixels[(size_t(y1) * source.width + x1) * 4]
+					};
+					uint8_t* target = &out.pixels[(size_t(y) * out.width + x) * 4];
+					for (int c = 0; c < 3; c++) {
+						float sum = 0.0f;
+						for (const uint8_t* tap : taps) sum += srgb.toLinear(tap[c]);
+						target[c] = srgb_table::fromLinear(sum * 0.25f);
+					}
+					int alpha = 0;
+					for (const uint8_t* tap : taps) alpha += tap[3];
+					target[3] = uint8_t((alpha + 2) / 4);
+				}
+			}
+			return out;
+		}
+
+		// Level 0 and every level below it down to 1x1, whatever the shape.
+		// Levels that aren't whole 4x4 blocks are padded out to them when
+		// encoded, the loader decides which of them the GPU can take.
+		inline std::vector<rgba_image> buildMipChain(const rgba_image& image) {
+			srgb_table srgb;
+			std::vector<rgba_image> levels = { image };
+			while (levels.size() < max_texture_levels && (levels.back().width > 1 || levels.back().height > 1)) {
+				levels.push_back(downsample(levels.back(), srgb));
+			}
+			return levels;
+		}
+
+		// BC1 colour blocks: two RGB565 endpoints and 2 bit indices into the
+		// palette of the endpoints and two thirds between them
+		class block_encoder {
+		public:
+			// Encodes a 4x4 block of RGBA pixels, 8 bytes out
+			static void encodeColor(const uint8_t block[16][4], uint8_t* out) {
+				float mean[3] = { 0, 0, 0 };
+				for (int i = 0; i < 16; i++) {
+					for (int c = 0; c < 3; c++) mean[c] += block[i][c] / 16.0f;
+				}
+				float covariance[6] = { 0, 0, 0, 0, 0, 0 };
+				for (int i = 0; i < 16; i++) {
+					float d[3] = { block[i][0] - mean[0], block[i][1] - mean[1], block[i][2] - mean[2] };
+					covariance[0] += d[0] * d[0]; covariance[1] += d[0] * d[1]; covariance[2] += d[0] * d[2];
+					covariance[3] += d[1] * d[1]; covariance[4] += d[1] * d[2]; covariance[5] += d[2] * d[2];
+				}
+				// Principal axis by power iteration, the colours mostly lie along it
+				float axis[3] = { 1.0f, 1.0f, 1.0f };
+				for (int iteration = 0; iteration < 4; iteration++) {
+					float next[3] = {
+						covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+						covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+						covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]
+					};
+					float length = std::max({ std::fabs(next[0]), std::fabs(next[1]), std::fabs(next[2]) });
+					if (length < 1e-6f) break;
+					for (int c = 0; c < 3; c++) axis[c] = next[c] / length;
+				}
+
+				float low = 1e9f, high = -1e9f;
+				for (int i = 0; i < 16; i++) {
+					float t = (block[i][0] - mean[0]) * axis[0] + (block[i][1] - mean[1]) * axis[1] + (block[i][2] - mean[2]) * axis[2];
+					low = std::min(low, t);
+					high = std::max(high, t);
+				}
+				float axisLength = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+				float ends[2][3];
+				for (int c = 0; c < 3; c++) {
+					// Inset a little, the extremes are rarely worth a palette entry each
+					float inset = (high - low) / 16.0f;
+					ends[0][c] = mean[c] + axis[c] * (high - inset) / std::max(axisLength, 1e-6f);
+					ends[1][c] = mean[c] + axis[c] * (low + inset) / std::max(axisLength, 1e-6f);
+				}
+
+				uint16_t c0 = pack565(ends[0]), c1 = pack565(ends[1]);
+				uint32_t indices = 0;
+				float error = fitIndices(block, c0, c1, indices);
+				// One least squares pass, new endpoints for the indices chosen
+				uint16_t r0, r1;
+				if (refine(block, indices, r0, r1)) {
+					uint32_t refinedIndices;
+					float refinedError = fitIndices(block, r0, r1, refinedIndices);
+					if (refinedError < error) {
+						c0 = r0;
+						c1 = r1;
+						indices = refinedIndices;
+					}
+				}
+				write(out, c0, c1, indices);
+			}
+
+			// 8 byte BC3 alpha block: two endpoints, 3 bit indices into them and
+			// six values between
+			static void encodeAlpha(const uint8_t block[16][4], uint8_t* out) {
+				uint8_t low = 255, high = 0;
+				for (int i = 0; i < 16; i++) {
+					low = std::min(low, block[i][3]);
+					high = std::max(high, block[i][3]);
+				}
+				out[0] = high;
+				out[1] = low;
+				uint64_t bits = 0;
+				if (high > low) {
+					int palette[8];
+					alphaPalette(high, low, palette);
+					for (int i = 0; i < 16; i++) {
+						int best = 0;
+						for (int k = 1; k < 8; k++) {
+							if (std::abs(palette[k] - block[i][3]) < std::abs(palette[best] - block[i][3])) best = k;
+						}
+						bits |= uint64_t(best) << (3 * i);
+					}
+				}
+				for (int b = 0; b < 6; b++) out[2 + b] = uint8_t(bits >> (8 * b));
+			}
+
+			// Decoders, the cooker checks what it wrote against the source
+			static void decodeColor(const uint8_t* in, uint8_t block[16][4]) {
+				uint16_t c0 = uint16_t(in[0] | (in[1] << 8)), c1 = uint16_t(in[2] | (in[3] << 8));
+				uint32_t indices = uint32_t(in[4]) | (uint32_t(in[5]) << 8) | (uint32_t(in[6]) << 16) | (uint32_t(in[7]) << 24);
+				int palette[4][3];
+				makePalette(c0, c1, palette);
+				for (int i = 0; i < 16; i++) {
+					int k = (indices >> (2 * i)) & 3;
+					for (int c = 0; c < 3; c++) block[i][c] = uint8_t(palette[k][c]);
+					block[i][3] = 255;
+				}
+			}
+
+			static void decodeAlpha(const uint8_t* in, uint8_t block[16][4]) {
+				int palette[8];
+				alphaPalette(in[0], in[1], palette);
+				uint64_t bits = 0;
+				for (int b = 0; b < 6; b++) bits |= uint64_t(in[2 + b]) << (8 * b);
+				for (int i = 0; i < 16; i++) block[i][3] = uint8_t(palette[(bits >> (3 * i)) & 7]);
+			}
+
+		private:
+			static uint16_t pack565(const float color[3]) {
+				auto channel = [](float value, int maximum) {
+					return uint16_t(std::min(std::max(int(value * maximum / 255.0f + 0.5f), 0), maximum));
+				};
+				return uint16_t((channel(color[0], 31) << 11) | (channel(color[1], 63) << 5) | channel(color[2], 31));
+			}
+
+			static void unpack565(uint16_t packed, int color[3]) {
+				int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+				color[0] = (r << 3) | (r >> 2);
+				color[1] = (g << 2) | (g >> 4);
+				color[2] = (b << 3) | (b >> 2);
+			}
+
+			// Always the four colour palette, write() orders the endpoints so a
+			// decoder reads it that way too
+			static void makePalette(uint16_t c0, uint16_t c1, int palette[4][3]) {
+				unpack565(c0, palette[0]);
+				unpack565(c1, palette[1]);
+				for (int c = 0; c < 3; c++) {
+					palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+					palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+				}
+			}
+
+			static void alphaPalette(int a0, int a1, int palette[8]) {
+				palette[0] = a0;
+				palette[1] = a1;
+				if (a0 > a1) {
+					for (int k = 1; k < 7; k++) palette[k + 1] = ((7 - k) * a0 + k * a1) / 7;
+				}
+				else {
+					for (int k = 1; k < 5; k++) palette[k + 1] = ((5 - k) * a0 + k * a1) / 5;
+					palette[6] = 0;
+					palette[7] = 255;
+				}
+			}
+
+			static float fitIndices(const uint8_t block[16][4], uint16_t c0, uint16_t c1, uint32_t& indices) {
+				int palette[4][3];
+				makePalette(c0, c1, palette);
+				indices = 0;
+				float total = 0.0f;
+				for (int i = 0; i < 16; i++) {
+					int best = 0, bestError = INT32_MAX;
+					for (int k = 0; k < 4; k++) {
+						int dr = palette[k][0] - block[i][0], dg = palette[k][1] - block[i][1], db = palette[k][2] - block[i][2];
+						int error = dr * dr + dg * dg + db * db;
+						if (error < bestError) {
+							bestError = error;
+							best = k;
+						}
+					}
+					indices |= uint32_t(best) << (2 * i);
+					total += float(bestError);
+				}
+				return total;
+			}
+
+			// Endpoints minimising the squared error for fixed indices
+			static bool refine(const uint8_t block[16][4], uint32_t indices, uint16_t& c0, uint16_t& c1) {
+				static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+				float aa = 0, ab = 0, bb = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+				for (int i = 0; i < 16; i++) {
+					float a = weights[(indices >> (2 * i)) & 3], b = 1.0f - a;
+					aa += a * a;
+					ab += a * b;
+					bb += b * b;
+					for (int c = 0; c < 3; c++) {
+						ax[c] += a * block[i][c];
+						bx[c] += b * block[i][c];
+					}
+				}
+				float determinant = aa * bb - ab * ab;
+				if (std::fabs(determinant) < 1e-6f) return false;
+				float e0[3], e1[3];
+				for (int c = 0; c < 3; c++) {
+					e0[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+					e1[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+				}
+				c0 = pack565(e0);
+				c1 = pack565(e1);
+				return true;
+			}
+
+			// The first endpoint has to be the larger for the four colour
+			// palette, swapping them swaps indices 0 and 1, and 2 and 3
+			static void write(uint8_t* out, uint16_t c0, uint16_t c1, uint32_t indices) {
+				if (c0 < c1) {
+					std::swap(c0, c1);
+					indices ^= 0x55555555;
+				}
+				else if (c0 == c1) indices = 0;
+				out[0] = uint8_t(c0);
+				out[1] = uint8_t(c0 >> 8);
+				out[2] = uint8_t(c1);
+				out[3] = uint8_t(c1 >> 8);
+				for (int b = 0; b < 4; b++) out[4 + b] = uint8_t(indices >> (8 * b));
+			}
+		};
+
+		// Gathers the 4x4 block at bx, by, repeating the edge past the image
+		inline void readBlock(const rgba_image& image, uint32_t bx, uint32_t by, uint8_t block[16][4]) {
+			for (uint32_t y = 0; y < 4; y++) {
+				for (uint32_t x = 0; x < 4; x++) {
+					uint32_t px = std::min(bx * 4 + x, image.width - 1), py = std::min(by * 4 + y, image.height - 1);
+					std::memcpy(block[y * 4 + x], &image.pixels[(size_t(py) * image.width + px) * 4], 4);
+				}
+			}
+		}
+
+		inline std::vector<uint8_t> encodeLevel(const rgba_image& image, texture_encoding encoding) {
+			if (encoding == texture_encoding::rgba8) return image.pixels;
+			const size_t blockSize = encoding == texture_encoding::bc1 ? 8 : 16;
+			const uint32_t blocksWide = (image.width + 3) / 4, blocksHigh = (image.height + 3) / 4;
+			std::vector<uint8_t> out(size_t(blocksWide) * blocksHigh * blockSize);
+			uint8_t block[16][4];
+			for (uint32_t by = 0; by < blocksHigh; by++) {
+				for (uint32_t bx = 0; bx < blocksWide; bx++) {
+					uint8_t* target = &out[(size_t(by) * blocksWide + bx) * blockSize];
+					readBlock(image, bx, by, block);
+					if (encoding == texture_encoding::bc3) {
+						block_encoder::encodeAlpha(block, target);
+						target += 8;
+					}
+					block_encoder::encodeColor(block, target);
+				}
+			}
+			return out;
+		}
+
+		inline rgba_image decodeLevel(const uint8_t* data, uint32_t width, uint32_t height, texture_encoding encoding) {
+			rgba_image image;
+			image.width = width;
+			image.height = height;
+			if (encoding == texture_encoding::rgba8) {
+				image.pixels.assign(data, data + size_t(width) * height * 4);
+				return image;
+			}
+			image.pixels.resize(size_t(width) * height * 4);
+			const size_t blockSize = encoding == texture_encoding::bc1 ? 8 : 16;
+			const uint32_t blocksWide = (width + 3) / 4, blocksHigh = (height + 3) / 4;
+			uint8_t block[16][4];
+			for (uint32_t by = 0; by < blocksHigh; by++) {
+				for (uint32_t bx = 0; bx < blocksWide; bx++) {
+					const uint8_t* source = data + (size_t(by) * blocksWide + bx) * blockSize;
+					if (encoding == texture_encoding::bc3) {
+						block_encoder::decodeColor(source + 8, block);
+						block_encoder::decodeAlpha(source, block);
+					}
+					else block_encoder::decodeColor(source, block);
+					for (uint32_t y = 0; y < 4 && by * 4 + y < height; y++) {
+						for (uint32_t x = 0; x < 4 && bx * 4 + x < width; x++) {
+							std::memcpy(&image.pixels[(size_t(by * 4 + y) * width + bx * 4 + x) * 4], block[y * 4 + x], 4);
+						}
+					}
+				}
+			}
+			return image;
+		}
+
+		// A texture's whole chain, encoded and ready to write
+		struct cooked_texture {
+			texture_encoding encoding = texture_encoding::rgba8;
+			std::vector<rgba_image> chain;
+			std::vector<std::vector<uint8_t>> levels;
+		};
+
+		inline cooked_texture cookImage(const rgba_image& image, texture_encoding encoding) {
+			cooked_texture out;
+			out.encoding = encoding;
+			out.chain = buildMipChain(image);
+			for (const rgba_image& level : out.chain) out.levels.push_back(encodeLevel(level, encoding));
+			return out;
+		}
+
+		// The file's bytes. Level data goes smallest first, a loader reading
+		// the file in order has a usable texture after the first few hundred
+		// bytes.
+		inline std::vector<uint8_t> serializeTexture(const cooked_texture& texture) {
+			texture_file_header header = {};
+			header.magic = texture_magic;
+			header.version = texture_version;
+			header.encoding = texture.encoding;
+			header.width = texture.chain[0].width;
+			header.height = texture.chain[0].height;
+			header.levelCount = uint32_t(texture.levels.size());
+
+			std::vector<texture_level> records(texture.levels.size());
+			uint64_t offset = sizeof(texture_file_header) + records.size() * sizeof(texture_level);
+			for (size_t l = texture.levels.size(); l-- > 0;) {
+				texture_level& record = records[l];
+				record.offset = alignUp(offset);
+				record.size = uint32_t(texture.levels[l].size());
+				record.width = texture.chain[l].width;
+				record.height = texture.chain[l].height;
+				offset = record.offset + record.size;
+			}
+			header.fileSize = offset;
+
+			std::vector<uint8_t> bytes(size_t(header.fileSize), 0);
+			std::memcpy(bytes.data(), &header, sizeof(header));
+			std::memcpy(bytes.data() + sizeof(header), records.data(), records.size() * sizeof(texture_level));
+			for (size_t l = 0; l < texture.levels.size(); l++) {
+				std::memcpy(bytes.data() + records[l].offset, texture.levels[l].data(), texture.levels[l].size());
+			}
+			return bytes;
+		}
+
+		// Peak signal to noise ratio over RGB (and alpha when it counts), the
+		// usual way to judge a block encoder
+		inline double psnr(const rgba_image& a, const rgba_image& b, bool alpha) {
+			double squared = 0.0;
+			size_t samples = 0;
+			for (size_t i = 0; i < a.pixels.size(); i++) {
+				if (i % 4 == 3 && !alpha) continue;
+				double d = double(a.pixels[i]) - double(b.pixels[i]);
+				squared += d * d;
+				samples++;
+			}
+			if (squared == 0.0) return 99.0;
+			return 10.0 * std::log10(255.0 * 255.0 / (squared / double(samples)));
+		}
+	}
+}